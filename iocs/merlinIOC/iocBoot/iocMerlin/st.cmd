@@ -60,9 +60,13 @@ drvAsynIPPortConfigure($(DATA_PORT), $(MERLIN_IP):$(DATA_IPPORT), 0, 0, 0)
 #                                    allowed to allocate. Set this to 0 to allow an unlimited amount of memory.
 #              priority,           # The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
 #              stackSize,          # The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+#              decodeThreads,      # The number of threads converting frames while the next are received.
+#                                    0 receives, converts and does callbacks in a single thread.
+#              dataSocket)         # Optional. host:port[,rcvbuf=<bytes>][,busypoll=<us>] to read the data channel
+#                                    from a socket of the driver's own instead of LabviewDataPort.
 
 # This is for a Merlin quad
-merlinDetectorConfig("$(PORT)", $(COMMAND_PORT), $(DATA_PORT), $(XSIZE), $(YSIZE), $(MODEL), 0, 0, 0, 0)
+merlinDetectorConfig("$(PORT)", $(COMMAND_PORT), $(DATA_PORT), $(XSIZE), $(YSIZE), $(MODEL), 0, 0, 0, 0, 2)
 
 asynSetTraceIOMask("$(PORT)",0,2)
 #asynSetTraceMask("$(PORT)",0,255)
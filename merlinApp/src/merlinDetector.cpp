@@ -21,6 +21,7 @@
 #include <math.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 
 // #include <epicsTime.h>
 #include <epicsThread.h>
@@ -32,306 +33,1668 @@
 #include <cantProceed.h>
 #include <iocsh.h>
 #include <epicsExport.h>
+#include <initHooks.h>
 
 #include <asynOctetSyncIO.h>
 
 #include "ADDriver.h"
 
 #include "mpxConnection.h"
+#include "mpxDecode.h"
+#include "mpxRawDecode.h"
+#include "mpxFrameHeader.h"
+#include "mpxBadPixel.h"
+#include "mpxGeometry.h"
 #include "merlinDetector.h"
 
 #define MAX(a,b) a>b ? a : b
 #define MIN(a,b) a<b ? a : b
 
-/** This thread controls acquisition, reads image files to get the image data, and
- * does the callbacks to send it to higher layers
+static void merlinDecodeTaskC(void *drvPvt);
+static void merlinCallbackTaskC(void *drvPvt);
+static void merlinCommandTaskC(void *drvPvt);
+
+/* every driver, for merlinInitHook */
+static merlinDetector *firstDetector = NULL;
+
+/** This thread controls acquisition, it is the receive stage of the acquisition
+ * pipeline. It reads data frames from the data channel into free frames and
+ * hands them on to the decode threads in turn, or when there are no decode
+ * threads it decodes each frame and does the callbacks itself.
  * It is totally decoupled from the command thread and simply waits for data
  * frames to be sent on the data channel (TCP) regardless of the state in the command
  * thread and TCP channel */
 void merlinDetector::merlinTask()
 {
     int status = asynSuccess;
+    const char *functionName = "merlinTask";
+    mpxFrame *frame = NULL;
+    int nextWorker = 0;
+    epicsUInt64 waitStart;
+    epicsUInt64 receiveStart;
+    int reportedResyncs = 0;
+    double reportedDiscarded = 0;
+    int generation;
+
+    // do not enter this thread until the IOC is initialised. This is because we are getting blocks of
+    // data on the data channel at startup after we have had a buffer overrun
+    epicsEventWait(startupEvent);
+
+    this->lock();
+    generation = connectionGeneration;
+    this->unlock();
+
+    /* Loop forever */
+    while (1)
+    {
+        // a frame that was not passed on is reused for the next one
+        if (frame == NULL)
+        {
+            frame = getFreeFrame();
+        }
+
+        // wait for the next data frame packet - this function spends most of its time here
+        waitStart = mpxTimingNow();
+        status = dataConnection->mpxReadHeader(&frame->bodySize, 10);
+        receiveStart = mpxTimingNow();
+
+        /* If there was an error go round again */
+        if (status)
+        {
+            // timeouts are expected, and after a bad header the next read
+            // resyncs to the following MPX prefix
+            if (dataConnection->mpxReadLost())
+            {
+                asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                        "%s:%s: error in Labview data channel response, status=%d\n",
+                        driverName, functionName, status);
+                // wait for the command thread to remake the connection,
+                // then start again from whatever the new one brings
+                this->lock();
+                connectionLost("Error in Labview data channel response",
+                        generation, 1);
+                while (connectionState != MPXConnected)
+                {
+                    this->unlock();
+                    epicsEventWait(dataReadyEvent);
+                    this->lock();
+                }
+                generation = connectionGeneration;
+                this->unlock();
+                dataConnection->mpxFlush();
+            }
+            continue;
+        }
+
+        status = receiveFrame(frame);
+        frame->stageTime[mpxStageWait] = receiveStart - waitStart;
+        frame->stageTime[mpxStageReceive] = mpxTimingNow() - receiveStart
+                - frame->stageTime[mpxStageHeader];
+        if (status)
+        {
+            if (frame->error != NULL)
+            {
+                this->lock();
+                setStringParam(ADStatusMessage, frame->error);
+                callParamCallbacks();
+                this->unlock();
+            }
+            continue;
+        }
+
+        // losses on the data channel go with the next frame to be published
+        frame->resyncs = dataConnection->resyncCount - reportedResyncs;
+        frame->discardedBytes = dataConnection->discardedBytes
+                - reportedDiscarded;
+        reportedResyncs = dataConnection->resyncCount;
+        reportedDiscarded = dataConnection->discardedBytes;
+
+        if (frame->record)
+        {
+            recordFrame(frame);
+        }
+
+        if (numDecodeThreads == 0)
+        {
+            decodeFrame(frame);
+            this->lock();
+            publishFrame(frame);
+            this->unlock();
+            releaseFrame(frame);
+        }
+        else
+        {
+            epicsRingPointerPush(decodeWorkers[nextWorker].input, frame);
+            epicsEventSignal(decodeWorkers[nextWorker].inputEvent);
+            nextWorker = (nextWorker + 1) % numDecodeThreads;
+        }
+        frame = NULL;
+    }
+}
+
+/** The decode stage of the acquisition pipeline, one of these threads runs
+ * for each decode thread given to merlinDetectorConfig.
+ * Converts the frames from its input queue and passes them on to the
+ * callback thread in the order they arrived.
+ */
+void merlinDetector::merlinDecodeTask(mpxDecodeWorker *worker)
+{
+    mpxFrame *frame;
+
+    while (1)
+    {
+        frame = (mpxFrame *) epicsRingPointerPop(worker->input);
+        if (frame == NULL)
+        {
+            epicsEventWait(worker->inputEvent);
+            continue;
+        }
+
+        decodeFrame(frame);
+
+        epicsRingPointerPush(worker->output, frame);
+        epicsEventSignal(decodedEvent);
+    }
+}
+
+/** The callback stage of the acquisition pipeline.
+ * Takes decoded frames from the decode threads in the same turn that
+ * merlinTask handed them out so that the NDArrays are passed to the plugins
+ * in frame order, then returns the frames to merlinTask.
+ */
+void merlinDetector::merlinCallbackTask()
+{
+    mpxFrame *frame;
+    int nextWorker = 0;
+
+    while (1)
+    {
+        frame = (mpxFrame *) epicsRingPointerPop(
+                decodeWorkers[nextWorker].output);
+        if (frame == NULL)
+        {
+            epicsEventWait(decodedEvent);
+            continue;
+        }
+        nextWorker = (nextWorker + 1) % numDecodeThreads;
+
+        this->lock();
+        publishFrame(frame);
+        this->unlock();
+
+        releaseFrame(frame);
+    }
+}
+
+/** Allocates the frames and queues for the acquisition pipeline and starts
+ * the decode and callback threads.
+ * \param[in] decodeThreads number of decode threads, 0 to decode and do the
+ * callbacks in merlinTask
+ */
+asynStatus merlinDetector::createPipeline(int decodeThreads)
+{
+    const char *functionName = "createPipeline";
+    char threadName[40];
+    int i;
+
+    // allocate buffers for reading in images from labview over network
+    switch (detType)
+    {
+    case UomXBPM:
+        frameBufferSize = MAX_BUFF_UOM;
+        break;
+    case Merlin:
+    case MerlinXBPM:
+        frameBufferSize = MPX_IMG_FRAME_LEN24;
+        break;
+    case MerlinQuad:
+        frameBufferSize = MAX_BUFF_MERLIN_QUAD;
+        break;
+    default:
+        frameBufferSize = MAX_BUFF_UOM;
+        break;
+    }
+
+    numDecodeThreads = decodeThreads < 0 ? 0 : decodeThreads;
+
+    // each decode thread can have a frame waiting and one being decoded,
+    // merlinTask and the callback thread each need one more
+    numFrames = numDecodeThreads == 0 ? 1 : 2 * numDecodeThreads + 2;
+    frames = (mpxFrame *) calloc(numFrames, sizeof(mpxFrame));
+    freeFrames = epicsRingPointerCreate(numFrames);
+    freeFrameEvent = epicsEventMustCreate(epicsEventEmpty);
+    decodedEvent = epicsEventMustCreate(epicsEventEmpty);
+
+    for (i = 0; i < numFrames; i++)
+    {
+        // one extra byte so that a frame can be terminated for parsing
+        frames[i].buffer = (char *) calloc(frameBufferSize + 1, 1);
+        epicsRingPointerPush(freeFrames, &frames[i]);
+    }
+
+    decodeWorkers = NULL;
+    if (numDecodeThreads == 0)
+    {
+        return asynSuccess;
+    }
+
+    decodeWorkers = (mpxDecodeWorker *) calloc(numDecodeThreads,
+            sizeof(mpxDecodeWorker));
+    for (i = 0; i < numDecodeThreads; i++)
+    {
+        decodeWorkers[i].pDetector = this;
+        decodeWorkers[i].input = epicsRingPointerCreate(numFrames);
+        decodeWorkers[i].output = epicsRingPointerCreate(numFrames);
+        decodeWorkers[i].inputEvent = epicsEventMustCreate(epicsEventEmpty);
+
+        epicsSnprintf(threadName, sizeof(threadName), "merlinDecode%d", i);
+        if (epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackMedium),
+                (EPICSTHREADFUNC) merlinDecodeTaskC, &decodeWorkers[i]) == NULL)
+        {
+            printf("%s:%s epicsThreadCreate failure for decode task\n",
+                    driverName, functionName);
+            return asynError;
+        }
+    }
+
+    if (epicsThreadCreate("merlinCallbackTask", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC) merlinCallbackTaskC, this) == NULL)
+    {
+        printf("%s:%s epicsThreadCreate failure for callback task\n",
+                driverName, functionName);
+        return asynError;
+    }
+
+    return asynSuccess;
+}
+
+/** Waits for a frame to be returned by the callback stage */
+mpxFrame* merlinDetector::getFreeFrame()
+{
+    mpxFrame *frame;
+
+    while ((frame = (mpxFrame *) epicsRingPointerPop(freeFrames)) == NULL)
+    {
+        epicsEventWait(freeFrameEvent);
+    }
+    return frame;
+}
+
+/** Returns a frame to merlinTask once its callbacks are complete */
+void merlinDetector::releaseFrame(mpxFrame *frame)
+{
+    epicsRingPointerPush(freeFrames, frame);
+    epicsEventSignal(freeFrameEvent);
+}
+
+/** Receives the body of a data frame once mpxReadHeader has returned its size.
+ * MQ1 frames are passed to receiveMqFrame when the pixel data can go directly
+ * into an NDArray, everything else is read into the frame buffer.
+ * Called without the driver lock.
+ * Returns asynSuccess if the frame should be passed on to be decoded and
+ * published, otherwise the frame has been consumed from the data channel
+ * and frame->error holds the status message (if any).
+ */
+asynStatus merlinDetector::receiveFrame(mpxFrame *frame)
+{
+    const char *functionName = "receiveFrame";
+    asynStatus status;
+    int zeroCopy;
+    int packedOutput;
+    int counterDepth;
+    int recordEnable;
+    int recordPublish;
+    int flatFieldEnable;
+    int flatFieldValid;
+    int badPixelEnable;
+    int chipAssembly;
+
+    frame->pImage = NULL;
+    frame->error = NULL;
+    frame->zeroCopy = 0;
+    frame->badPixelTime = 0;
+    memset(frame->stageTime, 0, sizeof(frame->stageTime));
+    frame->frameNumber = -1;
+    frame->resyncs = 0;
+    frame->discardedBytes = 0;
+    frame->receiveTime = dataConnection->mpxReceiveTime();
+    epicsTimeGetCurrent(&frame->startTime);
+
+    // read enough of the body to identify the frame type
+    frame->received = MIN(frame->bodySize, MPX_DATA_PREFIX_LEN);
+    status = dataConnection->mpxReadBody(frame->buffer, frame->received, 10);
+    if (status != asynSuccess)
+    {
+        frame->error = "Error in Labview data channel response";
+        return status;
+    }
+    frame->buffer[frame->received] = 0;
+
+    frame->header = dataConnection->parseDataHeader(frame->buffer);
+    if (frame->header == MPXQuadDataHeader)
+    {
+        frame->frameNumber = mqFrameNumber(frame->buffer, frame->received);
+    }
+
+    this->lock();
+    getIntegerParam(NDArrayCallbacks, &frame->arrayCallbacks);
+    getIntegerParam(merlinZeroCopy, &zeroCopy);
+    getIntegerParam(merlinPackedOutput, &packedOutput);
+    getIntegerParam(merlinCounterDepth, &counterDepth);
+    getIntegerParam(merlinRecordEnable, &recordEnable);
+    getIntegerParam(merlinRecordPublish, &recordPublish);
+    getIntegerParam(merlinFlatFieldEnable, &flatFieldEnable);
+    getIntegerParam(merlinFlatFieldValid, &flatFieldValid);
+    getIntegerParam(merlinFlatFieldFloat, &frame->flatFieldFloat);
+    // frames being captured for a new flat field are not corrected
+    frame->flatField = flatFieldEnable && flatFieldValid
+            && flatCaptureRemaining == 0 ? flatFactors[flatCurrent] : NULL;
+    // the frame holds a reference to the bad pixel map until it is published
+    // (a frame that was not passed on still has one from last time)
+    getIntegerParam(merlinBadPixelEnable, &badPixelEnable);
+    getIntegerParam(merlinChipAssembly, &chipAssembly);
+    getIntegerParam(merlinChipGap, &frame->chipGap);
+    // flat field frames are captured in detector pixels
+    if (!chipAssembly || flatCaptureRemaining > 0 || frame->chipGap < 0)
+    {
+        frame->chipGap = 0;
+    }
+    releaseBadPixels(frame);
+    if (badPixelEnable && badPixelMap != NULL && badPixelMap->count > 0)
+    {
+        frame->badPixels = badPixelMap;
+        badPixelMap->users++;
+    }
+    this->unlock();
+
+    // recorded frames are always read whole into the receive buffer, the
+    // NDArrays are optional while recording
+    frame->record = recordEnable && recorder != NULL;
+    if (frame->record && !recordPublish)
+    {
+        frame->arrayCallbacks = 0;
+    }
+
+    // a bitmap is made while copying out of the receive buffer
+    frame->packed = packedOutput && counterDepth == 1;
+
+    if (zeroCopy && frame->arrayCallbacks && !frame->packed && !frame->record
+            && frame->header == MPXQuadDataHeader)
+    {
+        // read the rest of the frame with the pixel data going straight
+        // into an NDArray from the pool
+        frame->zeroCopy = 1;
+        return receiveMqFrame(frame);
+    }
+
+    if (frame->bodySize >= frameBufferSize)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame size %d not supported\n", driverName,
+                functionName, frame->bodySize);
+        dataConnection->mpxDiscardBody(frame->bodySize - frame->received, 10);
+        return asynError;
+    }
+
+    // read the rest of the frame into the receive buffer
+    status = dataConnection->mpxReadBody(frame->buffer + frame->received,
+            frame->bodySize - frame->received, 10);
+    if (status != asynSuccess)
+    {
+        frame->error = "Error in Labview data channel response";
+        return status;
+    }
+    frame->received = frame->bodySize;
+    frame->buffer[frame->received] = 0;
+
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+            "\nReceived image frame of %d bytes\n", frame->bodySize);
+
+    if (pasynTrace->getTraceMask((pasynUserSelf)) & (ASYN_TRACE_MPX_VERBOSE))
+    {
+        dataConnection->dumpData(frame->buffer, frame->received);
+    }
+
+    return asynSuccess;
+}
+
+/** The decode stage for each frame, converts the pixel data, applies the
+ * flat field correction and bad pixel map and assembles the chips.
+ * Runs on a decode thread (or merlinTask) without the driver lock so it must
+ * not touch the parameter library, failures are reported in frame->error.
+ */
+void merlinDetector::decodeFrame(mpxFrame *frame)
+{
+    epicsUInt64 start = mpxTimingNow();
+    epicsUInt64 headerTime = frame->stageTime[mpxStageHeader];
+    epicsUInt64 converted;
+
+    convertFrame(frame);
+    converted = mpxTimingNow();
+    frame->stageTime[mpxStageConvert] = converted - start
+            - (frame->stageTime[mpxStageHeader] - headerTime);
+
+    if (frame->pImage != NULL && frame->flatField != NULL
+            && frame->error == NULL)
+    {
+        applyFlatField(frame);
+    }
+
+    // after the flat field so that dead pixels (factor 0) are filled in from
+    // corrected neighbours
+    if (frame->pImage != NULL && frame->badPixels != NULL
+            && frame->error == NULL)
+    {
+        applyBadPixels(frame);
+    }
+
+    // last as the corrections work in detector pixels
+    if (frame->pImage != NULL && frame->chipGap > 0 && frame->error == NULL)
+    {
+        assembleChips(frame);
+    }
+    frame->stageTime[mpxStageCorrect] = mpxTimingNow() - converted;
+}
+
+/** Converts the pixel data of a received frame into an NDArray,
+ * switching to little endien and Inverting in the Y axis.
+ * Called from decodeFrame.
+ */
+void merlinDetector::convertFrame(mpxFrame *frame)
+{
+    const char *functionName = "convertFrame";
+    NDArray *pImage = frame->pImage;
+    MqFrameHeader *pHeader = &frame->mqHeader;
+    size_t dims[2];
+    int pixelSize;
+    int offset;
+    epicsUInt64 start;
+    int decoded;
+
+    if (frame->header != MPXQuadDataHeader || !frame->arrayCallbacks
+            || frame->error != NULL)
+    {
+        return;
+    }
+
+    if (frame->zeroCopy)
+    {
+        // the frame was received straight into pImage by receiveMqFrame
+        dims[0] = pImage->dims[0].size;
+        dims[1] = pImage->dims[1].size;
+        switch (pImage->dataType)
+        {
+        case NDUInt8:
+            mpxInvertRows8(pImage->pData, pImage->pData, dims[0], dims[1]);
+            break;
+        case NDUInt16:
+            mpxInvertRows16(pImage->pData, pImage->pData, dims[0], dims[1],
+                    swapPixels);
+            break;
+        default:
+            mpxInvertRows32(pImage->pData, pImage->pData, dims[0], dims[1],
+                    swapPixels);
+            break;
+        }
+        return;
+    }
+
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+            "Creating a Quad Merlin Image NDArray\n");
+
+    // Decode the header and use the information to determine the
+    // size of the NDArray
+    start = mpxTimingNow();
+    decoded = mqDecodeHeader(frame->buffer, frame->received, pHeader);
+    frame->stageTime[mpxStageHeader] += mpxTimingNow() - start;
+    if (decoded != 0 || pHeader->dataOffset <= 0)
+    {
+        frame->error = "Error: invalid frame header";
+        return;
+    }
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX, "Image frame Header: %.*s\n\n",
+            pHeader->dataOffset, frame->buffer);
+
+    if (pHeader->pixelFormat == 'R')
+    {
+        frame->pImage = copyRawToNDArray(frame);
+        return;
+    }
+
+    dims[0] = pHeader->xSize;
+    dims[1] = pHeader->ySize;
+    pixelSize = pHeader->pixelDepth;
+    offset = pHeader->dataOffset;
+    if ((size_t) offset + dims[0] * dims[1] * (pixelSize / 8)
+            > (size_t) frame->received)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: %dx%d pixels of %d bits do not fit in frame of %d bytes\n",
+                driverName, functionName, (int) dims[0], (int) dims[1],
+                pixelSize, frame->received);
+        frame->error = "Error: frame size does not match header";
+        return;
+    }
+
+    if (pixelSize == 8 && frame->packed && dims[0] % 8 == 0)
+    {
+        pImage = copyToNDArrayPacked(dims, frame->buffer, offset);
+    }
+    else if (pixelSize == 8)
+    {
+        pImage = copyToNDArray8(dims, frame->buffer, offset);
+    }
+    else if (pixelSize == 16)
+    {
+        pImage = copyToNDArray16(dims, frame->buffer, offset);
+    }
+    else if (pixelSize == 32)
+    {
+        pImage = copyToNDArray32(dims, frame->buffer, offset);
+    }
+    else
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "Unsupported bit depth %d\n", pixelSize);
+        frame->error = "Error: Unsupported bit depth";
+        return;
+    }
+
+    if (pImage == NULL)
+    {
+        frame->error = "Error: run out of buffers in detector driver";
+    }
+    frame->pImage = pImage;
+}
+
+/** The final stage for each frame, updates the counters and acquisition
+ * state and passes the NDArray to the plugins.
+ * Called with the driver lock held, in frame order.
+ */
+void merlinDetector::publishFrame(mpxFrame *frame)
+{
+    const char *functionName = "publishFrame";
+    NDArray *pImage = frame->pImage;
+    merlinDataHeader header = frame->header;
     int imageCounter;      // number of ndarrays sent to plugins
     int numImagesCounter;  // number of images received
-    int counterDepth;
-    int imagSize;
-    NDArray * pImage;
-    epicsTimeStamp startTime;
-    const char *functionName = "merlinTask";
     size_t dims[2];
-    int arrayCallbacks;
-    int nread;
-    char *bigBuff;
-    char aquisitionHeader[MPX_ACQUISITION_HEADER_LEN + 1];
     int triggerMode;
-    NDAttributeList *imageAttr = new NDAttributeList();
+    int attributeTemplate;
+    int collected;
+    epicsUInt64 attributeStart;
+    epicsUInt64 callbackStart;
+    int framesLost = 0;
+    double receiveTime;
 
-    // do not enter this thread until the IOC is initialised. This is because we are getting blocks of
-    // data on the data channel at startup after we have had a buffer overrun
-    while (startingUp)
+    getIntegerParam(merlinAttributeTemplate, &attributeTemplate);
+
+    // frame numbers start again at 1 after each acquisition header
+    if (header == MPXAcquisitionHeader)
+    {
+        expectedFrame = 1;
+    }
+    else if (header == MPXQuadDataHeader)
+    {
+        framesLost = checkFrameNumber(frame);
+        // the exposure being grouped cannot be completed now
+        if (framesLost > 0 && counterGroup != NULL)
+        {
+            dropCounterGroup();
+        }
+    }
+    resyncCount += frame->resyncs;
+    discardedBytes += frame->discardedBytes;
+    setIntegerParam(merlinMissingFrames, missingFrames);
+    setIntegerParam(merlinDuplicateFrames, duplicateFrames);
+    setIntegerParam(merlinResyncCount, resyncCount);
+    setDoubleParam(merlinDiscardedBytes, discardedBytes);
+
+    // frames that are collected into a larger NDArray are not counted
+    // separately
+    collected = header == MPXQuadDataHeader
+            && (scanStacking || counterGrouping == MPXCounterStack);
+
+    if (header != MPXAcquisitionHeader)
+    {
+        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+        numImagesCounter++;
+        setIntegerParam(ADNumImagesCounter, numImagesCounter);
+        if (imagesRemaining > 0)
+            imagesRemaining--;
+
+        getIntegerParam(NDArrayCounter, &imageCounter);
+        if (!collected)
+        {
+            imageCounter++;
+            setIntegerParam(NDArrayCounter, imageCounter);
+        }
+    }
+
+    if (frame->error != NULL)
+    {
+        setStringParam(ADStatusMessage, frame->error);
+    }
+
+    if (frame->arrayCallbacks)
+    {
+        int idim;
+        attributeStart = mpxTimingNow();
+        getIntegerParam(ADMaxSizeX, &idim);
+        dims[0] = idim;
+        getIntegerParam(ADMaxSizeY, &idim);
+        dims[1] = idim;
+
+        if (header == MPXAcquisitionHeader)
+        {
+            // this is an acquisition header
+            strncpy(aquisitionHeader, frame->buffer,
+                    MPX_ACQUISITION_HEADER_LEN);
+            aquisitionHeader[MPX_ACQUISITION_HEADER_LEN] = 0;
+            templateValid = 0;
+        }
+        else if (header == MPXQuadDataHeader)
+        {
+            // the frame was converted by decodeFrame, the attributes are
+            // only made from the decoded header now it is being published
+            if (pImage != NULL && attributeTemplate)
+            {
+                applyAttributeTemplate(frame, pImage);
+            }
+            else if (pImage != NULL)
+            {
+                mqHeaderAttributes(&frame->mqHeader, pImage->pAttributeList);
+            }
+        }
+        else if (header == MPXProfileHeader)
+        {
+            int profileMask = 0;
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                    "Creating a Profile NDArray\n");
+
+//				dataConnection->parseDataFrame(imageAttr, bigBuff, header,
+//						&(dims[0]), &(dims[1]), &dummy2, &profileMask);
+            // TODO do profiles using 2.0 release of documentation
+            // TODO instead of above we should call parseMqDataFrame
+            // TODO in fact not sure we need a separate clause at this point.
+
+            if (profileMask
+                    != (MPXPROFILES_XPROFILE | MPXPROFILES_YPROFILE
+                            | MPXPROFILES_SUM))
+            {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: unsupported PROFILES mode %d\n", driverName,
+                        functionName, profileMask);
+            }
+            else
+            {
+                pImage = copyProfileToNDArray32(dims, frame->buffer,
+                        profileMask);
+            }
+        }
+        else
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "Unknown header type %d\n", header);
+        }
+
+        // for Data frames - complete the NDAttributes, pass the NDArray on
+        if (pImage != NULL
+                && (header == MPXProfileHeader || header == MPXQuadDataHeader))
+        {
+            // Put the frame number and time stamp into the buffer
+            pImage->uniqueId = imageCounter;
+            pImage->timeStamp = frame->startTime.secPastEpoch
+                    + frame->startTime.nsec / 1.e9;
+
+            // string attributes are global in HDF5 plugin so the most recent
+            // acquisition header is applied to all files. With the template
+            // the header is already there as separate HDR attributes
+            if (!attributeTemplate || header != MPXQuadDataHeader)
+            {
+                pImage->pAttributeList->add("Acquisition Header", "",
+                        NDAttrString, aquisitionHeader);
+            }
+            if (header == MPXQuadDataHeader)
+            {
+                pImage->pAttributeList->add("FramesLost",
+                        "Frames lost before this one", NDAttrInt32,
+                        &framesLost);
+            }
+            if (frame->receiveTime != 0)
+            {
+                receiveTime = frame->receiveTime / 1e9;
+                pImage->pAttributeList->add("ReceiveTime",
+                        "Kernel receive time, s since 1970", NDAttrFloat64,
+                        &receiveTime);
+            }
+
+            /* Get any attributes that have been defined for this driver */
+            this->getAttributes(pImage->pAttributeList);
+            callbackStart = mpxTimingNow();
+            frame->stageTime[mpxStageAttributes] = callbackStart
+                    - attributeStart;
+
+            // Call the NDArray callback
+            if (header == MPXQuadDataHeader && scanStacking)
+            {
+                // threshold scan steps go out together at the end of the
+                // scan, or on their own if they cannot be collected
+                if (addScanStep(frame, pImage) != 0)
+                {
+                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
+                }
+            }
+            else if (header == MPXQuadDataHeader
+                    && counterGrouping == MPXCounterStack)
+            {
+                // the counters of an exposure go out together
+                if (addCounterFrame(frame, pImage) != 0)
+                {
+                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
+                }
+            }
+            else if (header == MPXQuadDataHeader
+                    && counterGrouping == MPXCounterAddress)
+            {
+                // plugins pick the counter with their NDArrayAddress
+                doCallbacksGenericPointer(pImage, NDArrayData,
+                        counterSlot(frame));
+                counterPosition = (counterPosition + 1) % framesPerAcquire;
+            }
+            else if (header == MPXQuadDataHeader)
+            {
+                doCallbacksGenericPointer(pImage, NDArrayData, 0);
+            }
+            else
+            {
+                // address 1 on the port is used for profiles
+                // TODO use of port 1 is not working in NDPluginBase so
+                // currently reverting to use the same address
+                // (i.e. setting Merlin1:ROI:NDArrayAddress has no effect
+                doCallbacksGenericPointer(pImage, NDArrayData, 0);
+            }
+            frame->stageTime[mpxStageCallbacks] = mpxTimingNow()
+                    - callbackStart;
+        }
+    }
+
+    if (header == MPXQuadDataHeader && frame->error == NULL)
+    {
+        addFrameTiming(frame);
+    }
+
+    if (flatCaptureRemaining > 0 && pImage != NULL && frame->flatField == NULL
+            && header == MPXQuadDataHeader)
+    {
+        accumulateFlatField(pImage);
+    }
+
+    if (frame->badPixels != NULL)
+    {
+        setDoubleParam(merlinBadPixelTime, frame->badPixelTime * 1000.);
+        releaseBadPixels(frame);
+    }
+
+    /* Free the image buffer */
+    if (pImage != NULL)
+    {
+        pImage->release();
+    }
+    frame->pImage = NULL;
+
+    // If we are using SW triggers then reset the trigger to 0 when an image is
+    // received
+    getIntegerParam(ADTriggerMode, &triggerMode);
+    if (triggerMode == TMSoftwareTrigger)
+    {
+        // software trigger resets  when image received
+        setIntegerParam(merlinSoftwareTrigger, 0);
+    }
+
+    // If all the expected images have been received then the driver can
+    // complete the acquisition and return to waiting for acquisition state
+    if (imagesRemaining == 0)
+    {
+        if (scanStack != NULL)
+        {
+            publishScanStack(0);
+        }
+        scanStacking = 0;
+        setIntegerParam(ADAcquire, 0);
+        setIntegerParam(ADStatus, ADStatusIdle);
+        setIntegerParam(merlinArmed, 0);
+    }
+
+    if (frame->record)
+    {
+        setDoubleParam(merlinRecordBytes, recorder->getBytesWritten());
+        if (recorder->getError() != NULL)
+        {
+            setStringParam(ADStatusMessage, recorder->getError());
+        }
+    }
+
+    /* Call the callbacks to update any changes */
+    callParamCallbacks();
+}
+
+/** Checks the frame number of an MQ1 frame against the one expected next,
+ * counting the frames missing before it or a frame that was repeated.
+ * Returns the number of frames lost immediately before this one.
+ * Called with the driver lock held from publishFrame, in frame order.
+ */
+int merlinDetector::checkFrameNumber(mpxFrame *frame)
+{
+    const char *functionName = "checkFrameNumber";
+    int number = frame->frameNumber;
+    int lost = 0;
+
+    if (number < 0)
+    {
+        return 0;
+    }
+
+    if (expectedFrame > 0 && number > expectedFrame)
+    {
+        lost = number - expectedFrame;
+        missingFrames += lost;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: %d frames missing before frame %d\n", driverName,
+                functionName, lost, number);
+    }
+    else if (expectedFrame > 0 && number < expectedFrame && number != 1)
+    {
+        // frame 1 out of turn is a new acquisition whose header was lost,
+        // anything else has been seen already
+        duplicateFrames++;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame %d repeated, expected %d\n", driverName,
+                functionName, number, expectedFrame);
+        return 0;
+    }
+
+    expectedFrame = number + 1;
+    return lost;
+}
+
+/** Adds the stage times of a published data frame to the timing histograms
+ * and updates the timing parameters once a second.
+ * Called with the driver lock held from publishFrame.
+ */
+void merlinDetector::addFrameTiming(mpxFrame *frame)
+{
+    int stage;
+
+    for (stage = 0; stage < MPX_NUM_STAGES; stage++)
+    {
+        mpxTimingAdd(&timing[stage], frame->stageTime[stage]);
+    }
+    timingFrames++;
+    timingBytes += frame->bodySize;
+
+    if (mpxTimingNow() - timingStart >= 1000000000u)
+    {
+        publishTiming();
+    }
+}
+
+/** Sets the timing parameters (in us) and the frame and data rates from the
+ * frames published since the last call, then starts a new interval.
+ * Called with the driver lock held, the caller does the callbacks.
+ */
+void merlinDetector::publishTiming()
+{
+    epicsUInt64 now = mpxTimingNow();
+    double elapsed = (now - timingStart) / 1e9;
+    int stage;
+
+    for (stage = 0; stage < MPX_NUM_STAGES; stage++)
+    {
+        setDoubleParam(merlinTimingP50[stage],
+                mpxTimingPercentile(&timing[stage], 0.5) / 1e3);
+        setDoubleParam(merlinTimingP99[stage],
+                mpxTimingPercentile(&timing[stage], 0.99) / 1e3);
+        setDoubleParam(merlinTimingMax[stage], timing[stage].max / 1e3);
+        mpxTimingClear(&timing[stage]);
+    }
+    setDoubleParam(merlinFrameRate, elapsed > 0 ? timingFrames / elapsed : 0);
+    setDoubleParam(merlinDataRate,
+            elapsed > 0 ? timingBytes / elapsed / 1e6 : 0);
+
+    timingStart = now;
+    timingFrames = 0;
+    timingBytes = 0;
+}
+
+/** Copies a threshold scan frame into the next step of scanStack, adding
+ * its threshold as a "Scan Threshold <step>" attribute. Publishes the
+ * steps so far every ThresholdScanProgress steps.
+ * Called with the driver lock held from publishFrame.
+ * Returns 0 if the frame was added, -1 if it is to be published itself.
+ */
+int merlinDetector::addScanStep(mpxFrame *frame, NDArray *pImage)
+{
+    const char *functionName = "addScanStep";
+    NDArrayInfo_t info;
+    size_t dims[3];
+    char name[40];
+    int progress;
+
+    pImage->getInfo(&info);
+
+    if (scanStack == NULL)
+    {
+        // all the steps in one array, so allocated once the image size and
+        // type are known
+        dims[0] = pImage->dims[0].size;
+        dims[1] = pImage->dims[1].size;
+        dims[2] = scanStepsExpected;
+        scanStack = this->pNDArrayPool->alloc(3, dims, pImage->dataType, 0,
+                NULL);
+        if (scanStack == NULL)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unable to allocate %dx%dx%d NDArray for the "
+                    "threshold scan\n", driverName, functionName,
+                    (int) dims[0], (int) dims[1], (int) dims[2]);
+            setStringParam(ADStatusMessage,
+                    "Error: no memory for scan, publishing each step");
+            scanStacking = 0;
+            return -1;
+        }
+        scanStack->timeStamp = pImage->timeStamp;
+        scanStack->epicsTS = pImage->epicsTS;
+        scanStepsDone = 0;
+    }
+
+    if (pImage->ndims != 2 || pImage->dataType != scanStack->dataType
+            || pImage->dims[0].size != scanStack->dims[0].size
+            || pImage->dims[1].size != scanStack->dims[1].size
+            || scanStepsDone >= scanStepsExpected)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame does not fit the scan, step %d of %d\n",
+                driverName, functionName, scanStepsDone, scanStepsExpected);
+        return -1;
+    }
+
+    memcpy((char*) scanStack->pData + scanStepsDone * info.totalBytes,
+            pImage->pData, info.totalBytes);
+
+    // the header attributes of the latest step, and every step's threshold
+    pImage->pAttributeList->copy(scanStack->pAttributeList);
+    epicsSnprintf(name, sizeof(name), "Scan Threshold %d", scanStepsDone);
+    scanStack->pAttributeList->add(name, "Threshold 0 of the scan step (keV)",
+            NDAttrFloat64, &frame->mqHeader.threshold[0]);
+
+    scanStepsDone++;
+    setIntegerParam(merlinScanSteps, scanStepsDone);
+
+    getIntegerParam(merlinScanProgress, &progress);
+    if (scanStepsDone == scanStepsExpected)
+    {
+        publishScanStack(0);
+    }
+    else if (progress > 0 && scanStepsDone % progress == 0)
+    {
+        publishScanStack(1);
+    }
+    return 0;
+}
+
+/** Passes the steps of the threshold scan collected so far to the plugins
+ * as an (x, y, steps) NDArray. A partial scan goes out as a copy so that
+ * collection can carry on, the end of the scan sends scanStack itself.
+ * Called with the driver lock held.
+ */
+void merlinDetector::publishScanStack(int partial)
+{
+    const char *functionName = "publishScanStack";
+    NDArray *pStack;
+    int imageCounter;
+    int steps = scanStepsDone;
+    int complete = scanStepsDone == scanStepsExpected;
+
+    if (scanStack == NULL)
+        return;
+
+    scanStack->dims[2].size = steps;
+    scanStack->pAttributeList->add("Scan Steps", "Steps in the threshold scan",
+            NDAttrInt32, &steps);
+    scanStack->pAttributeList->add("Scan Complete",
+            "All steps of the threshold scan are present", NDAttrInt32,
+            &complete);
+    pStack = scanStack;
+    if (partial)
+    {
+        pStack = this->pNDArrayPool->copy(scanStack, NULL, 1);
+        scanStack->dims[2].size = scanStepsExpected;
+        if (pStack == NULL)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unable to copy the partial scan\n", driverName,
+                    functionName);
+            return;
+        }
+    }
+    else
+    {
+        scanStack = NULL;
+        scanStacking = 0;
+    }
+
+    getIntegerParam(NDArrayCounter, &imageCounter);
+    imageCounter++;
+    setIntegerParam(NDArrayCounter, imageCounter);
+    pStack->uniqueId = imageCounter;
+
+    this->getAttributes(pStack->pAttributeList);
+    doCallbacksGenericPointer(pStack, NDArrayData, 0);
+    pStack->release();
+}
+
+/** The position of a frame among the counters of its exposure: the Counter
+ * field of the header, or in colour mode (where the frames do not each have
+ * their own Counter) the frame number within the acquisition, so that a
+ * lost frame does not move the counters after it. The order of arrival is
+ * only used for a frame without a number.
+ */
+int merlinDetector::counterSlot(mpxFrame *frame)
+{
+    int counter = frame->mqHeader.counter;
+
+    if (!frame->mqHeader.colourMode && counter >= 0
+            && counter < framesPerAcquire)
+    {
+        return counter;
+    }
+    if (frame->frameNumber > 0)
+    {
+        return (frame->frameNumber - 1) % framesPerAcquire;
+    }
+    return counterPosition % framesPerAcquire;
+}
+
+/** Copies a frame into its counter's place in counterGroup, publishing the
+ * group when it has every counter. A frame whose counter is already in the
+ * group, or comes before the last one, is from the next exposure: the
+ * group is missing frames and is dropped rather than mix two exposures.
+ * Called with the driver lock held from publishFrame.
+ * Returns 0 if the frame was added, -1 if it is to be published itself.
+ */
+int merlinDetector::addCounterFrame(mpxFrame *frame, NDArray *pImage)
+{
+    const char *functionName = "addCounterFrame";
+    NDArrayInfo_t info;
+    size_t dims[3];
+    int slot = counterSlot(frame);
+    int counter = frame->mqHeader.counter;
+
+    if (counterGroup != NULL && ((counterFilled & (1 << slot))
+            || (!frame->mqHeader.colourMode && counter < lastCounter)
+            || counterGroup->dims[2].size != (size_t) framesPerAcquire))
+    {
+        dropCounterGroup();
+        slot = counterSlot(frame);
+    }
+
+    pImage->getInfo(&info);
+
+    if (counterGroup == NULL)
+    {
+        dims[0] = pImage->dims[0].size;
+        dims[1] = pImage->dims[1].size;
+        dims[2] = framesPerAcquire;
+        counterGroup = this->pNDArrayPool->alloc(3, dims, pImage->dataType,
+                0, NULL);
+        if (counterGroup == NULL)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unable to allocate NDArray from pool\n",
+                    driverName, functionName);
+            setStringParam(ADStatusMessage,
+                    "Error: no memory to group counters, publishing each");
+            counterGrouping = MPXCounterSeparate;
+            return -1;
+        }
+        counterGroup->timeStamp = pImage->timeStamp;
+        counterGroup->epicsTS = pImage->epicsTS;
+        counterFilled = 0;
+    }
+
+    if (pImage->ndims != 2 || pImage->dataType != counterGroup->dataType
+            || pImage->dims[0].size != counterGroup->dims[0].size
+            || pImage->dims[1].size != counterGroup->dims[1].size)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: counter %d frame does not match its group\n",
+                driverName, functionName, counter);
+        return -1;
+    }
+
+    memcpy((char*) counterGroup->pData + slot * info.totalBytes,
+            pImage->pData, info.totalBytes);
+    pImage->pAttributeList->copy(counterGroup->pAttributeList);
+
+    counterFilled |= 1 << slot;
+    counterPosition++;
+    lastCounter = counter;
+
+    if (counterFilled == (1 << framesPerAcquire) - 1)
+    {
+        publishCounterGroup();
+    }
+    return 0;
+}
+
+/** Passes a complete exposure to the plugins as one (x, y, counters)
+ * NDArray.
+ * Called with the driver lock held.
+ */
+void merlinDetector::publishCounterGroup()
+{
+    NDArray *pGroup = counterGroup;
+    int imageCounter;
+
+    counterGroup = NULL;
+    counterFilled = 0;
+    counterPosition = 0;
+    lastCounter = -1;
+
+    getIntegerParam(NDArrayCounter, &imageCounter);
+    imageCounter++;
+    setIntegerParam(NDArrayCounter, imageCounter);
+    pGroup->uniqueId = imageCounter;
+
+    pGroup->pAttributeList->add("Counters", "Counter frames in the array",
+            NDAttrInt32, &framesPerAcquire);
+    this->getAttributes(pGroup->pAttributeList);
+    doCallbacksGenericPointer(pGroup, NDArrayData, 0);
+    pGroup->release();
+}
+
+/** Throws away an incomplete exposure.
+ * Called with the driver lock held.
+ */
+void merlinDetector::dropCounterGroup()
+{
+    const char *functionName = "dropCounterGroup";
+
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: exposure dropped, counters present 0x%x\n", driverName,
+            functionName, counterFilled);
+    setStringParam(ADStatusMessage,
+            "Error: counter frames missing, exposure dropped");
+    counterGroup->release();
+    counterGroup = NULL;
+    counterFilled = 0;
+    counterPosition = 0;
+    lastCounter = -1;
+}
+
+/** Passes a received frame to the recorder, MQ1 frames are appended to the
+ * MIB file and acquisition headers go to the .hdr file next to it.
+ * Called from merlinTask without the driver lock, before the frame is
+ * decoded so the buffer still holds the frame as it was sent.
+ */
+void merlinDetector::recordFrame(mpxFrame *frame)
+{
+    if (frame->header == MPXQuadDataHeader)
+    {
+        recorder->append(frame->buffer, frame->received);
+    }
+    else if (frame->header == MPXAcquisitionHeader)
+    {
+        recorder->writeHeader(frame->buffer, frame->received);
+    }
+}
+
+/** Starts or stops recording the data channel to the file at RECORD_PATH.
+ * Called with the driver lock held from writeInt32.
+ */
+asynStatus merlinDetector::setRecording(int enable)
+{
+    const char *functionName = "setRecording";
+    char path[MAX_FILENAME_LEN];
+    double prealloc;
+
+    if (!enable)
+    {
+        if (recorder != NULL)
+        {
+            recorder->close();
+            setDoubleParam(merlinRecordBytes, recorder->getBytesWritten());
+        }
+        return asynSuccess;
+    }
+
+    getStringParam(merlinRecordPath, sizeof(path), path);
+    getDoubleParam(merlinRecordPrealloc, &prealloc);
+
+    if (recorder == NULL)
+    {
+        recorder = new mpxRecorder(MPX_RECORD_BUFFER_LEN);
+    }
+
+    if (path[0] == 0
+            || recorder->open(path, prealloc * 1024 * 1024) != asynSuccess)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: cannot record to '%s'\n", driverName, functionName,
+                path);
+        setIntegerParam(merlinRecordEnable, 0);
+        setStringParam(ADStatusMessage, "Error: cannot create record file");
+        return asynError;
+    }
+
+    // recording may start after the acquisition header has been sent
+    if (aquisitionHeader[0] != 0)
+    {
+        recorder->writeHeader(aquisitionHeader, strlen(aquisitionHeader));
+    }
+    setDoubleParam(merlinRecordBytes, 0);
+    return asynSuccess;
+}
+
+/** Multiplies a decoded image by the flat field factors, either in place
+ * (rounded and clamped to the pixel type) or into a new Float32 NDArray.
+ * Only full size images are corrected, not ROIs or bitmaps.
+ * Called from decodeFrame without the driver lock.
+ */
+void merlinDetector::applyFlatField(mpxFrame *frame)
+{
+    const char *functionName = "applyFlatField";
+    NDArray *pImage = frame->pImage;
+    NDArray *pFloat;
+    NDArrayInfo_t info;
+    size_t dims[2];
+
+    if (pImage->ndims != 2 || frame->packed
+            || pImage->dims[0].size != maxSize[0]
+            || pImage->dims[1].size != maxSize[1]
+            || pImage->dataType == NDFloat32 || pImage->dataType == NDFloat64)
+    {
+        return;
+    }
+    pImage->getInfo(&info);
+
+    if (!frame->flatFieldFloat)
+    {
+        mpxFlatFieldScale(pImage->pData, info.bytesPerElement,
+                frame->flatField, info.nElements);
+        return;
+    }
+
+    dims[0] = maxSize[0];
+    dims[1] = maxSize[1];
+    pFloat = this->pNDArrayPool->alloc(2, dims, NDFloat32, 0, NULL);
+    if (pFloat == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                functionName);
+        frame->error = "Error: run out of buffers in detector driver";
+        return;
+    }
+    mpxFlatFieldToFloat((float*) pFloat->pData, pImage->pData,
+            info.bytesPerElement, frame->flatField, info.nElements);
+    pImage->release();
+    frame->pImage = pFloat;
+}
+
+/** Adds a full size image to the flat field sum in pFlatField, computing
+ * the factors when the last of the requested frames has been added.
+ * Called with the driver lock held from publishFrame.
+ */
+void merlinDetector::accumulateFlatField(NDArray *pImage)
+{
+    epicsUInt32 *sum = (epicsUInt32*) pFlatField->pData;
+    epicsUInt32 value;
+    size_t i, n;
+    int frames;
+
+    if (pImage->ndims != 2 || pImage->dims[0].size != maxSize[0]
+            || pImage->dims[1].size != maxSize[1])
     {
-        epicsThreadSleep(.5);
+        return;
     }
+    n = (size_t) maxSize[0] * maxSize[1];
 
-    this->lock();
+    for (i = 0; i < n; i++)
+    {
+        switch (pImage->dataType)
+        {
+        case NDUInt8:
+            value = ((epicsUInt8*) pImage->pData)[i];
+            break;
+        case NDUInt16:
+            value = ((epicsUInt16*) pImage->pData)[i];
+            break;
+        case NDUInt32:
+            value = ((epicsUInt32*) pImage->pData)[i];
+            break;
+        default:
+            return;
+        }
+        // saturate rather than wrap
+        sum[i] = sum[i] > 0xFFFFFFFF - value ? 0xFFFFFFFF : sum[i] + value;
+    }
 
-    // allocate a buffer for reading in images from labview over network
-    switch (detType)
+    flatCaptureRemaining--;
+    getIntegerParam(merlinFlatFieldFrames, &frames);
+    setIntegerParam(merlinFlatFieldCaptured, frames - flatCaptureRemaining);
+    if (flatCaptureRemaining == 0)
     {
-    case UomXBPM:
-        imagSize = MAX_BUFF_UOM;
-        break;
-    case Merlin:
-    case MerlinXBPM: imagSize = MPX_IMG_FRAME_LEN24;
-        break;
-    case MerlinQuad:
-        imagSize = MAX_BUFF_MERLIN_QUAD;
-        break;
-    default:
-        imagSize = MAX_BUFF_UOM;
-        break;
+        computeFlatField();
     }
+}
 
-    bigBuff = (char*) calloc(imagSize, 1);
+/** Works out the factor for each pixel that brings the captured flat field
+ * to its mean, dead pixels (no counts in the flat) get a factor of 0.
+ * Called with the driver lock held.
+ */
+void merlinDetector::computeFlatField()
+{
+    const char *functionName = "computeFlatField";
+    epicsUInt32 *sum = (epicsUInt32*) pFlatField->pData;
+    float *factors = flatFactors[1 - flatCurrent];
+    size_t i, n = (size_t) maxSize[0] * maxSize[1];
+    size_t live = 0;
+    double total = 0, mean;
+    int frames;
+
+    for (i = 0; i < n; i++)
+    {
+        if (sum[i] > 0)
+        {
+            total += sum[i];
+            live++;
+        }
+    }
+    mean = live > 0 ? total / live : 0;
 
-    /* Loop forever */
-    while (1)
+    for (i = 0; i < n; i++)
     {
-        // Get the current time
-        epicsTimeGetCurrent(&startTime);
+        factors[i] = sum[i] > 0 ? (float) (mean / sum[i]) : 0.f;
+    }
 
-        // Acquire an image from the data channel
-        memset(bigBuff, 0, MPX_IMG_FRAME_LEN);
+    // frames decoded from now on get the new factors
+    flatCurrent = 1 - flatCurrent;
 
-        /* We release the mutex when waiting because this takes a long time and
-         * we need to allow abort operations to get through */
-        this->unlock();
+    getIntegerParam(merlinFlatFieldFrames, &frames);
+    averageFlatField = frames > 0 ? mean / frames : 0;
+    setDoubleParam(merlinFlatFieldAverage, averageFlatField);
+    setIntegerParam(merlinFlatFieldValid, live > 0);
+    setIntegerParam(merlinFlatFieldCapture, 0);
 
-        // wait for the next data frame packet - this function spends most of its time here
-        status = cmdConnection->mpxRead(this->pasynLabViewData, bigBuff,
-                imagSize, &nread, 10);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s: flat field of %d frames, %lu dead pixels, mean %f\n",
+            driverName, functionName, frames, (unsigned long) (n - live),
+            averageFlatField);
+}
 
-        /* If there was an error jump to bottom of loop */
-        if (status)
-        {
-            if (status == asynTimeout)
-                status = asynSuccess;   // timeouts are expected
-            else
-            {
-                asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
-                        "%s:%s: error in Labview data channel response, status=%d\n",
-                        driverName, functionName, status);
-                setStringParam(ADStatusMessage,
-                        "Error in Labview data channel response");
-                // wait before trying again - otherwise socket error creates a tight loop
-                epicsThreadSleep(5);
-            }
-            this->lock();
-            continue;
-        }
-        this->lock();
+/** Replaces the bad pixels of a decoded image using the frame's map.
+ * Only full size images are corrected, not ROIs or bitmaps.
+ * Called from decodeFrame without the driver lock.
+ */
+void merlinDetector::applyBadPixels(mpxFrame *frame)
+{
+    NDArray *pImage = frame->pImage;
+    mpxBadPixelMap *map = frame->badPixels;
+    NDArrayInfo_t info;
+    epicsTimeStamp start, end;
+
+    if (pImage->ndims != 2 || frame->packed
+            || pImage->dims[0].size != (size_t) map->xSize
+            || pImage->dims[1].size != (size_t) map->ySize
+            || pImage->dataType == NDFloat64)
+    {
+        return;
+    }
+    pImage->getInfo(&info);
 
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                "\nReceived image frame of %d bytes\n", nread);
+    epicsTimeGetCurrent(&start);
+    mpxBadPixelApply(map, pImage->pData, info.bytesPerElement,
+            pImage->dataType == NDFloat32);
+    epicsTimeGetCurrent(&end);
+    frame->badPixelTime = epicsTimeDiffInSeconds(&end, &start);
+}
 
-        if (pasynTrace->getTraceMask((pasynUserSelf))
-                & (ASYN_TRACE_MPX_VERBOSE))
-        {
-            dataConnection->dumpData(bigBuff, nread);
-        }
+/** Drops the frame's reference to its bad pixel map, freeing the map if it
+ * has been replaced and this was the last frame using it.
+ * Called with the driver lock held.
+ */
+void merlinDetector::releaseBadPixels(mpxFrame *frame)
+{
+    mpxBadPixelMap *map = frame->badPixels;
 
-        merlinDataHeader header = dataConnection->parseDataHeader(bigBuff);
-        if (header != MPXAcquisitionHeader)
-        {
-            getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-            numImagesCounter++;
-            setIntegerParam(ADNumImagesCounter, numImagesCounter);
-            if (imagesRemaining > 0)
-                imagesRemaining--;
+    if (map == NULL)
+        return;
 
-            getIntegerParam(NDArrayCounter, &imageCounter);
-            imageCounter++;
-            setIntegerParam(NDArrayCounter, imageCounter);
-        }
+    frame->badPixels = NULL;
+    map->users--;
+    if (map->users == 0 && map != badPixelMap)
+    {
+        mpxBadPixelFree(map);
+    }
+}
 
-        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+/** Loads the bad pixels listed in the BadPixelFile, an empty file name
+ * clears the map.
+ * Called with the driver lock held.
+ */
+asynStatus merlinDetector::loadBadPixelFile()
+{
+    const char *functionName = "loadBadPixelFile";
+    char path[MAX_FILENAME_LEN];
+    epicsUInt8 *mask;
+    char error[MAX_MESSAGE_SIZE];
+    asynStatus status;
 
-        if (arrayCallbacks)
-        {
-            getIntegerParam(merlinCounterDepth, &counterDepth);
+    mask = (epicsUInt8*) calloc((size_t) maxSize[0] * maxSize[1], 1);
+    if (mask == NULL)
+        return asynError;
 
-            int idim;
-            /* Get an image buffer from the pool */
-            getIntegerParam(ADMaxSizeX, &idim);
-            dims[0] = idim;
-            getIntegerParam(ADMaxSizeY, &idim);
-            dims[1] = idim;
+    getStringParam(merlinBadPixelFile, sizeof(path), path);
+    if (path[0] != 0 && mpxBadPixelReadFile(path, mask, maxSize[0],
+            maxSize[1], error, sizeof(error)) < 0)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: %s\n",
+                driverName, functionName, error);
+        setStringParam(ADStatusMessage, error);
+        free(mask);
+        return asynError;
+    }
 
-            if (header == MPXAcquisitionHeader)
-            {
-                // this is an acquisition header
-                strncpy(aquisitionHeader, bigBuff, MPX_ACQUISITION_HEADER_LEN);
-                aquisitionHeader[MPX_ACQUISITION_HEADER_LEN] = 0;
-            }
-            else if (header == MPXQuadDataHeader)
-            {
-                int pixelSize;
-                int offset, profileSelect;
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a Quad Merlin Image NDArray\n");
-
-                // Parse the header and use the information to determine the
-                // size of the NDArray
-                imageAttr->clear();
-                dataConnection->parseMqDataFrame(imageAttr, bigBuff, &(dims[0]),
-                        &(dims[1]), &pixelSize, &offset, &profileSelect);
-                pImage = NULL;
-                if (pixelSize == 8)
-                {
-                    pImage = copyToNDArray8(dims, bigBuff, offset);
-                }
-                else if (pixelSize == 16)
-                {
-                    pImage = copyToNDArray16(dims, bigBuff, offset);
-                }
-                else if (pixelSize == 32)
-                {
-                    pImage = copyToNDArray32(dims, bigBuff, offset);
-                }
-                else
-                {
-                    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                        "Unsupported bit depth %d\n", pixelSize);
-                    setStringParam(ADStatusMessage,
-                            "Error: Unsupported bit depth");
-                }
+    status = setBadPixelMask(mask);
+    free(mask);
+    return status;
+}
 
-                if (pImage == NULL)
-                {
-                    continue;
-                }
-                imageAttr->copy(pImage->pAttributeList);
-            }
-            else if (header == MPXProfileHeader)
-            {
-                int profileMask = 0;
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a Profile NDArray\n");
+/** Compiles a mask of maxSizeX x maxSizeY bytes (non zero for a bad pixel)
+ * and makes it the map for the frames received from now on. Frames already
+ * in the pipeline keep the map they were received with.
+ * Called with the driver lock held.
+ */
+asynStatus merlinDetector::setBadPixelMask(const epicsUInt8 *mask)
+{
+    const char *functionName = "setBadPixelMask";
+    mpxBadPixelMap *map;
+    mpxBadPixelMap *old = badPixelMap;
 
-                imageAttr->clear();
-                pImage = NULL;
+    map = mpxBadPixelCompile(mask, maxSize[0], maxSize[1]);
+    if (map == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate the bad pixel map\n", driverName,
+                functionName);
+        return asynError;
+    }
 
-//				dataConnection->parseDataFrame(imageAttr, bigBuff, header,
-//						&(dims[0]), &(dims[1]), &dummy2, &profileMask);
-                // TODO do profiles using 2.0 release of documentation
-                // TODO instead of above we should call parseMqDataFrame
-                // TODO in fact not sure we need a separate clause at this point.
+    badPixelMap = map;
+    if (old != NULL && old->users == 0)
+    {
+        mpxBadPixelFree(old);
+    }
 
-                if (profileMask
-                        != (MPXPROFILES_XPROFILE | MPXPROFILES_YPROFILE
-                                | MPXPROFILES_SUM))
-                {
-                    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                            "%s:%s: unsupported PROFILES mode %d\n", driverName,
-                            functionName, profileMask);
-                }
-                else
-                {
-                    pImage = copyProfileToNDArray32(dims, bigBuff, profileMask);
-                }
-                if (pImage == NULL)
-                    continue;
-                imageAttr->copy(pImage->pAttributeList);
-            }
-            else
-            {
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                        "Unknown header type %d\n", header);
-            }
+    setIntegerParam(merlinBadPixelCount, (int) map->count);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+            "%s:%s: %lu bad pixels, %lu neighbours\n", driverName,
+            functionName, (unsigned long) map->count,
+            (unsigned long) map->first[map->count]);
+    return asynSuccess;
+}
 
-            // for Data frames - complete the NDAttributes, pass the NDArray on
-            if (header == MPXProfileHeader || header == MPXQuadDataHeader)
-            {
-                // Put the frame number and time stamp into the buffer
-                pImage->uniqueId = imageCounter;
-                pImage->timeStamp = startTime.secPastEpoch
-                        + startTime.nsec / 1.e9;
+/** Replaces a decoded MQ1 image by one with the chips set out as on the
+ * sensor, with frame->chipGap pixels between them and the counts of the
+ * large edge pixels spread over the gap. Images that are not the full size
+ * given in the header (or are bitmaps) are passed on unchanged.
+ * Called from decodeFrame without the driver lock.
+ */
+void merlinDetector::assembleChips(mpxFrame *frame)
+{
+    const char *functionName = "assembleChips";
+    NDArray *pImage = frame->pImage;
+    NDArray *pAssembled;
+    MqFrameHeader *pHeader = &frame->mqHeader;
+    mpxRawLayout layout;
+    mpxGeometry *geometry;
+    NDArrayInfo_t info;
+    size_t dims[2];
+    int cols, rows;
 
-                // string attributes are global in HDF5 plugin so the most recent
-                // acquisition header is applied to all files
-                pImage->pAttributeList->add("Acquisition Header", "",
-                        NDAttrString, aquisitionHeader);
+    if (pImage->ndims != 2 || frame->packed
+            || pImage->dims[0].size != (size_t) pHeader->xSize
+            || pImage->dims[1].size != (size_t) pHeader->ySize
+            || pImage->dataType == NDFloat64)
+    {
+        return;
+    }
 
-                /* Get any attributes that have been defined for this driver */
-                this->getAttributes(pImage->pAttributeList);
+    // the same chip positions as for RAW frames, e.g. 2x2 (or 2x2G) or Nx1
+    if (mpxRawLayoutInit(&layout, pHeader->sensorLayout, pHeader->chipCount,
+            pHeader->xSize, pHeader->ySize) != 0)
+    {
+        return;
+    }
+    cols = layout.xSize / layout.chipX;
+    rows = layout.ySize / layout.chipY;
+    if (cols * rows == 1)
+    {
+        return;
+    }
 
-                // Call the NDArray callback
-                if (header == MPXQuadDataHeader)
-                {
-                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                }
-                else
-                {
-                    // address 1 on the port is used for profiles
-                    // TODO use of port 1 is not working in NDPluginBase so
-                    // currently reverting to use the same address
-                    // (i.e. setting Merlin1:ROI:NDArrayAddress has no effect
-                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                }
+    geometry = getGeometry(cols, rows, layout.chipX, layout.chipY,
+            frame->chipGap);
+    if (geometry == NULL)
+    {
+        return;
+    }
 
-                /* Free the image buffer */
-                pImage->release();
-            }
-        }
+    dims[0] = geometry->x.outSize;
+    dims[1] = geometry->y.outSize;
+    pAssembled = this->pNDArrayPool->alloc(2, dims, pImage->dataType, 0,
+            NULL);
+    if (pAssembled == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                functionName);
+        frame->error = "Error: run out of buffers in detector driver";
+        return;
+    }
+
+    pImage->getInfo(&info);
+    mpxGeometryApply(geometry, pAssembled->pData, pImage->pData,
+            info.bytesPerElement, pImage->dataType == NDFloat32);
+    pImage->release();
+    frame->pImage = pAssembled;
+}
 
-        // If we are using SW triggers then reset the trigger to 0 when an image is
-        // received
-        status = getIntegerParam(ADTriggerMode, &triggerMode);
-        if (triggerMode == TMSoftwareTrigger)
+/** Returns the assembly tables for a chip layout, building them the first
+ * time the layout is seen. Safe to call from several decode threads.
+ */
+mpxGeometry* merlinDetector::getGeometry(int cols, int rows, int chipX,
+        int chipY, int gap)
+{
+    const char *functionName = "getGeometry";
+    mpxGeometry *geometry = NULL;
+    int i;
+
+    epicsMutexLock(geometryMutex);
+    for (i = 0; i < numGeometries; i++)
+    {
+        if (geometries[i]->cols == cols && geometries[i]->rows == rows
+                && geometries[i]->chipX == chipX
+                && geometries[i]->chipY == chipY && geometries[i]->gap == gap)
         {
-            // software trigger resets  when image received
-            setIntegerParam(merlinSoftwareTrigger, 0);
+            geometry = geometries[i];
+            break;
         }
+    }
 
-        // If all the expected images have been received then the driver can
-        // complete the acquisition and return to waiting for acquisition state
-        if (imagesRemaining == 0)
+    if (geometry == NULL && numGeometries < MPX_GEOMETRY_CACHE)
+    {
+        geometry = mpxGeometryCreate(cols, rows, chipX, chipY, gap);
+        if (geometry != NULL)
         {
-            setIntegerParam(ADAcquire, 0);
-            setIntegerParam(ADStatus, ADStatusIdle);
+            geometries[numGeometries++] = geometry;
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                    "%s:%s: %dx%d chips of %dx%d, gap %d: %dx%d image\n",
+                    driverName, functionName, cols, rows, chipX, chipY, gap,
+                    geometry->x.outSize, geometry->y.outSize);
         }
-
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
     }
-    // release the image buffer (in reality this does not get called
-    // We need a thread shutdown signal)
-    free(bigBuff);
-}
+    epicsMutexUnlock(geometryMutex);
 
-/** helper functions for endian conversion
- *
- */
-inline void merlinDetector::endian_swap(unsigned short& x)
-{
-    if (detType == Merlin || detType == MerlinQuad)
+    if (geometry == NULL)
     {
-        x = (x >> 8) | (x << 8);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: no assembly table for %dx%d chips, gap %d\n",
+                driverName, functionName, cols, rows, gap);
     }
+    return geometry;
 }
 
-inline void merlinDetector::endian_swap(unsigned int& x)
+/** Adds the header attributes of an MQ1 frame to its NDArray from the
+ * per-acquisition template. The template holds the acquisition header and
+ * the header fields that do not change from frame to frame, it is rebuilt
+ * only when a new acquisition header arrives or those fields change, so
+ * each frame just copies it and adds its own frame number, time stamp etc.
+ * Called with the driver lock held from publishFrame.
+ */
+void merlinDetector::applyAttributeTemplate(mpxFrame *frame, NDArray *pImage)
 {
-    if (detType == Merlin || detType == MerlinQuad)
+    const char *functionName = "applyAttributeTemplate";
+
+    if (!templateValid
+            || !mqHeaderStaticEqual(&templateHeader, &frame->mqHeader))
     {
-        x = (x >> 24) | ((x << 8) & 0x00FF0000) | ((x >> 8) & 0x0000FF00)
-                | (x << 24);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s:%s: rebuilding attributes at frame %d\n", driverName,
+                functionName, frame->mqHeader.frameNumber);
+
+        templateAttr->clear();
+        mqHeaderStaticAttributes(&frame->mqHeader, templateAttr);
+        mqAcquisitionAttributes(aquisitionHeader, strlen(aquisitionHeader),
+                templateAttr);
+        templateHeader = frame->mqHeader;
+        templateValid = 1;
     }
+
+    templateAttr->copy(pImage->pAttributeList);
+    mqHeaderFrameAttributes(&frame->mqHeader, pImage->pAttributeList);
 }
 
+/** helper function for endian conversion of profile data, image data is
+ * converted by the kernels in mpxDecode
+ */
 inline void merlinDetector::endian_swap(uint64_t& x)
 {
-    if (detType == Merlin || detType == MerlinQuad)
+    if (swapPixels)
     {
         x = ((((x) & 0x00000000000000FFLL) << 0x38)
                 | (((x) & 0x000000000000FF00LL) << 0x28)
@@ -344,14 +1707,20 @@ inline void merlinDetector::endian_swap(uint64_t& x)
     }
 }
 
+/* the command thread talks to the server without the driver lock so these
+ * take it themselves */
 void merlinDetector::fromLabViewStr(const char *str)
 {
+    this->lock();
     setStringParam(ADStringFromServer, str);
+    this->unlock();
 }
 
 void merlinDetector::toLabViewStr(const char *str)
 {
+    this->lock();
     setStringParam(ADStringToServer, str);
+    this->unlock();
 }
 
 /** Helper function to copy a 64bit profile buffer into a 32Bit NDArray
@@ -419,117 +1788,351 @@ NDArray* merlinDetector::copyProfileToNDArray32(size_t *dims, char *buffer,
 }
 
 
-// Todo make the following three functions a single template function
+// The following three functions switch to little endien and Invert in the
+// Y axis (merlin origin is at bottom left) using the kernels in mpxDecode
 
 /** Helper function to copy a 8 bit buffer into an NDArray
  *
  */
 NDArray* merlinDetector::copyToNDArray8(size_t *dims, char *buffer, int offset)
 {
-    // copy the data into NDArray, switching to little endien and
-    // Inverting in the Y axis (merlin origin is at bottom left)
-    epicsUInt8 *pData, *pSrc;
-    size_t x, y;
-
     NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt8, 0, NULL);
 
     if (pImage == NULL)
     {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                 "%s:%s: unable to allocate NDArray from pool\n", driverName,
-                "copyToNDArray8");
-        setStringParam(ADStatusMessage,
-                "Error: run out of buffers in detector driver");
+                "copyToNDArray8");
+    }
+    else
+    {
+        mpxInvertRows8(pImage->pData, buffer + offset, dims[0], dims[1]);
+    }
+    return pImage;
+}
+
+
+/** Helper function to copy a 16 bit buffer into an NDArray
+ *
+ */
+NDArray* merlinDetector::copyToNDArray16(size_t *dims, char *buffer, int offset)
+{
+    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
+
+    if (pImage == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                "copyToNDArray16");
+    }
+    else
+    {
+        mpxInvertRows16(pImage->pData, buffer + offset, dims[0], dims[1],
+                swapPixels);
+    }
+    return pImage;
+}
+
+
+/** Helper function to copy a 32 bit buffer into an NDArray
+ *
+ */
+NDArray* merlinDetector::copyToNDArray32(size_t* dims, char* buffer, int offset)
+{
+    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+
+    if (pImage == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                "copyToNDArray32");
+    }
+    else
+    {
+        mpxInvertRows32(pImage->pData, buffer + offset, dims[0], dims[1],
+                swapPixels);
+    }
+    return pImage;
+}
+
+/** Packs the pixels of an 8 bit frame of 1 bit counters into a bitmap of
+ * dims[0] / 8 bytes per row, inverting in the Y axis.
+ */
+NDArray* merlinDetector::copyToNDArrayPacked(size_t *dims, char *buffer,
+        int offset)
+{
+    size_t packedDims[2];
+    NDArray* pImage;
+
+    packedDims[0] = dims[0] / 8;
+    packedDims[1] = dims[1];
+    pImage = this->pNDArrayPool->alloc(2, packedDims, NDUInt8, 0, NULL);
+    if (pImage == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                "copyToNDArrayPacked");
+    }
+    else
+    {
+        mpxPackRows1(pImage->pData, buffer + offset, dims[0], dims[1]);
+        addPackedAttributes(pImage, (int) dims[0]);
+    }
+    return pImage;
+}
+
+/** Describes the layout of a bitmap NDArray so that plugins and file
+ * readers can unpack it */
+void merlinDetector::addPackedAttributes(NDArray *pImage, int xSize)
+{
+    epicsInt32 iVal;
+
+    iVal = 1;
+    pImage->pAttributeList->add("Packed Bits Per Pixel", "", NDAttrInt32,
+            &iVal);
+    iVal = xSize;
+    pImage->pAttributeList->add("Packed X Size", "", NDAttrInt32, &iVal);
+    pImage->pAttributeList->add("Packed Bit Order", "", NDAttrString,
+            (void*) "LSB first");
+}
+
+/** Unpacks the pixels of a RAW format (R64) frame into a new NDArray.
+ * The counter depth is taken from the header and checked against the
+ * amount of pixel data, UInt8 is used for 1 and 6 bit counters, UInt16 for
+ * 12 bit and UInt32 for 24 bit. Sets frame->error on failure.
+ */
+NDArray* merlinDetector::copyRawToNDArray(mpxFrame *frame)
+{
+    const char *functionName = "copyRawToNDArray";
+    MqFrameHeader *pHeader = &frame->mqHeader;
+    NDArray *pImage;
+    NDDataType_t dataType;
+    mpxRawLayout layout;
+    size_t dims[2];
+    size_t dataBytes = frame->received - pHeader->dataOffset;
+    int counterDepth = pHeader->counterDepth;
+
+    if (mpxRawDataBytes(pHeader->xSize, pHeader->ySize, counterDepth)
+            != dataBytes)
+    {
+        counterDepth = mpxRawCounterDepth(dataBytes, pHeader->xSize,
+                pHeader->ySize);
+    }
+    if (counterDepth == 0)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: %lu bytes of RAW data do not fit %dx%d pixels\n",
+                driverName, functionName, (unsigned long) dataBytes,
+                pHeader->xSize, pHeader->ySize);
+        frame->error = "Error: frame size does not match header";
+        return NULL;
+    }
+
+    if (mpxRawLayoutInit(&layout, pHeader->sensorLayout, pHeader->chipCount,
+            pHeader->xSize, pHeader->ySize) != 0)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unsupported RAW layout %s of %d chips\n", driverName,
+                functionName, pHeader->sensorLayout, pHeader->chipCount);
+        frame->error = "Error: unsupported RAW sensor layout";
+        return NULL;
+    }
+
+    switch (mpxRawPixelBytes(counterDepth))
+    {
+    case 1:
+        dataType = NDUInt8;
+        break;
+    case 2:
+        dataType = NDUInt16;
+        break;
+    default:
+        dataType = NDUInt32;
+        break;
+    }
+
+    dims[0] = pHeader->xSize;
+    dims[1] = pHeader->ySize;
+    if (counterDepth == 1 && frame->packed)
+    {
+        dims[0] /= 8;
+    }
+    pImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+    if (pImage == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                functionName);
+        frame->error = "Error: run out of buffers in detector driver";
+        return NULL;
+    }
+
+    if (counterDepth == 1 && frame->packed)
+    {
+        mpxUnpackRawPacked(pImage->pData, frame->buffer + pHeader->dataOffset,
+                &layout);
+        addPackedAttributes(pImage, pHeader->xSize);
     }
     else
     {
-        for (y = 0; y < dims[1]; y++)
-        {
-            for (x = 0, pData = (epicsUInt8 *) pImage->pData + y * dims[0], pSrc =
-                    (epicsUInt8 *) (buffer + offset)
-                            + (dims[1] - y) * dims[0]; x < dims[0];
-                    x++, pData++, pSrc++)
-            {
-                *pData = *pSrc;
-            }
-        }
+        mpxUnpackRaw(pImage->pData, frame->buffer + pHeader->dataOffset,
+                &layout, counterDepth);
     }
+    pHeader->counterDepth = counterDepth;
     return pImage;
 }
 
-
-/** Helper function to copy a 16 bit buffer into an NDArray
+/** Receives the remainder of an MQ1 data frame, reading the pixel data
+ * directly into an NDArray from the pool instead of via the receive buffer.
  *
+ * The first frame->received bytes of the frame body are already in the frame
+ * buffer. The rest of the frame header is read into the buffer and parsed
+ * for the image dimensions before the NDArray is allocated, the pixel data
+ * is then read into pImage->pData ready for decodeFrame to convert in place.
+ * The whole frame is always consumed from the data channel.
+ * Called without the driver lock.
+ * Returns asynSuccess unless the data channel failed, if the frame could not
+ * be received into an NDArray then frame->pImage is NULL and frame->error
+ * is set.
  */
-NDArray* merlinDetector::copyToNDArray16(size_t *dims, char *buffer, int offset)
+asynStatus merlinDetector::receiveMqFrame(mpxFrame *frame)
 {
-    // copy the data into NDArray, switching to little endien and
-    // Inverting in the Y axis (merlin origin is at bottom left)
-    epicsUInt16 *pData, *pSrc;
-    size_t x, y;
+    const char *functionName = "receiveMqFrame";
+    char *buffer = frame->buffer;
+    int bodySize = frame->bodySize;
+    int received = frame->received;
+    NDArray *pImage = NULL;
+    NDDataType_t dataType;
+    size_t dims[2];
+    size_t pixelBytes;
+    int pixelSize;
+    int headerLen;
+    asynStatus status = asynSuccess;
+    epicsUInt64 start;
+    int decoded;
 
-    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
+    headerLen = mqHeaderLength(buffer, received);
+    if (headerLen < received || headerLen > MPX_IMG_HDR_FULL_LEN
+            || headerLen > bodySize)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: invalid header length %d\n", driverName, functionName,
+                headerLen);
+        frame->error = "Error: invalid frame header";
+        return dataConnection->mpxDiscardBody(bodySize - received, 10);
+    }
 
-    if (pImage == NULL)
+    // read the remainder of the header
+    status = dataConnection->mpxReadBody(buffer + received,
+            headerLen - received, 10);
+    if (status != asynSuccess)
+    {
+        frame->error = "Error in Labview data channel response";
+        return status;
+    }
+    buffer[headerLen] = 0;
+    frame->received = headerLen;
+
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+            "Receiving a Quad Merlin Image NDArray\n");
+
+    start = mpxTimingNow();
+    decoded = mqDecodeHeader(buffer, headerLen, &frame->mqHeader);
+    frame->stageTime[mpxStageHeader] += mpxTimingNow() - start;
+    if (decoded != 0)
     {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s:%s: unable to allocate NDArray from pool\n", driverName,
-                "copyToNDArray16");
-        setStringParam(ADStatusMessage,
-                "Error: run out of buffers in detector driver");
+                "%s:%s: incomplete frame header\n", driverName, functionName);
+        frame->error = "Error: invalid frame header";
+        return dataConnection->mpxDiscardBody(bodySize - headerLen, 10);
     }
-    else
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX, "Image frame Header: %s\n\n",
+            buffer);
+
+    if (frame->mqHeader.pixelFormat == 'R')
     {
-        for (y = 0; y < dims[1]; y++)
+        // RAW pixels are unpacked by decodeFrame from the receive buffer
+        frame->zeroCopy = 0;
+        if (bodySize >= frameBufferSize)
         {
-            for (x = 0, pData = (epicsUInt16 *) pImage->pData + y * dims[0], pSrc =
-                    (epicsUInt16 *) (buffer + offset)
-                            + (dims[1] - y) * dims[0]; x < dims[0];
-                    x++, pData++, pSrc++)
-            {
-                *pData = *pSrc;
-                endian_swap(*pData);
-            }
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: frame size %d not supported\n", driverName,
+                    functionName, bodySize);
+            frame->error = "Error: frame size does not match header";
+            return dataConnection->mpxDiscardBody(bodySize - headerLen, 10);
+        }
+        status = dataConnection->mpxReadBody(buffer + headerLen,
+                bodySize - headerLen, 10);
+        if (status != asynSuccess)
+        {
+            frame->error = "Error in Labview data channel response";
+            return status;
         }
+        frame->received = bodySize;
+        return asynSuccess;
     }
-    return pImage;
-}
 
+    dims[0] = frame->mqHeader.xSize;
+    dims[1] = frame->mqHeader.ySize;
+    pixelSize = frame->mqHeader.pixelDepth;
 
-/** Helper function to copy a 32 bit buffer into an NDArray
- *
- */
-NDArray* merlinDetector::copyToNDArray32(size_t* dims, char* buffer, int offset)
-{
-    epicsUInt32 *pData, *pSrc;
-    size_t x, y;
-
-    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+    switch (pixelSize)
+    {
+    case 8:
+        dataType = NDUInt8;
+        break;
+    case 16:
+        dataType = NDUInt16;
+        break;
+    case 32:
+        dataType = NDUInt32;
+        break;
+    default:
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "Unsupported bit depth %d\n", pixelSize);
+        frame->error = "Error: Unsupported bit depth";
+        return dataConnection->mpxDiscardBody(bodySize - headerLen, 10);
+    }
 
-    if (pImage == NULL)
+    pixelBytes = dims[0] * dims[1] * (pixelSize / 8);
+    if (pixelBytes != (size_t) (bodySize - headerLen))
     {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s:%s: unable to allocate NDArray from pool\n", driverName,
-                "copyToNDArray32");
-        setStringParam(ADStatusMessage,
-                "Error: run out of buffers in detector driver");
+                "%s:%s: frame has %d bytes of pixel data, expected %lu\n",
+                driverName, functionName, bodySize - headerLen,
+                (unsigned long) pixelBytes);
+        frame->error = "Error: frame size does not match header";
     }
     else
     {
-        for (y = 0; y < dims[1]; y++)
+        pImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+        if (pImage == NULL)
         {
-            for (x = 0, pData = (epicsUInt32 *) pImage->pData + y * dims[0], pSrc =
-                    (epicsUInt32 *) (buffer + offset)
-                            + (dims[1] - y) * dims[0]; x < dims[0];
-                    x++, pData++, pSrc++)
-            {
-                *pData = *pSrc;
-                endian_swap(*pData);
-            }
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                    functionName);
+            frame->error = "Error: run out of buffers in detector driver";
         }
     }
-    return pImage;
+
+    if (pImage == NULL)
+    {
+        return dataConnection->mpxDiscardBody(bodySize - headerLen, 10);
+    }
+
+    status = dataConnection->mpxReadBody((char*) pImage->pData,
+            (int) pixelBytes, 10);
+    if (status != asynSuccess)
+    {
+        frame->error = "Error in Labview data channel response";
+        pImage->release();
+        return status;
+    }
+
+    frame->pImage = pImage;
+    return asynSuccess;
 }
+
 asynStatus merlinDetector::setModeCommands(int function)
 {
     asynStatus status;
@@ -546,8 +2149,7 @@ asynStatus merlinDetector::setModeCommands(int function)
             setIntegerParam(merlinEnableCounter1, counter1Enabled);
         }
         epicsSnprintf(value, MPX_MAXLINE, "%d", counter1Enabled);
-        cmdConnection->mpxSet(MPXVAR_ENABLECOUNTER1, value,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_ENABLECOUNTER1, value);
     }
 
     if (function == merlinContinuousRW)
@@ -560,25 +2162,12 @@ asynStatus merlinDetector::setModeCommands(int function)
             setIntegerParam(merlinContinuousRW, continuousEnabled);
         }
         epicsSnprintf(value, MPX_MAXLINE, "%d", continuousEnabled);
-        cmdConnection->mpxSet(MPXVAR_CONTINUOUSRW, value,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_CONTINUOUSRW, value);
     }
 
-    epicsThreadSleep(.01);
-
-    // now get the values again from the device -- it may reset them to consistent values
-    // (presently only one of merlinContinuousRW or merlinEnableCounter1 can be set at a time)
-    status = cmdConnection->mpxGet(MPXVAR_ENABLECOUNTER1,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(merlinEnableCounter1,
-                atoi(cmdConnection->fromLabviewValue));
-
-    status = cmdConnection->mpxGet(MPXVAR_CONTINUOUSRW,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(merlinContinuousRW,
-                atoi(cmdConnection->fromLabviewValue));
+    // the device may reset the other value to be consistent (presently only
+    // one of merlinContinuousRW or merlinEnableCounter1 can be set at a
+    // time) so the shadow reads both back in the same batch
 
     return (asynSuccess);
 }
@@ -639,7 +2228,7 @@ asynStatus merlinDetector::setROI()
 
         epicsSnprintf(value, MPX_MAXLINE, "%lu %lu %lu %lu", arrayDims[0].offset,
                 arrayDims[1].offset, arrayDims[0].size, arrayDims[1].size);
-        cmdConnection->mpxSet(MPXVAR_ROI, value, Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_ROI, value);
     }
     return asynSuccess;
 }
@@ -652,28 +2241,22 @@ asynStatus merlinDetector::setAcquireParams()
 //	char *substr = NULL;
 //	int pixelCutOff = 0;
 
-    // avoid chatty startup which keeps setting these values
-    if (startingUp)
-        return asynSuccess;
-
+    // all the settings go to the server in the command thread's batch
     if (detType == MerlinXBPM || detType == UomXBPM)
     {
         int exposures, val;
 
         getIntegerParam(ADNumExposures, &exposures);
         epicsSnprintf(value, MPX_MAXLINE, "%d", exposures);
-        cmdConnection->mpxSet(MPXVAR_IMAGESTOSUM, value,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_IMAGESTOSUM, value);
 
         getIntegerParam(merlinEnableBackgroundCorr, &val);
         epicsSnprintf(value, MPX_MAXLINE, "%d", val);
-        cmdConnection->mpxSet(MPXVAR_ENABLEBACKROUNDCORR, value,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_ENABLEBACKROUNDCORR, value);
 
         getIntegerParam(merlinEnableImageSum, &val);
         epicsSnprintf(value, MPX_MAXLINE, "%d", val);
-        cmdConnection->mpxSet(MPXVAR_ENABLEIMAGEAVERAGE, value,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_ENABLEIMAGEAVERAGE, value);
     }
 
     int numImages;
@@ -694,8 +2277,8 @@ asynStatus merlinDetector::setAcquireParams()
 
     int counterDepth;
     status = getIntegerParam(merlinCounterDepth, &counterDepth);
-    if ((status != asynSuccess) || (counterDepth != 6 && counterDepth != 12 &&
-            counterDepth != 24)) // currently limited to 6/12/24 bit
+    if ((status != asynSuccess) || (counterDepth != 1 && counterDepth != 6
+            && counterDepth != 12 && counterDepth != 24))
     {
         counterDepth = 12;
         setIntegerParam(merlinCounterDepth, counterDepth);
@@ -720,16 +2303,13 @@ asynStatus merlinDetector::setAcquireParams()
 
     // set the values enmasse - an attempt to fix the strange GUI updates caused by slow comms (failed)
     epicsSnprintf(value, MPX_MAXLINE, "%d", numExposures);
-    cmdConnection->mpxSet(MPXVAR_NUMFRAMESPERTRIGGER, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_NUMFRAMESPERTRIGGER, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", counterDepth);
-    cmdConnection->mpxSet(MPXVAR_COUNTERDEPTH, value, Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_COUNTERDEPTH, value);
     epicsSnprintf(value, MPX_MAXLINE, "%f", acquireTime * 1000); // translated into millisec
-    cmdConnection->mpxSet(MPXVAR_ACQUISITIONTIME, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_ACQUISITIONTIME, value);
     epicsSnprintf(value, MPX_MAXLINE, "%f", acquirePeriod * 1000); // translated into millisec
-    cmdConnection->mpxSet(MPXVAR_ACQUISITIONPERIOD, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_ACQUISITIONPERIOD, value);
 
     status = getIntegerParam(ADTriggerMode, &triggerMode);
     if (status != asynSuccess)
@@ -740,213 +2320,789 @@ asynStatus merlinDetector::setAcquireParams()
     switch (triggerMode)
     {
     case TMInternal:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigInternal);
+        shadowSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalEnable:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigFalling,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        shadowSet(MPXVAR_TRIGGERSTOP, TMTrigFalling);
         break;
     case TMExternalTriggerLow:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigFalling,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigFalling);
+        shadowSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalTriggerHigh:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        shadowSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalTriggerRising:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        shadowSet(MPXVAR_TRIGGERSTOP, TMTrigRising);
         break;
     case TMSoftwareTrigger:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigSoftware,
-                Labview_DEFAULT_TIMEOUT);
+        shadowSet(MPXVAR_TRIGGERSTART, TMTrigSoftware);
         break;
     }
 
-    // read the acquire period back from the server so that it can insert
-    // the readback time if necessary
-    cmdConnection->mpxGet(MPXVAR_ACQUISITIONPERIOD, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(ADAcquirePeriod,
-                atof(cmdConnection->fromLabviewValue) / 1000); // translated into secs
+    // the acquire period is read back from the server when anything that
+    // affects it was changed so that it can insert the readback time if
+    // necessary
+    return asynSuccess;
+}
+
+asynStatus merlinDetector::getThreshold()
+{
+    char *thresholdVar[] = { MPXVAR_THRESHOLD0, MPXVAR_THRESHOLD1,
+            MPXVAR_THRESHOLD2, MPXVAR_THRESHOLD3, MPXVAR_THRESHOLD4,
+            MPXVAR_THRESHOLD5, MPXVAR_THRESHOLD6, MPXVAR_THRESHOLD7 };
+    int i;
+
+    /* Read back the actual setting, in case we are out of bounds.*/
+    for (i = 0; i < 8; i++)
+    {
+        shadowGet(thresholdVar[i]);
+    }
+    shadowGet(MPXVAR_OPERATINGENERGY);
 
     return (asynSuccess);
+}
+
+asynStatus merlinDetector::updateThresholdScanParms()
+{
+    char valueStr[MPX_MAXLINE];
+    int thresholdScan;
+    double start, stop, step;
+
+    getDoubleParam(merlinStartThresholdScan, &start);
+    getDoubleParam(merlinStopThresholdScan, &stop);
+    getDoubleParam(merlinStepThresholdScan, &step);
+    getIntegerParam(merlinThresholdScan, &thresholdScan);
+
+    // each value that is changed is read back in case it is out of bounds
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", start);
+    shadowSet(MPXVAR_THSTART, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", stop);
+    shadowSet(MPXVAR_THSTOP, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", step);
+    shadowSet(MPXVAR_THSTEP, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%d", thresholdScan);
+    shadowSet(MPXVAR_THSSCAN, valueStr);
 
+    return asynSuccess;
 }
 
-asynStatus merlinDetector::getThreshold()
+/** The number of images in the threshold scan, one for each step, or -1
+ * if the step is zero or goes away from the stop. The division is rounded
+ * so that e.g. (20 - 10) / 0.1 is 100 steps, not 99.
+ * Called with the driver lock held.
+ */
+int merlinDetector::thresholdScanSteps()
 {
-    int status;
+    double start, stop, step, steps;
 
-    if (startingUp)
-        return asynSuccess;
+    getDoubleParam(merlinStartThresholdScan, &start);
+    getDoubleParam(merlinStopThresholdScan, &stop);
+    getDoubleParam(merlinStepThresholdScan, &step);
 
-    /* Read back the actual setting, in case we are out of bounds.*/
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD0, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold0,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD1, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold1,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD2, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold2,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD3, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold3,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD4, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold4,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD5, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold5,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD6, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold6,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD7, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinThreshold7,
-                atof(cmdConnection->fromLabviewValue));
-
-    status = cmdConnection->mpxGet(MPXVAR_OPERATINGENERGY,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinOperatingEnergy,
-                atof(cmdConnection->fromLabviewValue));
+    if (step == 0)
+        return -1;
+    steps = floor((stop - start) / step + 0.5);
+    // also refuses a NaN from a start, stop or step that is not a number
+    if (!(steps >= 0 && steps <= INT_MAX))
+        return -1;
+    // a scan that starts and stops at the same threshold takes one image
+    return steps < 1 ? 1 : (int) steps;
+}
 
-    callParamCallbacks();
+/** Prepares for an Acquire with the least delay: has the command thread
+ * send any settings that the server does not already have, including the
+ * number of frames, and fills the NDArray pool so that the first frames do
+ * not wait for memory. Acquire then only has to send the start command.
+ * Called with the driver lock held from writeInt32.
+ */
+asynStatus merlinDetector::armDetector()
+{
+    int adstatus;
 
-    return (asynSuccess);
+    getIntegerParam(ADStatus, &adstatus);
+    if (adstatus == ADStatusAcquire)
+    {
+        setStringParam(ADStatusMessage, "Error: cannot arm while acquiring");
+        return asynError;
+    }
+
+    prewarmBuffers();
+
+    setStringParam(ADStatusMessage, "Arming...");
+    requestCommand(MPXWorkAcquireParams | MPXWorkArm);
+    return asynSuccess;
+}
+
+/** Adds the number of frames that Acquire will ask for to the batch */
+void merlinDetector::armCommands()
+{
+    char strVal[MPX_MAXLINE];
+    int imageMode;
+    int imagesToAcquire;
+
+    getIntegerParam(ADImageMode, &imageMode);
+    getIntegerParam(ADNumImages, &imagesToAcquire);
+    if (imageMode == MPXImageSingle || imageMode == MPXImageMultiple
+            || imageMode == MPXImageContinuous)
+    {
+        if (imageMode == MPXImageContinuous)
+        {
+            imagesToAcquire = 0;
+        }
+        epicsSnprintf(strVal, MPX_MAXLINE, "%d", imagesToAcquire);
+        shadowSet(MPXVAR_NUMFRAMESTOACQUIRE, strVal);
+    }
+}
+
+/** Adds the thresholds and energy that have been written since they were
+ * last sent to the batch, the energy first as it can move the thresholds */
+void merlinDetector::thresholdCommands()
+{
+    char *thresholdVar[] = { MPXVAR_OPERATINGENERGY, MPXVAR_THRESHOLD0,
+            MPXVAR_THRESHOLD1, MPXVAR_THRESHOLD2, MPXVAR_THRESHOLD3,
+            MPXVAR_THRESHOLD4, MPXVAR_THRESHOLD5, MPXVAR_THRESHOLD6,
+            MPXVAR_THRESHOLD7 };
+    char value[MPX_MAXLINE];
+    mpxShadowVar *var;
+    double threshold;
+    int i;
+
+    for (i = 0; i < 9; i++)
+    {
+        var = mpxShadowFind(&shadow, thresholdVar[i]);
+        if (var != NULL && var->written)
+        {
+            getDoubleParam(var->param, &threshold);
+            epicsSnprintf(value, MPX_MAXLINE, "%f", threshold);
+            shadowSet(thresholdVar[i], value);
+        }
+    }
+}
+
+/** Leaves work for the command thread and wakes it.
+ * Called with the driver lock held.
+ * \param[in] work MPXCommandWork_t bits
+ */
+void merlinDetector::requestCommand(int work)
+{
+    // a stop overtakes a start and triggers that have not been sent, a
+    // start after a stop is sent after it
+    if (work & MPXWorkStop)
+    {
+        commandWork &= ~MPXWorkStart;
+        softwareTriggers = 0;
+    }
+    commandWork |= work;
+    epicsEventSignal(commandEvent);
+}
+
+/** Allocates and releases an NDArray of the full detector size for each
+ * frame of the pipeline so that the pool has them ready, touching the
+ * memory so that it is mapped in before the first frame.
+ * Called with the driver lock held.
+ */
+void merlinDetector::prewarmBuffers()
+{
+    NDArray **arrays;
+    NDDataType_t dataType;
+    size_t dims[2];
+    int counterDepth;
+    int idim;
+    int count = 0;
+    int i;
+
+    getIntegerParam(ADMaxSizeX, &idim);
+    dims[0] = idim;
+    getIntegerParam(ADMaxSizeY, &idim);
+    dims[1] = idim;
+    getIntegerParam(merlinCounterDepth, &counterDepth);
+    dataType = counterDepth > 12 ? NDUInt32 :
+            counterDepth > 6 ? NDUInt16 : NDUInt8;
+
+    arrays = (NDArray **) calloc(numFrames, sizeof(NDArray *));
+    if (arrays == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < numFrames; i++)
+    {
+        arrays[i] = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+        if (arrays[i] == NULL)
+        {
+            break;
+        }
+        memset(arrays[i]->pData, 0, arrays[i]->dataSize);
+        count++;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        arrays[i]->release();
+    }
+    free(arrays);
+}
+
+/** Builds the shadow of the server variables that the driver sets, with
+ * the parameters that show their values.
+ */
+void merlinDetector::initShadow()
+{
+    int thresholdParam[] = { merlinThreshold0, merlinThreshold1,
+            merlinThreshold2, merlinThreshold3, merlinThreshold4,
+            merlinThreshold5, merlinThreshold6, merlinThreshold7 };
+    char *thresholdVar[] = { MPXVAR_THRESHOLD0, MPXVAR_THRESHOLD1,
+            MPXVAR_THRESHOLD2, MPXVAR_THRESHOLD3, MPXVAR_THRESHOLD4,
+            MPXVAR_THRESHOLD5, MPXVAR_THRESHOLD6, MPXVAR_THRESHOLD7 };
+    int i;
+
+    // in the order that shadowReplay sets them, the energy before the
+    // thresholds that it moves
+    memset(&shadow, 0, sizeof(shadow));
+    mpxShadowAdd(&shadow, MPXVAR_OPERATINGENERGY, merlinOperatingEnergy, 0,
+            1);
+    for (i = 0; i < 8; i++)
+    {
+        mpxShadowAdd(&shadow, thresholdVar[i], thresholdParam[i], 0, 1);
+    }
+    mpxShadowAdd(&shadow, MPXVAR_ENABLECOUNTER1, merlinEnableCounter1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_CONTINUOUSRW, merlinContinuousRW, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_COLOURMODE, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_CHARGESUMMING, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_COUNTERDEPTH, merlinCounterDepth, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_NUMFRAMESPERTRIGGER, ADNumExposures, 1, 1);
+    // times are in ms on the server
+    mpxShadowAdd(&shadow, MPXVAR_ACQUISITIONTIME, ADAcquireTime, 0, .001);
+    mpxShadowAdd(&shadow, MPXVAR_ACQUISITIONPERIOD, ADAcquirePeriod, 0,
+            .001);
+    mpxShadowAdd(&shadow, MPXVAR_NUMFRAMESTOACQUIRE, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_TRIGGERSTART, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_TRIGGERSTOP, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_IMAGESTOSUM, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_ENABLEBACKROUNDCORR, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_ENABLEIMAGEAVERAGE, -1, 1, 1);
+    mpxShadowAdd(&shadow, MPXVAR_THSTART, merlinStartThresholdScan, 0, 1);
+    mpxShadowAdd(&shadow, MPXVAR_THSTOP, merlinStopThresholdScan, 0, 1);
+    mpxShadowAdd(&shadow, MPXVAR_THSTEP, merlinStepThresholdScan, 0, 1);
+    mpxShadowAdd(&shadow, MPXVAR_THSSCAN, merlinThresholdScan, 1, 1);
+}
+
+/** Marks the shadowed variable shown by param as written by a client, its
+ * parameter is then left alone by read backs until it has been sent.
+ * Called with the driver lock held.
+ */
+void merlinDetector::shadowWritten(int param)
+{
+    int i;
+
+    for (i = 0; i < shadow.count; i++)
+    {
+        if (shadow.var[i].param == param)
+        {
+            shadow.var[i].written = 1;
+        }
+    }
+}
+
+/** Starts a batch of shadowed commands, see merlinCommandTask */
+void merlinDetector::shadowBegin()
+{
+    int i;
+
+    cmdConnection->mpxBatchBegin();
+    for (i = 0; i < shadow.count; i++)
+    {
+        shadow.var[i].setIndex = -1;
+        shadow.var[i].getIndex = -1;
+        shadow.var[i].readback = 0;
+    }
+}
+
+/** Adds a SET to the batch unless the server already holds value, and
+ * marks the variables that it may change to be read back.
+ * Returns the batch index of the SET or -1 if it was not needed.
+ */
+int merlinDetector::shadowSet(char *name, const char *value)
+{
+    mpxShadowVar *var = mpxShadowFind(&shadow, name);
+    mpxShadowVar *dep;
+    int i;
+
+    if (var == NULL)
+    {
+        return cmdConnection->mpxBatchSet(name, value);
+    }
+    var->written = 0;
+    if (mpxShadowSame(var, value))
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                "%s:shadowSet: %s is already %s\n", driverName, name, value);
+        return -1;
+    }
+
+    var->setIndex = cmdConnection->mpxBatchSet(name, value);
+    for (i = 0; var->depends[i] != NULL; i++)
+    {
+        dep = mpxShadowFind(&shadow, var->depends[i]);
+        if (dep != NULL)
+        {
+            dep->readback = 1;
+        }
+    }
+    return var->setIndex;
+}
+
+/** Reads a shadowed variable back in the batch whatever the shadow holds */
+void merlinDetector::shadowGet(char *name)
+{
+    mpxShadowVar *var = mpxShadowFind(&shadow, name);
+
+    if (var != NULL)
+    {
+        var->readback = 1;
+    }
+}
+
+/** Adds the read backs to the batch, after all the SETs */
+void merlinDetector::shadowReadback()
+{
+    mpxShadowVar *var;
+    int i;
+
+    for (i = 0; i < shadow.count; i++)
+    {
+        var = &shadow.var[i];
+        if (var->readback)
+        {
+            var->getIndex = cmdConnection->mpxBatchGet((char *) var->name);
+        }
+    }
+}
+
+/** Adds a SET of every value that the server was known to hold to the
+ * batch, and a read back of it, to put the settings back after the server
+ * was reset or the connection was lost.
+ */
+void merlinDetector::shadowReplay()
+{
+    mpxShadowVar *var;
+    int i;
+
+    for (i = 0; i < shadow.count; i++)
+    {
+        var = &shadow.var[i];
+        if (var->valid)
+        {
+            var->setIndex = cmdConnection->mpxBatchSet((char *) var->name,
+                    var->value);
+            var->readback = 1;
+        }
+    }
+}
+
+/** Updates the shadow from the batch that has been run, and the parameters
+ * of the variables that were read unless a client has written them since
+ * the batch was built.
+ */
+void merlinDetector::shadowApply()
+{
+    mpxShadowVar *var;
+    mpxBatchItem *item;
+    int i;
+
+    for (i = 0; i < shadow.count; i++)
+    {
+        var = &shadow.var[i];
+        if (var->setIndex >= 0)
+        {
+            item = &cmdConnection->batch[var->setIndex];
+            var->valid = item->status == asynSuccess;
+            strcpy(var->value, item->value);
+        }
+        if (var->getIndex >= 0)
+        {
+            item = &cmdConnection->batch[var->getIndex];
+            var->valid = item->status == asynSuccess;
+            strcpy(var->value, item->value);
+            if (var->valid && var->param >= 0 && !var->written
+                    && var->isInteger)
+            {
+                setIntegerParam(var->param,
+                        (int) (atof(var->value) * var->scale));
+            }
+            else if (var->valid && var->param >= 0 && !var->written)
+            {
+                setDoubleParam(var->param, atof(var->value) * var->scale);
+            }
+        }
+        var->setIndex = -1;
+        var->getIndex = -1;
+        var->readback = 0;
+    }
+}
+
+static void merlinTaskC(void *drvPvt)
+{
+    merlinDetector *pPvt = (merlinDetector *) drvPvt;
+
+    pPvt->merlinTask();
+}
+
+static void merlinStatusC(void *drvPvt)
+{
+    merlinDetector *pPvt = (merlinDetector *) drvPvt;
+
+    pPvt->merlinStatus();
+}
+
+static void merlinDecodeTaskC(void *drvPvt)
+{
+    mpxDecodeWorker *worker = (mpxDecodeWorker *) drvPvt;
+
+    worker->pDetector->merlinDecodeTask(worker);
 }
 
-asynStatus merlinDetector::updateThresholdScanParms()
+static void merlinCallbackTaskC(void *drvPvt)
 {
-    asynStatus status = asynSuccess;
-    char valueStr[MPX_MAXLINE];
-    int thresholdScan;
-    double start, stop, step;
+    merlinDetector *pPvt = (merlinDetector *) drvPvt;
 
-    if (startingUp)
-        return asynSuccess;
+    pPvt->merlinCallbackTask();
+}
 
-    getDoubleParam(merlinStartThresholdScan, &start);
-    getDoubleParam(merlinStopThresholdScan, &stop);
-    getDoubleParam(merlinStepThresholdScan, &step);
-    getIntegerParam(merlinThresholdScan, &thresholdScan);
+static void merlinCommandTaskC(void *drvPvt)
+{
+    merlinDetector *pPvt = (merlinDetector *) drvPvt;
 
-    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", start);
-    status = cmdConnection->mpxSet(MPXVAR_THSTART, valueStr,
-            Labview_DEFAULT_TIMEOUT);
+    pPvt->merlinCommandTask();
+}
 
-    if (status == asynSuccess)
+/** Notes that a connection to the server has gone and wakes the command
+ * thread to remake it. Ignored if the connection has already been remade
+ * since the caller last used it.
+ * Called with the driver lock held.
+ * \param[in] reason status message to show
+ * \param[in] generation connectionGeneration when the caller last used it
+ * \param[in] dataOnly only the data channel failed, the command channel is
+ *            kept unless it fails as well
+ */
+void merlinDetector::connectionLost(const char *reason, int generation,
+        int dataOnly)
+{
+    if (generation != connectionGeneration
+            || connectionState != MPXConnected)
     {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%f", stop);
-        status = cmdConnection->mpxSet(MPXVAR_THSTOP, valueStr,
-                Labview_DEFAULT_TIMEOUT);
+        return;
     }
-    if (status == asynSuccess)
+
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:connectionLost: %s\n", driverName, reason);
+    connectionState = MPXConnectionLost;
+    connectionLostTime = mpxTimingNow();
+    commandLost = !dataOnly;
+    setIntegerParam(merlinConnectionState, connectionState);
+    setStringParam(ADStatusMessage, reason);
+    callParamCallbacks();
+    epicsEventSignal(commandEvent);
+}
+
+/** Remakes the connections that failed, then puts back the settings the
+ * server held from the shadow and lets merlinTask carry on. The connection
+ * only counts as made once the server answers on the command channel and
+ * the data channel is connected. Any acquisition that was
+ * running is ended as its frames will not come now.
+ * Runs in the command thread, called with the driver lock held.
+ */
+void merlinDetector::recoverConnection()
+{
+    char message[MAX_MESSAGE_SIZE];
+    double delay = 1;
+    double recoveryTime;
+    asynStatus status;
+    int recycleCommand = commandLost;
+    int adstatus;
+
+    connectionState = MPXReconnecting;
+    setIntegerParam(merlinConnectionState, connectionState);
+    getIntegerParam(ADStatus, &adstatus);
+    if (adstatus == ADStatusAcquire)
     {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%f", step);
-        status = cmdConnection->mpxSet(MPXVAR_THSTEP, valueStr,
-                Labview_DEFAULT_TIMEOUT);
+        scanStacking = 0;
+        setIntegerParam(ADAcquire, 0);
+        setIntegerParam(ADStatus, ADStatusError);
+        setIntegerParam(merlinArmed, 0);
     }
-    if (status == asynSuccess)
+    commandWork &= ~(MPXWorkStart | MPXWorkStop | MPXWorkReset);
+    softwareTriggers = 0;
+    setStringParam(ADStatusMessage, "Reconnecting to the server");
+    callParamCallbacks();
+    this->unlock();
+
+    while (1)
     {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%d", thresholdScan);
-        status = cmdConnection->mpxSet(MPXVAR_THSSCAN, valueStr,
-                Labview_DEFAULT_TIMEOUT);
+        // a server that is being reset needs time to go away
+        epicsThreadSleep(delay);
+        delay = MIN(delay * 2, MPX_RECONNECT_MAX_DELAY);
+
+        status = asynSuccess;
+        if (recycleCommand)
+        {
+            status = cmdConnection->mpxReconnect();
+        }
+        if (status == asynSuccess)
+        {
+            status = dataConnection->mpxReconnect();
+        }
+        if (status == asynSuccess)
+        {
+            // the server is back once it answers
+            cmdConnection->mpxFlush();
+            cmdConnection->mpxBatchBegin();
+            cmdConnection->mpxBatchGet(MPXVAR_GETSOFTWAREVERSION);
+            status = cmdConnection->mpxBatchRun(Labview_DEFAULT_TIMEOUT);
+            if (status != asynSuccess)
+            {
+                // the command channel has gone as well
+                recycleCommand = 1;
+            }
+        }
+        if (status == asynSuccess)
+        {
+            break;
+        }
     }
 
-    /* Read back the actual setting, in case we are out of bounds.*/
-    status = cmdConnection->mpxGet(MPXVAR_THSTART, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinStartThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSTEP, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinStepThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSTOP, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(merlinStopThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSSCAN, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(merlinThresholdScan,
-                atoi(cmdConnection->fromLabviewValue));
+    this->lock();
+    connectionState = MPXRestoring;
+    setIntegerParam(merlinConnectionState, connectionState);
+    callParamCallbacks();
 
-    return status;
+    shadowBegin();
+    shadowReplay();
+    shadowReadback();
+    this->unlock();
+    cmdConnection->mpxBatchRun(Labview_DEFAULT_TIMEOUT);
+    this->lock();
+    shadowApply();
+
+    // the settings that are not shadowed, and anything written meanwhile
+    requestCommand(MPXWorkAcquireParams | MPXWorkROI
+            | MPXWorkReadThresholds);
+
+    recoveryTime = (mpxTimingNow() - connectionLostTime) / 1e9;
+    reconnects++;
+    connectionGeneration++;
+    connectionState = MPXConnected;
+    setIntegerParam(merlinConnectionState, connectionState);
+    setDoubleParam(merlinRecoveryTime, recoveryTime);
+    setIntegerParam(merlinReconnects, reconnects);
+    // the Reset busy record completes once the server is back
+    setIntegerParam(merlinReset, 0);
+    epicsSnprintf(message, MAX_MESSAGE_SIZE, "Reconnected after %.1f s",
+            recoveryTime);
+    setStringParam(ADStatusMessage, message);
+    callParamCallbacks();
+    epicsEventSignal(dataReadyEvent);
 }
 
-static void merlinTaskC(void *drvPvt)
+/** This thread owns the command channel. It waits for work left by
+ * requestCommand, builds one batch for all of it from the parameters as
+ * they are then, and sends it without the driver lock so that writes and
+ * the frames never wait for the server. The results are applied with the
+ * lock held once the responses are in. */
+void merlinDetector::merlinCommandTask()
 {
-    merlinDetector *pPvt = (merlinDetector *) drvPvt;
+    char value[MPX_MAXLINE];
+    mpxBatchItem *item;
+    asynStatus status;
+    int work, triggers;
+    int startIndex;
+    int adstatus;
+    int i;
 
-    pPvt->merlinTask();
-}
+    this->lock();
+    while (1)
+    {
+        // what is written during iocInit waits for iocRunning
+        while (startingUp || (commandWork == 0 && softwareTriggers == 0
+                && connectionState == MPXConnected))
+        {
+            this->unlock();
+            epicsEventWait(commandEvent);
+            this->lock();
+        }
+        if (connectionState != MPXConnected)
+        {
+            recoverConnection();
+            continue;
+        }
+        work = commandWork;
+        commandWork = 0;
+        triggers = softwareTriggers;
+        softwareTriggers = 0;
+
+        // settings are refused while the server is acquiring
+        shadowBegin();
+        if (work & MPXWorkStop)
+            cmdConnection->mpxBatchCommand(MPXCMD_STOPACQUISITION);
+        if (work & MPXWorkQuadMode)
+            quadModeCommands();
+        if (work & MPXWorkAcquireParams)
+            setAcquireParams();
+        if (work & MPXWorkCounter1)
+            setModeCommands(merlinEnableCounter1);
+        if (work & MPXWorkContinuousRW)
+            setModeCommands(merlinContinuousRW);
+        if (work & MPXWorkThresholds)
+            thresholdCommands();
+        if (work & MPXWorkScanParams)
+            updateThresholdScanParms();
+        if (work & MPXWorkROI)
+            setROI();
+        if (work & MPXWorkProfileControl)
+        {
+            getIntegerParam(merlinProfileControl, &i);
+            epicsSnprintf(value, MPX_MAXLINE, "%d", i);
+            cmdConnection->mpxBatchSet(MPXCMD_PROFILECONTROL, value);
+        }
+        if (work & MPXWorkReadThresholds)
+            getThreshold();
+        if (work & MPXWorkArm)
+            armCommands();
+        if (work & MPXWorkVersion)
+            cmdConnection->mpxBatchGet(MPXVAR_GETSOFTWAREVERSION);
+        shadowReadback();
+
+        // the commands that do not fit in the batch wait for the next one,
+        // the triggers only go once the start has gone
+        startIndex = -1;
+        if ((work & MPXWorkStart) && cmdConnection->mpxBatchRoom() < 2)
+        {
+            commandWork |= MPXWorkStart;
+            softwareTriggers += triggers;
+            triggers = 0;
+        }
+        else if (work & MPXWorkStart)
+        {
+            if (startVar != NULL)
+            {
+                shadowSet(startVar, startValue);
+            }
+            startIndex = cmdConnection->mpxBatchCommand(startCommand);
+        }
+        if ((work & MPXWorkReset) && cmdConnection->mpxBatchRoom() < 1)
+        {
+            commandWork |= MPXWorkReset;
+            work &= ~MPXWorkReset;
+        }
+        i = cmdConnection->mpxBatchRoom() - ((work & MPXWorkReset) ? 1 : 0);
+        if (triggers > i)
+        {
+            softwareTriggers += triggers - i;
+            triggers = i;
+        }
+        for (i = 0; i < triggers; i++)
+            cmdConnection->mpxBatchCommand(MPXCMD_SOFTWARETRIGGER);
+        if (work & MPXWorkReset)
+            cmdConnection->mpxBatchCommand(MPXCMD_RESET);
 
-static void merlinStatusC(void *drvPvt)
-{
-    merlinDetector *pPvt = (merlinDetector *) drvPvt;
+        this->unlock();
+        status = cmdConnection->mpxBatchRun(Labview_DEFAULT_TIMEOUT);
+        this->lock();
 
-    pPvt->merlinStatus();
-}
+        shadowApply();
 
-/** This thread periodically read the detector status (temperature, humidity, etc.)
- It does not run if we are acquiring data, to avoid polling Labview when taking data.*/
-void merlinDetector::merlinStatus()
-{
-    int result = asynSuccess;
-    int status = 0;
-    int statusCode;
+        // the server drops the connections when it is reset
+        if (work & MPXWorkReset)
+        {
+            connectionLost("Server reset", connectionGeneration, 0);
+        }
+        else if (cmdConnection->mpxBatchLost())
+        {
+            connectionLost("Error in Labview command channel response",
+                    connectionGeneration, 0);
+        }
 
-// let the startup script complete before attempting I/O
-    epicsThreadSleep(4);
-    startingUp = 0;
+        getIntegerParam(ADStatus, &adstatus);
+        if (startIndex >= 0 && adstatus == ADStatusAcquire)
+        {
+            item = &cmdConnection->batch[startIndex];
+            if (item->status == asynSuccess)
+            {
+                // the server has started and is waiting for the triggers
+                setIntegerParam(merlinArmed, 1);
+                setDoubleParam(merlinArmLatency,
+                        (mpxTimingNow() - acquireRequested) / 1e6);
+            }
+            else
+            {
+                setIntegerParam(ADAcquire, 0);
+                setIntegerParam(ADStatus, ADStatusError);
+                setStringParam(ADStatusMessage,
+                        "Error: acquisition did not start");
+            }
+        }
+        if ((work & MPXWorkArm) && adstatus != ADStatusAcquire)
+        {
+            setStringParam(ADStatusMessage, status == asynSuccess ?
+                    "Ready to acquire" : "Error: arming failed");
+        }
+        if (status != asynSuccess)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:merlinCommandTask: %d commands, not all succeeded\n",
+                    driverName, cmdConnection->batchCount);
+        }
+        callParamCallbacks();
+    }
+}
 
+/** Called once iocInit has finished, when autosave has restored the
+ * settings and every record has been processed. The command thread then
+ * sends everything that was written during iocInit as one batch, along with
+ * the settings that are only sent at startup, and merlinTask starts.
+ */
+void merlinDetector::iocRunning()
+{
     this->lock();
+    startingUp = 0;
 
 // make sure important grouped variables are set to agree with
 // IOCs auto saved values
-    setAcquireParams();
-    setROI();
-    updateThresholdScanParms();
-    getThreshold();
-
-    result = cmdConnection->mpxGet(MPXVAR_GETSOFTWAREVERSION,
-            Labview_DEFAULT_TIMEOUT);
-    statusCode = atoi(cmdConnection->fromLabviewValue);
+    requestCommand(MPXWorkAcquireParams | MPXWorkROI | MPXWorkScanParams
+            | MPXWorkReadThresholds | MPXWorkVersion);
 
 // initial status
     setIntegerParam(ADStatus, ADStatusIdle);
-
+    callParamCallbacks();
     this->unlock();
 
+    epicsEventSignal(startupEvent);
+}
+
+/** This thread periodically read the detector status (temperature, humidity, etc.)
+ It does not run if we are acquiring data, to avoid polling Labview when taking data.*/
+void merlinDetector::merlinStatus()
+{
+    int status = 0;
+
     while (1)
     {
         epicsThreadSleep(4);
         this->lock();
         getIntegerParam(ADStatus, &status);
 
+        // the rates fall to 0 when the frames stop
+        if (mpxTimingNow() - timingStart >= 1000000000u)
+        {
+            publishTiming();
+            callParamCallbacks();
+        }
+
         if (status == ADStatusIdle)
         {
             setStringParam(ADStatusMessage, "Waiting for acquire command");
@@ -957,72 +3113,93 @@ void merlinDetector::merlinStatus()
 
 }
 
-/** sets one of the 6 modes for Merlin versions since Quad Merlin
- * these modes combine sensible combinations of 5 individual settings
- * on the device
- *
- * \param[in] mode the mode number
- */
-asynStatus merlinDetector::SetQuadMode(int mode)
+/** the 5 individual settings on the device that make up each of the quad
+ * modes and the number of frames that an exposure then gives */
+static asynStatus quadModeSettings(int mode, int *bits, int *colourMode,
+        int *enableCounter1, int *continuousRW, int *chargeSumming,
+        int *frames)
 {
-    char value[MPX_MAXLINE];
     asynStatus result = asynSuccess;
-    int bits = 12;
-    int colourMode = 0;
-    int enableCounter1 = 0;
-    int continuousRW = 0;
-    int chargeSumming = 0;
 
-    this->framesPerAcquire = 1;
+    *bits = 12;
+    *colourMode = 0;
+    *enableCounter1 = 0;
+    *continuousRW = 0;
+    *chargeSumming = 0;
+    *frames = 1;
 
     switch(mode)
     {
     case MPXQuadMode12Bit:
         break;
     case MPXQuadMode24Bit:
-        bits = 24;
+        *bits = 24;
         break;
     case MPXQuadMode2Threshold:
-        enableCounter1 = 1;
-        this->framesPerAcquire = 2;
-        enableCounter1 = 2;
+        *enableCounter1 = 1;
+        *frames = 2;
+        *enableCounter1 = 2;
         break;
     case MPXQuadModeContinuousRW:
-        continuousRW = 1;
+        *continuousRW = 1;
         break;
     case MPXQuadModeColour:
-        colourMode = 1;
-        enableCounter1 = 2;
-        this->framesPerAcquire = 8;
+        *colourMode = 1;
+        *enableCounter1 = 2;
+        *frames = 8;
         break;
     case MPXQuadModeSumming:
-        chargeSumming = 1;
-        enableCounter1 = 1;
+        *chargeSumming = 1;
+        *enableCounter1 = 1;
         break;
     default:
         result = asynError;
         break;
     }
+    return result;
+}
+
+/** sets one of the 6 modes for Merlin versions since Quad Merlin
+ * these modes combine sensible combinations of 5 individual settings
+ * on the device, which the command thread sends
+ *
+ * \param[in] mode the mode number
+ */
+asynStatus merlinDetector::SetQuadMode(int mode)
+{
+    asynStatus result;
+    int bits, colourMode, enableCounter1, continuousRW, chargeSumming;
+
+    result = quadModeSettings(mode, &bits, &colourMode, &enableCounter1,
+            &continuousRW, &chargeSumming, &this->framesPerAcquire);
 
     setIntegerParam(merlinCounterDepth, bits);
+    requestCommand(MPXWorkQuadMode);
+
+    return result;
+}
+
+/** Adds the settings of the current quad mode to the batch */
+void merlinDetector::quadModeCommands()
+{
+    char value[MPX_MAXLINE];
+    int mode, frames;
+    int bits, colourMode, enableCounter1, continuousRW, chargeSumming;
+
+    getIntegerParam(merlinQuadMerlinMode, &mode);
+    quadModeSettings(mode, &bits, &colourMode, &enableCounter1,
+            &continuousRW, &chargeSumming, &frames);
 
     epicsSnprintf(value, MPX_MAXLINE, "%d", bits);
-    cmdConnection->mpxSet(MPXVAR_COUNTERDEPTH, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_COUNTERDEPTH, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", enableCounter1);
-    cmdConnection->mpxSet(MPXVAR_ENABLECOUNTER1, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_ENABLECOUNTER1, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", continuousRW);
-    cmdConnection->mpxSet(MPXVAR_CONTINUOUSRW, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_CONTINUOUSRW, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", colourMode);
-    cmdConnection->mpxSet(MPXVAR_COLOURMODE, value,
-            Labview_DEFAULT_TIMEOUT);
+    shadowSet(MPXVAR_COLOURMODE, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", chargeSumming);
-    cmdConnection->mpxSet(MPXVAR_CHARGESUMMING, value,
-            Labview_DEFAULT_TIMEOUT);
-
-    return result;
+    shadowSet(MPXVAR_CHARGESUMMING, value);
 }
 
 /** Called when asyn clients call pasynInt32->write().
@@ -1032,21 +3209,19 @@ asynStatus merlinDetector::SetQuadMode(int mode)
  * \param[in] value Value to write. */
 asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
 {
-    char strVal[MPX_MAXLINE];
     int function = pasynUser->reason;
     int adstatus;
     int imageMode, imagesToAcquire, profileMaskParm;
     asynStatus status = asynSuccess;
     const char *functionName = "writeInt32";
+    epicsUInt64 acquireStart = mpxTimingNow();
 
     status = setIntegerParam(function, value);
+    shadowWritten(function);
 
     if (function == merlinReset)
     {
-        cmdConnection->mpxCommand(MPXCMD_RESET, Labview_DEFAULT_TIMEOUT);
-// I cannot successfully reconnect to the server after a reset
-// the only solution found so far is to restart the ioc
-        exit(0);
+        requestCommand(MPXWorkReset);
     }
     else if (function == merlinQuadMerlinMode)
     {
@@ -1054,12 +3229,23 @@ asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
     }
     else if (function == merlinSoftwareTrigger)
     {
-        cmdConnection->mpxCommand(MPXCMD_SOFTWARETRIGGER,
-                Labview_DEFAULT_TIMEOUT);
+        softwareTriggers++;
+        epicsEventSignal(commandEvent);
     }
     else if (function == ADAcquire)
     {
         getIntegerParam(ADStatus, &adstatus);
+        getIntegerParam(ADImageMode, &imageMode);
+        if (value && (adstatus == ADStatusIdle || adstatus == ADStatusError)
+                && imageMode == MPXThresholdScan && thresholdScanSteps() < 0)
+        {
+            // refused before anything is sent to the server
+            value = 0;
+            setIntegerParam(ADAcquire, 0);
+            setIntegerParam(ADStatus, ADStatusError);
+            setStringParam(ADStatusMessage,
+                    "Error: threshold scan step is zero or away from the stop");
+        }
         if (value && (adstatus == ADStatusIdle || adstatus == ADStatusError))
         {
             setIntegerParam(ADStatus, ADStatusAcquire);
@@ -1070,6 +3256,34 @@ asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
             // set number of images to acquire based on the capture mode
             getIntegerParam(ADImageMode, &imageMode);
             getIntegerParam(merlinProfileControl, &profileMaskParm);
+            scanStacking = 0;
+
+            // frames of an exposure with several counters are grouped from
+            // the first frame of this acquisition
+            getIntegerParam(merlinCounterGrouping, &counterGrouping);
+            if (framesPerAcquire <= 1)
+            {
+                counterGrouping = MPXCounterSeparate;
+            }
+            if (counterGroup != NULL)
+            {
+                counterGroup->release();
+                counterGroup = NULL;
+            }
+            counterFilled = 0;
+            counterPosition = 0;
+            lastCounter = -1;
+
+            // losses are counted for each acquisition
+            expectedFrame = 0;
+            missingFrames = 0;
+            duplicateFrames = 0;
+            resyncCount = 0;
+            discardedBytes = 0;
+            setIntegerParam(merlinMissingFrames, 0);
+            setIntegerParam(merlinDuplicateFrames, 0);
+            setIntegerParam(merlinResyncCount, 0);
+            setDoubleParam(merlinDiscardedBytes, 0);
 
             switch (imageMode)
             {
@@ -1084,11 +3298,18 @@ asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
                 imagesRemaining = -1;
                 break;
             case MPXThresholdScan:
-                double start, stop, step;
-                getDoubleParam(merlinStartThresholdScan, &start);
-                getDoubleParam(merlinStopThresholdScan, &stop);
-                getDoubleParam(merlinStepThresholdScan, &step);
-                imagesRemaining = (int) ((stop - start) / step);
+                // one image per step, the acquisition ends with the last
+                // step and the stack of steps goes out then
+                scanStepsExpected = thresholdScanSteps();
+                imagesRemaining = scanStepsExpected;
+                getIntegerParam(merlinScanStack, &scanStacking);
+                scanStepsDone = 0;
+                if (scanStack != NULL)
+                {
+                    scanStack->release();
+                    scanStack = NULL;
+                }
+                setIntegerParam(merlinScanSteps, 0);
                 setStringParam(ADStatusMessage, "Performing Threshold Scan...");
                 setIntegerParam(ADNumImages, 1); // internally Merlin does this so we set EPICS PV to match
                 break;
@@ -1099,42 +3320,46 @@ asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
                 break;
             }
 
+            // the command thread sends the start, ARMED is set when the
+            // server has started and is waiting for the triggers
+            startVar = NULL;
             if (imageMode == MPXThresholdScan)
             {
-                status = cmdConnection->mpxCommand(MPXCMD_THSCAN,
-                        Labview_DEFAULT_TIMEOUT);
+                startCommand = MPXCMD_THSCAN;
             }
             else if (imageMode == MPXBackgroundCalibrate)
             {
-                epicsSnprintf(strVal, MPX_MAXLINE, "%d", imagesToAcquire);
-                cmdConnection->mpxSet(MPXVAR_BACKGROUNDCOUNT, strVal,
-                        Labview_DEFAULT_TIMEOUT);
-                status = cmdConnection->mpxCommand(MPXCMD_BACKGROUNDACQUIRE,
-                        Labview_DEFAULT_TIMEOUT);
+                startVar = MPXVAR_BACKGROUNDCOUNT;
+                startCommand = MPXCMD_BACKGROUNDACQUIRE;
             }
             else // a standard image acquisition (or profile acquisition)
             {
-                epicsSnprintf(strVal, MPX_MAXLINE, "%d", imagesToAcquire);
-                cmdConnection->mpxSet(MPXVAR_NUMFRAMESTOACQUIRE, strVal,
-                        Labview_DEFAULT_TIMEOUT);
-
+                // already on the server if the detector was armed
+                startVar = MPXVAR_NUMFRAMESTOACQUIRE;
                 if (profileMaskParm & (MPXPROFILES_IMAGE == MPXPROFILES_IMAGE))
                 {
-                    cmdConnection->mpxCommand(MPXCMD_STARTACQUISITION,
-                            Labview_DEFAULT_TIMEOUT);
+                    startCommand = MPXCMD_STARTACQUISITION;
                 }
                 else
                 {
-                    cmdConnection->mpxCommand(MPXCMD_PROFILES,
-                            Labview_DEFAULT_TIMEOUT);
+                    startCommand = MPXCMD_PROFILES;
                 }
             }
+            epicsSnprintf(startValue, MPX_MAXLINE, "%d", imagesToAcquire);
+            acquireRequested = acquireStart;
+            requestCommand(MPXWorkStart);
         }
         if (!value && (adstatus == ADStatusAcquire))
         {
+            // an aborted scan is published with the steps it has
+            if (scanStack != NULL)
+            {
+                publishScanStack(0);
+            }
+            scanStacking = 0;
             setIntegerParam(ADStatus, ADStatusIdle);
-            cmdConnection->mpxCommand(MPXCMD_STOPACQUISITION,
-                    Labview_DEFAULT_TIMEOUT);
+            setIntegerParam(merlinArmed, 0);
+            requestCommand(MPXWorkStop);
         }
     }
     else if ((function == ADTriggerMode) || (function == ADNumImages)
@@ -1142,28 +3367,67 @@ asynStatus merlinDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
             || (function == merlinEnableBackgroundCorr)
             || (function == merlinEnableImageSum))
     {
-        setAcquireParams();
+        requestCommand(MPXWorkAcquireParams);
     }
     else if ((function == ADSizeX) || (function == ADSizeY)
             || (function == ADMinX) || (function == ADMinY))
     {
-        setROI();
+        requestCommand(MPXWorkROI);
+    }
+    else if (function == merlinEnableCounter1)
+    {
+        requestCommand(MPXWorkCounter1);
     }
-    else if ((function == merlinEnableCounter1
-            || function == merlinContinuousRW))
+    else if (function == merlinContinuousRW)
     {
-        setModeCommands(function);
+        requestCommand(MPXWorkContinuousRW);
     }
     else if (function == merlinThresholdApply)
     {
-        getThreshold();
+        requestCommand(MPXWorkReadThresholds);
+    }
+    else if (function == merlinRecordEnable)
+    {
+        status = setRecording(value);
+    }
+    else if (function == merlinFlatFieldCapture)
+    {
+        // the next FlatFieldFrames full size images are summed in pFlatField
+        flatCaptureRemaining = 0;
+        if (value && pFlatField != NULL && flatFactors[0] != NULL
+                && flatFactors[1] != NULL)
+        {
+            getIntegerParam(merlinFlatFieldFrames, &flatCaptureRemaining);
+            if (flatCaptureRemaining < 1)
+            {
+                flatCaptureRemaining = 1;
+                setIntegerParam(merlinFlatFieldFrames, 1);
+            }
+            memset(pFlatField->pData, 0, pFlatField->dataSize);
+        }
+        else if (value)
+        {
+            setIntegerParam(merlinFlatFieldCapture, 0);
+            status = asynError;
+        }
+        setIntegerParam(merlinFlatFieldCaptured, 0);
+    }
+    else if (function == merlinArm)
+    {
+        if (value)
+        {
+            status = armDetector();
+        }
+        setIntegerParam(merlinArm, 0);
+    }
+    else if (function == merlinBadPixelLoad)
+    {
+        status = loadBadPixelFile();
+        setIntegerParam(merlinBadPixelLoad, 0);
     }
     else if (function == merlinProfileControl)
     {
-        epicsSnprintf(strVal, MPX_MAXLINE, "%d", value);
-        cmdConnection->mpxSet(MPXCMD_PROFILECONTROL, strVal,
-                Labview_DEFAULT_TIMEOUT);
-        setIntegerParam(merlinProfileControl, value);
+        requestCommand(MPXWorkProfileControl);
     }
     else
     {
@@ -1198,87 +3462,32 @@ asynStatus merlinDetector::writeFloat64(asynUser *pasynUser,
     int function = pasynUser->reason;
     asynStatus status = asynSuccess;
     const char *functionName = "writeFloat64";
-    char value_str[MPX_MAXLINE];
     double oldValue;
 
     /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
      * status at the end, but that's OK */
     getDoubleParam(function, &oldValue);
     status = setDoubleParam(function, value);
+    shadowWritten(function);
 
     /* Changing any of the following parameters requires recomputing the base image */
-    if (function == merlinThreshold0)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD0, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold1)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD1, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold2)
+    if ((function == merlinThreshold0) || (function == merlinThreshold1)
+            || (function == merlinThreshold2) || (function == merlinThreshold3)
+            || (function == merlinThreshold4) || (function == merlinThreshold5)
+            || (function == merlinThreshold6) || (function == merlinThreshold7)
+            || (function == merlinOperatingEnergy))
     {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD2, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold3)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD3, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold4)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD4, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold5)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD5, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold6)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD6, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinThreshold7)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD7, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
-    else if (function == merlinOperatingEnergy)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_OPERATINGENERGY, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
+        requestCommand(MPXWorkThresholds);
     }
     else if ((function == ADAcquireTime) || (function == ADAcquirePeriod))
     {
-        setAcquireParams();
+        requestCommand(MPXWorkAcquireParams);
     }
     else if ((function == merlinStartThresholdScan)
             || (function == merlinStopThresholdScan)
             || (function == merlinStepThresholdScan))
     {
-        updateThresholdScanParms();
+        requestCommand(MPXWorkScanParams);
     }
     else
     {
@@ -1306,6 +3515,44 @@ asynStatus merlinDetector::writeFloat64(asynUser *pasynUser,
 }
 
 
+/** Called when asyn clients call pasynInt8Array->write().
+ * BadPixelMask takes a mask of the full image, one byte per pixel, non zero
+ * for a bad pixel.
+ * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+ * \param[in] value Array to write.
+ * \param[in] nElements Number of elements in the array. */
+asynStatus merlinDetector::writeInt8Array(asynUser *pasynUser,
+        epicsInt8 *value, size_t nElements)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    const char *functionName = "writeInt8Array";
+
+    if (function == merlinBadPixelMask)
+    {
+        if (nElements != (size_t) maxSize[0] * maxSize[1])
+        {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                    "%s:%s: mask of %lu pixels, the image has %u\n",
+                    driverName, functionName, (unsigned long) nElements,
+                    maxSize[0] * maxSize[1]);
+            setStringParam(ADStatusMessage,
+                    "Error: bad pixel mask is not the image size");
+            status = asynError;
+        }
+        else
+        {
+            status = setBadPixelMask((const epicsUInt8*) value);
+        }
+        callParamCallbacks();
+    }
+    else
+    {
+        status = ADDriver::writeInt8Array(pasynUser, value, nElements);
+    }
+    return status;
+}
+
 /** Report status of the driver.
  * Prints details about the driver if details>0.
  * It then calls the ADDriver::report() method.
@@ -1324,6 +3571,17 @@ void merlinDetector::report(FILE *fp, int details)
         getIntegerParam(NDDataType, &dataType);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        fprintf(fp, "  Pixel decode:      %s\n", mpxDecodeKernelName());
+        fprintf(fp, "  RAW unpack:        %s\n", mpxRawKernelName());
+        fprintf(fp, "  Decode threads:    %d\n", numDecodeThreads);
+        fprintf(fp, "  Frame buffers:     %d of %d bytes\n", numFrames,
+                frameBufferSize);
+        if (dataSocket != NULL)
+        {
+            fprintf(fp, "  Data socket:       %s, rcvbuf %d, busy poll %d us\n",
+                    dataSocket->address, dataSocket->actualBuffer,
+                    dataSocket->busyPoll);
+        }
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -1332,10 +3590,12 @@ void merlinDetector::report(FILE *fp, int details)
 extern "C" int merlinDetectorConfig(const char *portName,
         const char *LabviewCommandPort, const char *LabviewDataPort,
         int maxSizeX, int maxSizeY, int detectorType, int maxBuffers,
-        size_t maxMemory, int priority, int stackSize)
+        size_t maxMemory, int priority, int stackSize, int decodeThreads,
+        const char *dataSocket)
 {
     new merlinDetector(portName, LabviewCommandPort, LabviewDataPort, maxSizeX,
-            maxSizeY, detectorType, maxBuffers, maxMemory, priority, stackSize);
+            maxSizeY, detectorType, maxBuffers, maxMemory, priority, stackSize,
+            decodeThreads, dataSocket);
     return (asynSuccess);
 }
 
@@ -1356,19 +3616,26 @@ extern "C" int merlinDetectorConfig(const char *portName,
  *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
  * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
  * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+ * \param[in] decodeThreads The number of threads converting data frames to NDArrays while the next frames
+ *            are received. Set this to 0 to receive, convert and do callbacks all in one thread.
+ * \param[in] dataSocket If not NULL or empty, read the data channel from a socket of our own instead of
+ *            LabviewDataPort, given as host:port[,rcvbuf=<bytes>][,busypoll=<us>].
  */
 merlinDetector::merlinDetector(const char *portName,
         const char *LabviewCommandPort, const char *LabviewDataPort,
         int maxSizeX, int maxSizeY, int detectorType, int maxBuffers,
-        size_t maxMemory, int priority, int stackSize)
+        size_t maxMemory, int priority, int stackSize, int decodeThreads,
+        const char *dataSocket)
 
 :
-        ADDriver(portName, 1, NUM_merlin_PARAMS, maxBuffers, maxMemory,
+        ADDriver(portName, MPX_MAX_COUNTERS, NUM_merlin_PARAMS, maxBuffers,
+                maxMemory,
                 asynInt32ArrayMask | asynFloat64ArrayMask
-                        | asynGenericPointerMask | asynInt16ArrayMask,
+                        | asynGenericPointerMask | asynInt16ArrayMask
+                        | asynInt8ArrayMask,
                 asynInt32ArrayMask | asynFloat64ArrayMask
                         | asynGenericPointerMask | asynInt16ArrayMask,
-                ASYN_CANBLOCK, 1, /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=0, autoConnect=1 */
+                ASYN_CANBLOCK | ASYN_MULTIDEVICE, 1, /* a counter on each address, autoConnect=1 */
                 priority, stackSize),
         imagesRemaining(0)
 
@@ -1376,18 +3643,68 @@ merlinDetector::merlinDetector(const char *portName,
     int status = asynSuccess;
     const char *functionName = "merlinDetector";
     size_t dims[2];
+    char paramName[40];
+    int stage;
 
     startingUp = 1;
+    startupEvent = epicsEventCreate(epicsEventEmpty);
+    commandEvent = epicsEventCreate(epicsEventEmpty);
+    dataReadyEvent = epicsEventCreate(epicsEventEmpty);
     strcpy(LabviewCommandPortName, LabviewCommandPort);
     strcpy(LabviewDataPortName, LabviewDataPort);
 
     detType = (merlinDetectorType) detectorType;
+    // Merlin sends big endian pixels, the BPMs native byte order
+    swapPixels = (detType == Merlin || detType == MerlinQuad);
+    mpxDecodeInit();
+    mpxRawDecodeInit();
 
     /* Allocate the raw buffer we use to read image files.  Only do this once */
     dims[0] = maxSizeX;
     dims[1] = maxSizeY;
     /* Allocate the raw buffer we use for flat fields. */
     this->pFlatField = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+    this->flatFactors[0] = (float*) calloc(maxSizeX * maxSizeY, sizeof(float));
+    this->flatFactors[1] = (float*) calloc(maxSizeX * maxSizeY, sizeof(float));
+    this->flatCurrent = 0;
+    this->flatCaptureRemaining = 0;
+    this->averageFlatField = 0;
+    this->badPixelMap = NULL;
+    this->numGeometries = 0;
+    this->geometryMutex = epicsMutexMustCreate();
+    this->scanStacking = 0;
+    this->scanStepsExpected = 0;
+    this->scanStepsDone = 0;
+    this->scanStack = NULL;
+    this->counterGrouping = MPXCounterSeparate;
+    this->counterGroup = NULL;
+    this->counterFilled = 0;
+    this->counterPosition = 0;
+    this->lastCounter = -1;
+    for (stage = 0; stage < MPX_NUM_STAGES; stage++)
+    {
+        mpxTimingClear(&this->timing[stage]);
+    }
+    this->timingStart = mpxTimingNow();
+    this->timingFrames = 0;
+    this->timingBytes = 0;
+    this->expectedFrame = 0;
+    this->missingFrames = 0;
+    this->duplicateFrames = 0;
+    this->resyncCount = 0;
+    this->discardedBytes = 0;
+    // leave the server stopped whatever it was doing
+    this->commandWork = MPXWorkStop;
+    this->softwareTriggers = 0;
+    this->startCommand = MPXCMD_STARTACQUISITION;
+    this->startVar = NULL;
+    this->startValue[0] = 0;
+    this->acquireRequested = 0;
+    this->connectionState = MPXConnected;
+    this->connectionGeneration = 0;
+    this->connectionLostTime = 0;
+    this->commandLost = 0;
+    this->reconnects = 0;
 
     // merlin is upside down by area detector standards
     // this does not work - I need to invert using my own memory copy function
@@ -1398,13 +3715,30 @@ merlinDetector::merlinDetector(const char *portName,
     /* Connect to Labview */
     status = pasynOctetSyncIO->connect(LabviewCommandPort, 0,
             &this->pasynLabViewCmd, NULL);
-    status = pasynOctetSyncIO->connect(LabviewDataPort, 0,
-            &this->pasynLabViewData, NULL);
 
-    cmdConnection = new mpxConnection(pasynUserSelf, pasynLabViewCmd, this);
-    dataConnection = new mpxConnection(pasynUserSelf, pasynLabViewData, this);
+    this->dataSocket = NULL;
+    if (dataSocket != NULL && dataSocket[0] != 0)
+    {
+        this->dataSocket = mpxSocketCreate(dataSocket);
+        if (this->dataSocket == NULL)
+            printf("%s:%s: using %s for the data channel\n", driverName,
+                    functionName, LabviewDataPort);
+    }
+    if (this->dataSocket == NULL)
+    {
+        status = pasynOctetSyncIO->connect(LabviewDataPort, 0,
+                &this->pasynLabViewData, NULL);
+    }
+    else
+    {
+        // the data port is not used, trace the data channel on our own port
+        this->pasynLabViewData = pasynUserSelf;
+    }
 
-    cmdConnection->mpxCommand(MPXCMD_STOPACQUISITION, Labview_DEFAULT_TIMEOUT);
+    cmdConnection = new mpxConnection(pasynUserSelf, pasynLabViewCmd, this,
+            MPX_CMD_STREAM_BUFFER_LEN);
+    dataConnection = new mpxConnection(pasynUserSelf, pasynLabViewData, this,
+            MPX_DATA_STREAM_BUFFER_LEN, this->dataSocket);
 
     createParam(merlinDelayTimeString, asynParamFloat64, &merlinDelayTime);
     createParam(merlinThreshold0String, asynParamFloat64, &merlinThreshold0);
@@ -1461,6 +3795,83 @@ merlinDetector::merlinDetector(const char *portName,
             &merlinQuadMerlinMode);
     createParam(merlinSelectGuiString, asynParamOctet,
             &merlinSelectGui);
+    createParam(merlinZeroCopyString, asynParamInt32, &merlinZeroCopy);
+    createParam(merlinAttributeTemplateString, asynParamInt32,
+            &merlinAttributeTemplate);
+    createParam(merlinPackedOutputString, asynParamInt32,
+            &merlinPackedOutput);
+    createParam(merlinRecordPathString, asynParamOctet, &merlinRecordPath);
+    createParam(merlinRecordEnableString, asynParamInt32,
+            &merlinRecordEnable);
+    createParam(merlinRecordPublishString, asynParamInt32,
+            &merlinRecordPublish);
+    createParam(merlinRecordPreallocString, asynParamFloat64,
+            &merlinRecordPrealloc);
+    createParam(merlinRecordBytesString, asynParamFloat64,
+            &merlinRecordBytes);
+    createParam(merlinFlatFieldEnableString, asynParamInt32,
+            &merlinFlatFieldEnable);
+    createParam(merlinFlatFieldFloatString, asynParamInt32,
+            &merlinFlatFieldFloat);
+    createParam(merlinFlatFieldFramesString, asynParamInt32,
+            &merlinFlatFieldFrames);
+    createParam(merlinFlatFieldCaptureString, asynParamInt32,
+            &merlinFlatFieldCapture);
+    createParam(merlinFlatFieldCapturedString, asynParamInt32,
+            &merlinFlatFieldCaptured);
+    createParam(merlinFlatFieldValidString, asynParamInt32,
+            &merlinFlatFieldValid);
+    createParam(merlinFlatFieldAverageString, asynParamFloat64,
+            &merlinFlatFieldAverage);
+    createParam(merlinBadPixelEnableString, asynParamInt32,
+            &merlinBadPixelEnable);
+    createParam(merlinBadPixelFileString, asynParamOctet,
+            &merlinBadPixelFile);
+    createParam(merlinBadPixelLoadString, asynParamInt32,
+            &merlinBadPixelLoad);
+    createParam(merlinBadPixelMaskString, asynParamInt8Array,
+            &merlinBadPixelMask);
+    createParam(merlinBadPixelCountString, asynParamInt32,
+            &merlinBadPixelCount);
+    createParam(merlinBadPixelTimeString, asynParamFloat64,
+            &merlinBadPixelTime);
+    createParam(merlinChipAssemblyString, asynParamInt32,
+            &merlinChipAssembly);
+    createParam(merlinChipGapString, asynParamInt32, &merlinChipGap);
+    createParam(merlinScanStackString, asynParamInt32, &merlinScanStack);
+    createParam(merlinScanProgressString, asynParamInt32,
+            &merlinScanProgress);
+    createParam(merlinScanStepsString, asynParamInt32, &merlinScanSteps);
+    createParam(merlinCounterGroupingString, asynParamInt32,
+            &merlinCounterGrouping);
+    for (stage = 0; stage < MPX_NUM_STAGES; stage++)
+    {
+        epicsSnprintf(paramName, sizeof(paramName), merlinTimingP50Format,
+                mpxStageNames[stage]);
+        createParam(paramName, asynParamFloat64, &merlinTimingP50[stage]);
+        epicsSnprintf(paramName, sizeof(paramName), merlinTimingP99Format,
+                mpxStageNames[stage]);
+        createParam(paramName, asynParamFloat64, &merlinTimingP99[stage]);
+        epicsSnprintf(paramName, sizeof(paramName), merlinTimingMaxFormat,
+                mpxStageNames[stage]);
+        createParam(paramName, asynParamFloat64, &merlinTimingMax[stage]);
+    }
+    createParam(merlinFrameRateString, asynParamFloat64, &merlinFrameRate);
+    createParam(merlinDataRateString, asynParamFloat64, &merlinDataRate);
+    createParam(merlinMissingFramesString, asynParamInt32,
+            &merlinMissingFrames);
+    createParam(merlinDuplicateFramesString, asynParamInt32,
+            &merlinDuplicateFrames);
+    createParam(merlinResyncCountString, asynParamInt32, &merlinResyncCount);
+    createParam(merlinDiscardedBytesString, asynParamFloat64,
+            &merlinDiscardedBytes);
+    createParam(merlinArmString, asynParamInt32, &merlinArm);
+    createParam(merlinArmLatencyString, asynParamFloat64, &merlinArmLatency);
+    createParam(merlinConnectionStateString, asynParamInt32,
+            &merlinConnectionState);
+    createParam(merlinRecoveryTimeString, asynParamFloat64,
+            &merlinRecoveryTime);
+    createParam(merlinReconnectsString, asynParamInt32, &merlinReconnects);
 
     setStringParam(merlinSelectGui, "merlinEmbedded.edl");
 
@@ -1498,6 +3909,53 @@ merlinDetector::merlinDetector(const char *portName,
     status |= setIntegerParam(ADImageMode, ADImageContinuous);
     status |= setIntegerParam(ADTriggerMode, TMInternal);
     status |= setIntegerParam(merlinProfileControl, MPXPROFILES_IMAGE);
+    status |= setIntegerParam(merlinZeroCopy, 1);
+    status |= setIntegerParam(merlinAttributeTemplate, 0);
+    status |= setIntegerParam(merlinPackedOutput, 0);
+    status |= setStringParam(merlinRecordPath, "");
+    status |= setIntegerParam(merlinRecordEnable, 0);
+    status |= setIntegerParam(merlinRecordPublish, 1);
+    status |= setDoubleParam(merlinRecordPrealloc, 0);
+    status |= setDoubleParam(merlinRecordBytes, 0);
+    status |= setIntegerParam(merlinFlatFieldEnable, 0);
+    status |= setIntegerParam(merlinFlatFieldFloat, 0);
+    status |= setIntegerParam(merlinFlatFieldFrames, 10);
+    status |= setIntegerParam(merlinFlatFieldCapture, 0);
+    status |= setIntegerParam(merlinFlatFieldCaptured, 0);
+    status |= setIntegerParam(merlinFlatFieldValid, 0);
+    status |= setDoubleParam(merlinFlatFieldAverage, 0);
+    status |= setIntegerParam(merlinBadPixelEnable, 0);
+    status |= setStringParam(merlinBadPixelFile, "");
+    status |= setIntegerParam(merlinBadPixelLoad, 0);
+    status |= setIntegerParam(merlinBadPixelCount, 0);
+    status |= setDoubleParam(merlinBadPixelTime, 0);
+    status |= setIntegerParam(merlinChipAssembly, 0);
+    status |= setIntegerParam(merlinChipGap, 3);
+    status |= setIntegerParam(merlinScanStack, 0);
+    status |= setIntegerParam(merlinScanProgress, 0);
+    status |= setIntegerParam(merlinScanSteps, 0);
+    status |= setIntegerParam(merlinCounterGrouping, MPXCounterSeparate);
+    for (stage = 0; stage < MPX_NUM_STAGES; stage++)
+    {
+        status |= setDoubleParam(merlinTimingP50[stage], 0);
+        status |= setDoubleParam(merlinTimingP99[stage], 0);
+        status |= setDoubleParam(merlinTimingMax[stage], 0);
+    }
+    status |= setDoubleParam(merlinFrameRate, 0);
+    status |= setDoubleParam(merlinDataRate, 0);
+    status |= setIntegerParam(merlinMissingFrames, 0);
+    status |= setIntegerParam(merlinDuplicateFrames, 0);
+    status |= setIntegerParam(merlinResyncCount, 0);
+    status |= setDoubleParam(merlinDiscardedBytes, 0);
+    status |= setIntegerParam(merlinArmed, 0);
+    status |= setIntegerParam(merlinArm, 0);
+    status |= setDoubleParam(merlinArmLatency, 0);
+    status |= setIntegerParam(merlinConnectionState, MPXConnected);
+    status |= setDoubleParam(merlinRecoveryTime, 0);
+    status |= setIntegerParam(merlinReconnects, 0);
+
+    // nothing is known of the server until it has been set or read
+    initShadow();
 
     this->maxSize[0] = maxSizeX;
     this->maxSize[1] = maxSizeY;
@@ -1512,6 +3970,17 @@ merlinDetector::merlinDetector(const char *portName,
         return;
     }
 
+    /* Create the decode and callback threads of the acquisition pipeline */
+    aquisitionHeader[0] = 0;
+    templateAttr = new NDAttributeList;
+    templateValid = 0;
+    recorder = NULL;
+    status = createPipeline(decodeThreads);
+    if (status)
+    {
+        return;
+    }
+
     /* Create the thread that updates the images */
     status = (epicsThreadCreate("merlinDetTask", epicsThreadPriorityMedium,
             epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -1523,6 +3992,17 @@ merlinDetector::merlinDetector(const char *portName,
         return;
     }
 
+    /* Create the thread that talks to the server on the command channel */
+    status = (epicsThreadCreate("merlinCmdTask", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackBig),
+            (EPICSTHREADFUNC) merlinCommandTaskC, this) == NULL);
+    if (status)
+    {
+        printf("%s:%s epicsThreadCreate failure for command task\n",
+                driverName, functionName);
+        return;
+    }
+
     /* Create the thread that monitors detector status (temperature, humidity, etc). */
     status = (epicsThreadCreate("merlinStatusTask", epicsThreadPriorityMedium,
             epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -1534,6 +4014,9 @@ merlinDetector::merlinDetector(const char *portName,
         return;
     }
 
+    // only a driver that started completely is started by the initHook
+    nextDetector = firstDetector;
+    firstDetector = this;
 }
 
 /* Code for iocsh registration */
@@ -1557,25 +4040,47 @@ static const iocshArg merlinDetectorConfigArg8 =
 { "priority", iocshArgInt };
 static const iocshArg merlinDetectorConfigArg9 =
 { "stackSize", iocshArgInt };
+static const iocshArg merlinDetectorConfigArg10 =
+{ "decodeThreads", iocshArgInt };
+static const iocshArg merlinDetectorConfigArg11 =
+{ "dataSocket", iocshArgString };
 static const iocshArg * const merlinDetectorConfigArgs[] =
 { &merlinDetectorConfigArg0, &merlinDetectorConfigArg1,
         &merlinDetectorConfigArg2, &merlinDetectorConfigArg3,
         &merlinDetectorConfigArg4, &merlinDetectorConfigArg5,
         &merlinDetectorConfigArg6, &merlinDetectorConfigArg7,
-        &merlinDetectorConfigArg8, &merlinDetectorConfigArg9 };
+        &merlinDetectorConfigArg8, &merlinDetectorConfigArg9,
+        &merlinDetectorConfigArg10, &merlinDetectorConfigArg11 };
 static const iocshFuncDef configmerlinDetector =
-{ "merlinDetectorConfig", 9, merlinDetectorConfigArgs };
+{ "merlinDetectorConfig", 12, merlinDetectorConfigArgs };
 static void configmerlinDetectorCallFunc(const iocshArgBuf *args)
 {
     merlinDetectorConfig(args[0].sval, args[1].sval, args[2].sval,
             args[3].ival, args[4].ival, args[5].ival, args[6].ival,
-            args[7].ival, args[8].ival, args[9].ival);
+            args[7].ival, args[8].ival, args[9].ival, args[10].ival,
+            args[11].sval);
+}
+
+/** Starts the drivers once the IOC is running */
+static void merlinInitHook(initHookState state)
+{
+    merlinDetector *pDetector;
+
+    if (state != initHookAfterIocRunning)
+        return;
+
+    for (pDetector = firstDetector; pDetector != NULL;
+            pDetector = pDetector->nextDetector)
+    {
+        pDetector->iocRunning();
+    }
 }
 
 static void merlinDetectorRegister(void)
 {
 
     iocshRegister(&configmerlinDetector, configmerlinDetectorCallFunc);
+    initHookRegister(merlinInitHook);
 }
 
 extern "C"
@@ -8,15 +8,30 @@
 #ifndef MEDIPIXDETECTOR_H_
 #define MEDIPIXDETECTOR_H_
 
+#include <epicsEvent.h>
+#include <epicsRingPointer.h>
+#include <epicsTime.h>
+
+#include "mpxConnection.h"
+#include "mpxFrameHeader.h"
+#include "mpxRecorder.h"
+#include "mpxBadPixel.h"
+#include "mpxGeometry.h"
+#include "mpxTiming.h"
+#include "mpxShadow.h"
+
 /** Messages to/from Labview command channel */
 #define MAX_MESSAGE_SIZE 256
 #define MAX_FILENAME_LEN 256
-#define MAX_BAD_PIXELS 100
 /** Time to poll when reading from Labview */
 #define ASYN_POLL_TIME .01
 #define Labview_DEFAULT_TIMEOUT 2.0
+/** Longest wait between attempts to reconnect to the server */
+#define MPX_RECONNECT_MAX_DELAY 10.0
 /** Time between checking to see if image file is complete */
 #define FILE_READ_DELAY .01
+/** Number of chip layouts whose assembly tables are kept */
+#define MPX_GEOMETRY_CACHE 8
 
 #define DIMS 2
 
@@ -59,6 +74,47 @@ typedef enum
     MPXQuadModeSumming
 } MPXQuadMode_t;
 
+/** How the frames of the counters of one exposure are published */
+typedef enum
+{
+    MPXCounterSeparate,     /**< each counter as its own NDArray */
+    MPXCounterStack,        /**< one (x, y, counters) NDArray per exposure */
+    MPXCounterAddress       /**< each counter on its own asyn address */
+} MPXCounterGrouping_t;
+
+/** State of the connections to the server */
+typedef enum
+{
+    MPXConnected,       /**< both channels up */
+    MPXConnectionLost,  /**< waiting for the command thread to notice */
+    MPXReconnecting,    /**< remaking the connections */
+    MPXRestoring        /**< putting back the settings the server had */
+} MPXConnectionState_t;
+
+/** Work for the command thread, each is done once however many times it
+ * was asked for before the thread got to it */
+typedef enum
+{
+    MPXWorkQuadMode         = 0x0001,
+    MPXWorkAcquireParams    = 0x0002,
+    MPXWorkCounter1         = 0x0004,
+    MPXWorkContinuousRW     = 0x0008,
+    MPXWorkThresholds       = 0x0010,   /**< the thresholds that were written */
+    MPXWorkScanParams       = 0x0020,
+    MPXWorkROI              = 0x0040,
+    MPXWorkProfileControl   = 0x0080,
+    MPXWorkReadThresholds   = 0x0100,
+    MPXWorkVersion          = 0x0200,
+    MPXWorkArm              = 0x0400,
+    MPXWorkStop             = 0x0800,
+    MPXWorkStart            = 0x1000,   /**< startCommand */
+    MPXWorkReset            = 0x2000
+} MPXCommandWork_t;
+
+/** Most frames per exposure (colour mode), also the number of asyn
+ * addresses of the port */
+#define MPX_MAX_COUNTERS 8
+
 /** Merlin Individual Trigger types */
 
 #define TMTrigInternal  (char*)"0"
@@ -106,8 +162,91 @@ typedef enum
 // Merlin Quad
 #define merlinQuadMerlinModeString         "QUADMERLINMODE"
 #define merlinSelectGuiString              "SELECTGUI"
+#define merlinZeroCopyString               "ZERO_COPY"
+#define merlinAttributeTemplateString      "ATTRIBUTE_TEMPLATE"
+#define merlinPackedOutputString           "PACKED_OUTPUT"
+#define merlinRecordPathString             "RECORD_PATH"
+#define merlinRecordEnableString           "RECORD_ENABLE"
+#define merlinRecordPublishString          "RECORD_PUBLISH"
+#define merlinRecordPreallocString         "RECORD_PREALLOC"
+#define merlinRecordBytesString            "RECORD_BYTES"
+#define merlinFlatFieldEnableString        "FLAT_FIELD_ENABLE"
+#define merlinFlatFieldFloatString         "FLAT_FIELD_FLOAT"
+#define merlinFlatFieldFramesString        "FLAT_FIELD_FRAMES"
+#define merlinFlatFieldCaptureString       "FLAT_FIELD_CAPTURE"
+#define merlinFlatFieldCapturedString      "FLAT_FIELD_CAPTURED"
+#define merlinFlatFieldValidString         "FLAT_FIELD_VALID"
+#define merlinFlatFieldAverageString       "FLAT_FIELD_AVERAGE"
+#define merlinBadPixelEnableString         "BAD_PIXEL_ENABLE"
+#define merlinBadPixelFileString           "BAD_PIXEL_FILE"
+#define merlinBadPixelLoadString           "BAD_PIXEL_LOAD"
+#define merlinBadPixelMaskString           "BAD_PIXEL_MASK"
+#define merlinBadPixelCountString          "BAD_PIXEL_COUNT"
+#define merlinBadPixelTimeString           "BAD_PIXEL_TIME"
+#define merlinChipAssemblyString           "CHIP_ASSEMBLY"
+#define merlinChipGapString                "CHIP_GAP"
+#define merlinScanStackString              "THRESHOLD_SCAN_STACK"
+#define merlinScanProgressString           "THRESHOLD_SCAN_PROGRESS"
+#define merlinScanStepsString              "THRESHOLD_SCAN_STEPS"
+#define merlinCounterGroupingString        "COUNTER_GROUPING"
+// per stage timing, made for each stage as e.g. TIMING_WAIT_P50
+#define merlinTimingP50Format              "TIMING_%s_P50"
+#define merlinTimingP99Format              "TIMING_%s_P99"
+#define merlinTimingMaxFormat              "TIMING_%s_MAX"
+#define merlinFrameRateString              "FRAME_RATE"
+#define merlinDataRateString               "DATA_RATE"
+#define merlinMissingFramesString          "MISSING_FRAMES"
+#define merlinDuplicateFramesString        "DUPLICATE_FRAMES"
+#define merlinResyncCountString            "RESYNC_COUNT"
+#define merlinDiscardedBytesString         "DISCARDED_BYTES"
+#define merlinArmString                    "ARM"
+#define merlinArmLatencyString             "ARM_LATENCY"
+#define merlinConnectionStateString        "CONNECTION_STATE"
+#define merlinRecoveryTimeString           "RECOVERY_TIME"
+#define merlinReconnectsString             "RECONNECTS"
 
 class mpxConnection;
+class merlinDetector;
+
+/** A data channel frame on its way through the acquisition pipeline.
+ * merlinTask receives the frame, a decode thread converts the pixel data
+ * and the callback thread passes the NDArray to the plugins */
+typedef struct
+{
+    char *buffer;           // frame body, or just the header for zero copy
+    int bodySize;           // size of the frame body on the data channel
+    int received;           // number of bytes of the body in buffer
+    merlinDataHeader header;
+    int arrayCallbacks;     // NDArrayCallbacks when the frame was received
+    int zeroCopy;           // pixel data was read directly into pImage
+    int packed;             // 1 bit counters are to be output as a bitmap
+    int record;             // the frame is to be written by the recorder
+    const float *flatField; // flat field factors to apply, or NULL
+    int flatFieldFloat;     // output the corrected image as Float32
+    mpxBadPixelMap *badPixels;  // bad pixels to replace, or NULL
+    double badPixelTime;    // seconds spent replacing the bad pixels
+    int chipGap;            // gap to insert between chips, 0 for none
+    MqFrameHeader mqHeader; // decoded header of MQ1 frames
+    NDArray *pImage;
+    epicsTimeStamp startTime;
+    epicsUInt64 stageTime[MPX_NUM_STAGES];  // ns spent in each stage
+    int frameNumber;        // from the MQ1 header, -1 if not known
+    int resyncs;            // data channel resyncs since the last frame
+    double discardedBytes;  // and bytes thrown away
+    epicsUInt64 receiveTime;    // kernel time the header arrived in ns, or 0
+    const char *error;      // status message if the frame was not converted
+} mpxFrame;
+
+/** A decode thread and the queues joining it to the other stages.
+ * Frames are handed to the decode threads in turn so the callback thread
+ * gets them back in order by reading the output queues in the same turn */
+typedef struct
+{
+    merlinDetector *pDetector;
+    epicsRingPointerId input;
+    epicsRingPointerId output;
+    epicsEventId inputEvent;
+} mpxDecodeWorker;
 
 /** Driver for Dectris merlin pixel array detectors using their Labview server over TCP/IP socket */
 class merlinDetector: public ADDriver
@@ -116,20 +255,30 @@ public:
     merlinDetector(const char *portName, const char *LabviewCmdPort,
             const char *LabviewDataPort, int maxSizeX, int maxSizeY,
             int detectorType, int maxBuffers, size_t maxMemory, int priority,
-            int stackSize);
+            int stackSize, int decodeThreads, const char *dataSocket);
 
     /* These are the methods that we override from ADDriver */
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus writeInt8Array(asynUser *pasynUser, epicsInt8 *value,
+            size_t nElements);
 //    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value,
 //            size_t nChars, size_t *nActual);
     void report(FILE *fp, int details);
     void merlinTask(); /* This should be private but is called from C so must be public */
     void merlinStatus(); /* This should be private but is called from C so must be public */
+    void merlinDecodeTask(mpxDecodeWorker *worker); /* called from C */
+    void merlinCallbackTask(); /* called from C */
+    void merlinCommandTask(); /* called from C */
+    void iocRunning(); /* called from the initHook once iocInit is done */
+    merlinDetector *nextDetector; /* the drivers that the initHook calls */
 
     void fromLabViewStr(const char *str);
     void toLabViewStr(const char *str);
 
+    /* the replay benchmark (merlin_replay) runs the pipeline stages */
+    friend class mpxReplay;
+
 protected:
     int merlinDelayTime;
 #define FIRST_merlin_PARAM merlinDelayTime
@@ -162,8 +311,49 @@ protected:
     int merlinEnableImageSum;
     int merlinQuadMerlinMode;
     int merlinSelectGui;
-
-#define LAST_merlin_PARAM merlinSelectGui
+    int merlinZeroCopy;
+    int merlinAttributeTemplate;
+    int merlinPackedOutput;
+    int merlinRecordPath;
+    int merlinRecordEnable;
+    int merlinRecordPublish;
+    int merlinRecordPrealloc;
+    int merlinRecordBytes;
+    int merlinFlatFieldEnable;
+    int merlinFlatFieldFloat;
+    int merlinFlatFieldFrames;
+    int merlinFlatFieldCapture;
+    int merlinFlatFieldCaptured;
+    int merlinFlatFieldValid;
+    int merlinFlatFieldAverage;
+    int merlinBadPixelEnable;
+    int merlinBadPixelFile;
+    int merlinBadPixelLoad;
+    int merlinBadPixelMask;
+    int merlinBadPixelCount;
+    int merlinBadPixelTime;
+    int merlinChipAssembly;
+    int merlinChipGap;
+    int merlinScanStack;
+    int merlinScanProgress;
+    int merlinScanSteps;
+    int merlinCounterGrouping;
+    int merlinTimingP50[MPX_NUM_STAGES];
+    int merlinTimingP99[MPX_NUM_STAGES];
+    int merlinTimingMax[MPX_NUM_STAGES];
+    int merlinFrameRate;
+    int merlinDataRate;
+    int merlinMissingFrames;
+    int merlinDuplicateFrames;
+    int merlinResyncCount;
+    int merlinDiscardedBytes;
+    int merlinArm;
+    int merlinArmLatency;
+    int merlinConnectionState;
+    int merlinRecoveryTime;
+    int merlinReconnects;
+
+#define LAST_merlin_PARAM merlinReconnects
 
 private:
     /* These are the methods that are new to this class */
@@ -173,15 +363,63 @@ private:
     asynStatus setAcquireParams();
     asynStatus getThreshold();
     asynStatus updateThresholdScanParms();
+    int thresholdScanSteps();
     asynStatus setROI();
+    asynStatus armDetector();
+    void armCommands();
+    void quadModeCommands();
+    void thresholdCommands();
+    void prewarmBuffers();
+    void requestCommand(int work);
+    void connectionLost(const char *reason, int generation, int dataOnly);
+    void recoverConnection();
+    void initShadow();
+    void shadowWritten(int param);
+    void shadowBegin();
+    int shadowSet(char *name, const char *value);
+    void shadowGet(char *name);
+    void shadowReadback();
+    void shadowReplay();
+    void shadowApply();
 
     NDArray* copyProfileToNDArray32(size_t *dims, char *buffer,
             int profileMask);
     NDArray* copyToNDArray8(size_t *dims, char *buffer, int offset);
     NDArray* copyToNDArray16(size_t *dims, char *buffer, int offset);
     NDArray* copyToNDArray32(size_t *dims, char *buffer, int offset);
-    inline void endian_swap(unsigned short& x);
-    inline void endian_swap(unsigned int& x);
+    NDArray* copyRawToNDArray(mpxFrame *frame);
+    NDArray* copyToNDArrayPacked(size_t *dims, char *buffer, int offset);
+    void addPackedAttributes(NDArray *pImage, int xSize);
+    asynStatus createPipeline(int decodeThreads);
+    mpxFrame* getFreeFrame();
+    void releaseFrame(mpxFrame *frame);
+    asynStatus receiveFrame(mpxFrame *frame);
+    asynStatus receiveMqFrame(mpxFrame *frame);
+    void decodeFrame(mpxFrame *frame);
+    void convertFrame(mpxFrame *frame);
+    void applyFlatField(mpxFrame *frame);
+    void accumulateFlatField(NDArray *pImage);
+    void computeFlatField();
+    void applyBadPixels(mpxFrame *frame);
+    void releaseBadPixels(mpxFrame *frame);
+    asynStatus loadBadPixelFile();
+    asynStatus setBadPixelMask(const epicsUInt8 *mask);
+    void assembleChips(mpxFrame *frame);
+    mpxGeometry* getGeometry(int cols, int rows, int chipX, int chipY,
+            int gap);
+    int addScanStep(mpxFrame *frame, NDArray *pImage);
+    void publishScanStack(int partial);
+    int counterSlot(mpxFrame *frame);
+    int addCounterFrame(mpxFrame *frame, NDArray *pImage);
+    void publishCounterGroup();
+    void dropCounterGroup();
+    void publishFrame(mpxFrame *frame);
+    void addFrameTiming(mpxFrame *frame);
+    int checkFrameNumber(mpxFrame *frame);
+    void publishTiming();
+    void recordFrame(mpxFrame *frame);
+    asynStatus setRecording(int enable);
+    void applyAttributeTemplate(mpxFrame *frame, NDArray *pImage);
     inline void endian_swap(uint64_t& x);
     unsigned int maxSize[2];
 
@@ -197,15 +435,103 @@ private:
     int *profileX;
     int *profileY;
 
-    bool startingUp;  // used to avoid very chatty initialisation
+    bool startingUp;  // until iocInit is done, to avoid very chatty initialisation
+    epicsEventId startupEvent;  // signalled when startingUp is cleared
 
     char LabviewCommandPortName[20];
     char LabviewDataPortName[20];
 
     merlinDetectorType detType;
+    int swapPixels;  // image data arrives big endian
 
     mpxConnection *cmdConnection;
     mpxConnection *dataConnection;
+    mpxSocket *dataSocket;  // NULL when the data channel is an asyn port
+    mpxShadow shadow;       // what the server holds, see mpxShadow.h
+
+    /* merlinCommandTask is the only user of cmdConnection. Writes leave
+     * their work in commandWork and the task sends all that is waiting as
+     * one batch, built from the parameters at that time, so a value that
+     * is written several times before it is sent is only sent once */
+    epicsEventId commandEvent;
+    int commandWork;            // MPXCommandWork_t bits waiting
+    int softwareTriggers;       // triggers waiting
+    char *startCommand;         // the command for MPXWorkStart
+    char *startVar;             // variable set just before it, or NULL
+    char startValue[MPX_MAXLINE];
+    epicsUInt64 acquireRequested;   // when Acquire was written
+
+    /* a lost connection is remade by the command thread while merlinTask
+     * waits for dataReadyEvent. The generation goes up each time so that
+     * an error from before the reconnect does not start another one */
+    int connectionState;        // MPXConnectionState_t
+    int connectionGeneration;
+    epicsUInt64 connectionLostTime;
+    int commandLost;            // the command channel is to be remade too
+    int reconnects;
+    epicsEventId dataReadyEvent;
+
+    /* acquisition pipeline */
+    int frameBufferSize;
+    int numFrames;
+    mpxFrame *frames;
+    epicsRingPointerId freeFrames;   // callback thread -> merlinTask
+    epicsEventId freeFrameEvent;
+    int numDecodeThreads;            // 0 for decode and callbacks in merlinTask
+    mpxDecodeWorker *decodeWorkers;
+    epicsEventId decodedEvent;       // decode threads -> callback thread
+    char aquisitionHeader[MPX_ACQUISITION_HEADER_LEN + 1];
+
+    /* attributes shared by every frame of an acquisition, rebuilt when a
+     * new acquisition header arrives or the static header fields change */
+    NDAttributeList *templateAttr;
+    MqFrameHeader templateHeader;
+    int templateValid;
+
+    mpxRecorder *recorder;  // created when recording is first enabled
+
+    /* flat field correction, pFlatField holds the sum of the captured frames
+     * and the factors are double buffered so that a new capture does not
+     * change them under frames that are being decoded */
+    float *flatFactors[2];
+    int flatCurrent;
+    int flatCaptureRemaining;
+
+    /* the bad pixel map that new frames get, a map that has been replaced
+     * is freed when the last frame using it has been published */
+    mpxBadPixelMap *badPixelMap;
+
+    /* chip assembly tables, built on first use by a decode thread and kept
+     * for the life of the driver */
+    mpxGeometry *geometries[MPX_GEOMETRY_CACHE];
+    int numGeometries;
+    epicsMutexId geometryMutex;
+
+    /* threshold scan frames collected into one (x, y, steps) NDArray */
+    int scanStacking;       // the current scan is being collected
+    int scanStepsExpected;
+    int scanStepsDone;
+    NDArray *scanStack;     // allocated when the first step arrives
+
+    /* the counter frames of the exposure being grouped */
+    int counterGrouping;    // MPXCounterGrouping_t for this acquisition
+    NDArray *counterGroup;  // (x, y, framesPerAcquire)
+    int counterFilled;      // bit for each counter in counterGroup
+    int counterPosition;    // frames since the group was started
+    int lastCounter;        // Counter of the last frame added
+
+    /* stage times of the frames published since timingStart */
+    mpxTimingHistogram timing[MPX_NUM_STAGES];
+    epicsUInt64 timingStart;
+    int timingFrames;
+    double timingBytes;
+
+    /* loss accounting for the current acquisition */
+    int expectedFrame;      // next MQ1 frame number, 0 until one is seen
+    int missingFrames;
+    int duplicateFrames;
+    int resyncCount;
+    double discardedBytes;
 };
 
 #define NUM_merlin_PARAMS (&LAST_merlin_PARAM - &FIRST_merlin_PARAM + 1)
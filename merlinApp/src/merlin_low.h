@@ -36,6 +36,11 @@ extern int mpxDisconnect(void);
 #define MPX_IMG_HDR_MAX_CHIPS 16
 #define MPX_IMG_HDR_FULL_LEN MPX_IMG_HDR_LEN + MPX_IMG_HDR_DAC_LEN * MPX_IMG_HDR_MAX_CHIPS
 #define MPX_ACQUISITION_HEADER_LEN 2044
+// enough of a data frame body to identify its type and MQ1 header length
+#define MPX_DATA_PREFIX_LEN 32
+// size of the read buffers for the command and data channels
+#define MPX_CMD_STREAM_BUFFER_LEN (MPX_MAXLINE * 16)
+#define MPX_DATA_STREAM_BUFFER_LEN (256 * 1024)
 
 #define MPX_X_SIZE 256
 #define MPX_Y_SIZE 256
@@ -0,0 +1,770 @@
+/* merlin_replay.cpp
+ *
+ * Offline benchmark of the receive and decode path of the driver.
+ *
+ * Usage: merlin_replay [options] capture [capture ...]
+ *
+ *   -n repeats  number of times the captures are replayed (1)
+ *   -z 0|1      ZeroCopy (1)
+ *   -a 0|1      AttributeTemplate (0)
+ *   -p 0|1      PackedOutput for 1 bit frames (0)
+ *   -g gap      ChipAssembly with this ChipGap, -1 for no assembly (-1)
+ *
+ * A capture is either the data channel byte stream as sent by the detector
+ * (MPX prefixed HDR and MQ1 frames, e.g. from merlin_sim or a packet
+ * capture) or a MIB file written by the stream recorder, in which case the
+ * .hdr file next to it is sent first if there is one.
+ *
+ * The captures are loaded into memory and served by an in-memory asyn octet
+ * port standing in for the Labview data socket, a second one answers the
+ * command channel. A merlinDetector is created on these ports and each frame
+ * is put through the same stages as merlinTask does without decode threads:
+ * mpxReadHeader and receiveFrame, decodeFrame and publishFrame. The time
+ * taken by each stage is reported as percentiles for each pixel format,
+ * with the frames/s and MB/s achieved.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsStdio.h>
+#include <epicsExit.h>
+#include <epicsString.h>
+#include <asynDriver.h>
+#include <asynOctet.h>
+#include <asynOctetSyncIO.h>
+
+#include "ADDriver.h"
+
+#include "merlinDetector.h"
+#include "mpxConnection.h"
+#include "mpxFrameHeader.h"
+#include "mpxRawDecode.h"
+
+#define REPLAY_PORT "MERLIN_REPLAY"
+#define REPLAY_CMD_PORT "MERLIN_REPLAY_CMD"
+#define REPLAY_DATA_PORT "MERLIN_REPLAY_DATA"
+#define REPLAY_IDLE_PORT "MERLIN_REPLAY_IDLE"
+
+/** seconds to wait for the driver to finish starting up */
+#define REPLAY_STARTUP_TIMEOUT 30.
+
+#define REPLAY_MAX_CLASSES 16
+#define REPLAY_STAGES 3
+
+static const char *stageNames[REPLAY_STAGES] =
+{ "receive", "decode", "publish" };
+
+typedef enum
+{
+    replayCommand,      // answers every command with success
+    replayData,         // serves the captured stream
+    replayIdle          // blocks the reader for good
+} replayPortType;
+
+/** An in-memory asyn octet port */
+typedef struct
+{
+    replayPortType type;
+    const char *data;       // replayData: the stream and how far it has got
+    size_t len;
+    size_t pos;
+    int passes;             // times the stream is served
+    int passesDone;
+    char response[MPX_MAXLINE * 2];  // replayCommand: pending response
+    size_t responseLen;
+    size_t responsePos;
+    epicsEventId idleEvent;     // replayIdle: signalled when the reader
+    epicsEventId neverEvent;    // blocks on this
+    asynInterface common;
+    asynInterface octet;
+} replayPort;
+
+/** The stage times of the frames of one pixel format */
+typedef struct
+{
+    char name[32];
+    int frames;
+    double bytes;
+    double *times[REPLAY_STAGES];
+    int capacity;
+} replayClass;
+
+/* asynCommon methods */
+static void replayReport(void *drvPvt, FILE *fp, int details)
+{
+    replayPort *port = (replayPort *) drvPvt;
+
+    fprintf(fp, "replay port type %d, %lu of %lu bytes\n", port->type,
+            (unsigned long) port->pos, (unsigned long) port->len);
+}
+
+static asynStatus replayConnect(void *drvPvt, asynUser *pasynUser)
+{
+    pasynManager->exceptionConnect(pasynUser);
+    return asynSuccess;
+}
+
+static asynStatus replayDisconnect(void *drvPvt, asynUser *pasynUser)
+{
+    pasynManager->exceptionDisconnect(pasynUser);
+    return asynSuccess;
+}
+
+static asynCommon replayCommon =
+{ replayReport, replayConnect, replayDisconnect };
+
+/* asynOctet methods */
+
+/** a command is answered as the detector would with no error and, for a
+ * GET, a value of 0 */
+static asynStatus replayWrite(void *drvPvt, asynUser *pasynUser,
+        const char *data, size_t numchars, size_t *nbytesTransfered)
+{
+    replayPort *port = (replayPort *) drvPvt;
+    char request[MPX_MAXLINE];
+    char body[MPX_MAXLINE * 2];
+    char *type, *name, *save;
+    size_t len = numchars < sizeof(request) - 1 ?
+            numchars : sizeof(request) - 1;
+
+    *nbytesTransfered = numchars;
+    if (port->type != replayCommand)
+        return asynSuccess;
+
+    // MPX,<length>,<type>,<name>[,<value>]
+    memcpy(request, data, len);
+    request[len] = 0;
+    epicsStrtok_r(request, ",", &save);
+    epicsStrtok_r(NULL, ",", &save);
+    type = epicsStrtok_r(NULL, ",", &save);
+    name = epicsStrtok_r(NULL, ",", &save);
+    if (type == NULL || name == NULL)
+        return asynSuccess;
+
+    if (strcmp(type, MPX_GET) == 0)
+        epicsSnprintf(body, sizeof(body), ",%s,%s,0,0", type, name);
+    else
+        epicsSnprintf(body, sizeof(body), ",%s,%s,0", type, name);
+    port->responseLen = epicsSnprintf(port->response, sizeof(port->response),
+            "%s,%010u%s", MPX_HEADER, (unsigned) strlen(body), body);
+    port->responsePos = 0;
+    return asynSuccess;
+}
+
+static asynStatus replayRead(void *drvPvt, asynUser *pasynUser, char *data,
+        size_t maxchars, size_t *nbytesTransfered, int *eomReason)
+{
+    replayPort *port = (replayPort *) drvPvt;
+    size_t n = 0;
+
+    *nbytesTransfered = 0;
+    if (eomReason != NULL)
+        *eomReason = ASYN_EOM_CNT;
+
+    switch (port->type)
+    {
+    case replayCommand:
+        n = port->responseLen - port->responsePos;
+        if (n > maxchars)
+            n = maxchars;
+        memcpy(data, port->response + port->responsePos, n);
+        port->responsePos += n;
+        break;
+    case replayData:
+        if (port->pos == port->len && port->passesDone + 1 < port->passes)
+        {
+            port->pos = 0;
+            port->passesDone++;
+        }
+        n = port->len - port->pos;
+        if (n > maxchars)
+            n = maxchars;
+        memcpy(data, port->data + port->pos, n);
+        port->pos += n;
+        break;
+    case replayIdle:
+        epicsEventSignal(port->idleEvent);
+        epicsEventWait(port->neverEvent);
+        break;
+    }
+
+    *nbytesTransfered = n;
+    return n > 0 ? asynSuccess : asynTimeout;
+}
+
+static asynStatus replayFlush(void *drvPvt, asynUser *pasynUser)
+{
+    return asynSuccess;
+}
+
+static asynStatus replayRegisterInterruptUser(void *drvPvt,
+        asynUser *pasynUser, interruptCallbackOctet callback, void *userPvt,
+        void **registrarPvt)
+{
+    return asynError;
+}
+
+static asynStatus replayCancelInterruptUser(void *drvPvt, asynUser *pasynUser,
+        void *registrarPvt)
+{
+    return asynError;
+}
+
+static asynStatus replaySetEos(void *drvPvt, asynUser *pasynUser,
+        const char *eos, int eoslen)
+{
+    return asynSuccess;
+}
+
+static asynStatus replayGetEos(void *drvPvt, asynUser *pasynUser, char *eos,
+        int eossize, int *eoslen)
+{
+    *eoslen = 0;
+    return asynSuccess;
+}
+
+static asynOctet replayOctet =
+{ replayWrite, replayRead, replayFlush, replayRegisterInterruptUser,
+        replayCancelInterruptUser, replaySetEos, replayGetEos, replaySetEos,
+        replayGetEos };
+
+static replayPort* createPort(const char *portName, replayPortType type)
+{
+    replayPort *port = (replayPort *) calloc(1, sizeof(replayPort));
+
+    port->type = type;
+    port->passes = 1;
+    port->idleEvent = epicsEventMustCreate(epicsEventEmpty);
+    port->neverEvent = epicsEventMustCreate(epicsEventEmpty);
+    port->common.interfaceType = asynCommonType;
+    port->common.pinterface = &replayCommon;
+    port->common.drvPvt = port;
+    port->octet.interfaceType = asynOctetType;
+    port->octet.pinterface = &replayOctet;
+    port->octet.drvPvt = port;
+
+    // synchronous, the reads never wait for anything but memory (or for
+    // good on the idle port which nothing else uses)
+    if (pasynManager->registerPort(portName, 0, 1, 0, 0) != asynSuccess
+            || pasynManager->registerInterface(portName, &port->common)
+                    != asynSuccess
+            || pasynManager->registerInterface(portName, &port->octet)
+                    != asynSuccess)
+    {
+        printf("cannot register port %s\n", portName);
+        exit(EXIT_FAILURE);
+    }
+    return port;
+}
+
+/** Appends len bytes to the stream */
+static void append(char **stream, size_t *len, size_t *capacity,
+        const char *data, size_t n)
+{
+    if (*len + n > *capacity)
+    {
+        *capacity = (*len + n) * 2;
+        *stream = (char *) realloc(*stream, *capacity);
+        if (*stream == NULL)
+        {
+            printf("out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*stream + *len, data, n);
+    *len += n;
+}
+
+/** Appends a frame body with its MPX prefix */
+static void appendFrame(char **stream, size_t *len, size_t *capacity,
+        const char *body, size_t n)
+{
+    char prefix[MPX_MAXLINE];
+    int prefixLen;
+
+    // the length includes the comma after it
+    prefixLen = epicsSnprintf(prefix, sizeof(prefix), "%s,%010u,", MPX_HEADER,
+            (unsigned) n + 1);
+    append(stream, len, capacity, prefix, prefixLen);
+    append(stream, len, capacity, body, n);
+}
+
+static char* readFile(const char *path, size_t *len)
+{
+    FILE *fp;
+    char *data;
+    long size;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (char *) malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, fp) != (size_t) size)
+    {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+/** Returns the size of the MQ1 frame at body from its header, or 0 if the
+ * header cannot be decoded. Keeps the largest image size in maxX, maxY. */
+static size_t mqFrameSize(const char *body, size_t len, int *maxX, int *maxY)
+{
+    MqFrameHeader header;
+    int headerLen;
+
+    headerLen = mqHeaderLength(body, len);
+    if (headerLen <= 0 || (size_t) headerLen > len
+            || mqDecodeHeader(body, headerLen, &header) != 0)
+        return 0;
+
+    if (header.xSize > *maxX)
+        *maxX = header.xSize;
+    if (header.ySize > *maxY)
+        *maxY = header.ySize;
+
+    if (header.pixelFormat == 'R')
+    {
+        return headerLen + mpxRawDataBytes(header.xSize, header.ySize,
+                header.counterDepth);
+    }
+    return headerLen + (size_t) header.xSize * header.ySize
+            * (header.pixelDepth / 8);
+}
+
+/** Adds a capture to the stream, MIB files are given the MPX prefixes they
+ * had on the data channel */
+static void loadCapture(const char *path, char **stream, size_t *len,
+        size_t *capacity, int *maxX, int *maxY)
+{
+    size_t prefixLen = strlen(MPX_HEADER) + MPX_MSG_LEN_DIGITS + 2;
+    char hdrPath[MPX_MAXLINE];
+    char *data, *hdr, *dot;
+    size_t size, pos, frameLen, hdrLen;
+
+    data = readFile(path, &size);
+    if (data == NULL)
+    {
+        printf("cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strncmp(data, MPX_QUAD_DATA, MPX_MSG_DATATYPE_LEN) == 0)
+    {
+        // a MIB file, send the acquisition header recorded with it first
+        strncpy(hdrPath, path, sizeof(hdrPath) - 5);
+        hdrPath[sizeof(hdrPath) - 5] = 0;
+        dot = strrchr(hdrPath, '.');
+        if (dot == NULL || strchr(dot, '/') != NULL)
+            dot = hdrPath + strlen(hdrPath);
+        strcpy(dot, ".hdr");
+        hdr = readFile(hdrPath, &hdrLen);
+        if (hdr != NULL)
+        {
+            appendFrame(stream, len, capacity, hdr, hdrLen);
+            free(hdr);
+        }
+    }
+
+    pos = 0;
+    while (pos < size)
+    {
+        if (size - pos > prefixLen
+                && strncmp(data + pos, MPX_HEADER ",", strlen(MPX_HEADER) + 1)
+                        == 0)
+        {
+            // MPX framed, the frames go into the stream as they are
+            frameLen = prefixLen - 1
+                    + strtoul(data + pos + strlen(MPX_HEADER) + 1, NULL, 10);
+            if (frameLen > size - pos)
+                break;
+            if (strncmp(data + pos + prefixLen, MPX_QUAD_DATA,
+                    MPX_MSG_DATATYPE_LEN) == 0)
+            {
+                mqFrameSize(data + pos + prefixLen, frameLen - prefixLen,
+                        maxX, maxY);
+            }
+            append(stream, len, capacity, data + pos, frameLen);
+        }
+        else if (strncmp(data + pos, MPX_QUAD_DATA, MPX_MSG_DATATYPE_LEN)
+                == 0)
+        {
+            // an MQ1 frame of a MIB file, its size comes from the header
+            frameLen = mqFrameSize(data + pos, size - pos, maxX, maxY);
+            if (frameLen == 0)
+            {
+                printf("%s: bad MQ1 header at offset %lu\n", path,
+                        (unsigned long) pos);
+                exit(EXIT_FAILURE);
+            }
+            if (frameLen > size - pos)
+                break;
+            appendFrame(stream, len, capacity, data + pos, frameLen);
+        }
+        else
+        {
+            printf("%s: no MPX or MQ1 frame at offset %lu\n", path,
+                    (unsigned long) pos);
+            exit(EXIT_FAILURE);
+        }
+        pos += frameLen;
+    }
+
+    if (pos < size)
+    {
+        printf("%s: %lu bytes of a truncated frame ignored\n", path,
+                (unsigned long) (size - pos));
+    }
+    free(data);
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    int i = (int) (p / 100. * (n - 1) + 0.5);
+
+    return n > 0 ? sorted[i] : 0;
+}
+
+static replayClass* findClass(replayClass *classes, int *numClasses,
+        const MqFrameHeader *header)
+{
+    char name[32];
+    int i;
+
+    if (header->pixelFormat == 'R')
+    {
+        epicsSnprintf(name, sizeof(name), "R64/%d %dx%d",
+                header->counterDepth, header->xSize, header->ySize);
+    }
+    else
+    {
+        epicsSnprintf(name, sizeof(name), "%c%02d %dx%d",
+                header->pixelFormat, header->pixelDepth, header->xSize,
+                header->ySize);
+    }
+
+    for (i = 0; i < *numClasses; i++)
+    {
+        if (strcmp(classes[i].name, name) == 0)
+            return &classes[i];
+    }
+    if (*numClasses == REPLAY_MAX_CLASSES)
+        return NULL;
+
+    strcpy(classes[i].name, name);
+    (*numClasses)++;
+    return &classes[i];
+}
+
+static void addTimes(replayClass *c, const double *times, int bytes)
+{
+    int s;
+
+    if (c->frames == c->capacity)
+    {
+        c->capacity = c->capacity == 0 ? 1024 : c->capacity * 2;
+        for (s = 0; s < REPLAY_STAGES; s++)
+        {
+            c->times[s] = (double *) realloc(c->times[s],
+                    c->capacity * sizeof(double));
+        }
+    }
+    for (s = 0; s < REPLAY_STAGES; s++)
+    {
+        c->times[s][c->frames] = times[s];
+    }
+    c->frames++;
+    c->bytes += bytes;
+}
+
+static void reportClass(replayClass *c)
+{
+    double total = 0;
+    int i, s;
+
+    for (s = 0; s < REPLAY_STAGES; s++)
+    {
+        for (i = 0; i < c->frames; i++)
+        {
+            total += c->times[s][i];
+        }
+    }
+    if (c->frames == 0 || total <= 0)
+        return;
+
+    printf("\n%s: %d frames, %.1f frames/s, %.1f MB/s\n", c->name, c->frames,
+            c->frames / total, c->bytes / total / 1e6);
+    printf("  %-8s %10s %10s %10s %10s %10s\n", "stage", "p50 us", "p90 us",
+            "p99 us", "max us", "mean us");
+    for (s = 0; s < REPLAY_STAGES; s++)
+    {
+        double sum = 0;
+
+        for (i = 0; i < c->frames; i++)
+        {
+            sum += c->times[s][i];
+        }
+        qsort(c->times[s], c->frames, sizeof(double), compareDouble);
+        printf("  %-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", stageNames[s],
+                percentile(c->times[s], c->frames, 50) * 1e6,
+                percentile(c->times[s], c->frames, 90) * 1e6,
+                percentile(c->times[s], c->frames, 99) * 1e6,
+                c->times[s][c->frames - 1] * 1e6, sum / c->frames * 1e6);
+    }
+}
+
+/** Runs the stages of the acquisition pipeline on a merlinDetector, this
+ * class is a friend of the driver */
+class mpxReplay
+{
+public:
+    mpxReplay(merlinDetector *pDetector, replayPort *idle, replayPort *data);
+    int start(int zeroCopy, int attributeTemplate, int packed, int gap);
+    void run();
+    void report();
+
+private:
+    merlinDetector *pDetector;
+    replayPort *idlePort;
+    replayPort *dataPort;
+    replayClass classes[REPLAY_MAX_CLASSES];
+    int numClasses;
+    int otherFrames;
+    int errors;
+    double elapsed;
+};
+
+mpxReplay::mpxReplay(merlinDetector *pDetector, replayPort *idle,
+        replayPort *data)
+{
+    this->pDetector = pDetector;
+    this->idlePort = idle;
+    this->dataPort = data;
+    memset(classes, 0, sizeof(classes));
+    numClasses = 0;
+    otherFrames = 0;
+    errors = 0;
+    elapsed = 0;
+}
+
+/** Waits for merlinTask to block on the idle port and then takes over the
+ * data channel with a connection to the replay port */
+int mpxReplay::start(int zeroCopy, int attributeTemplate, int packed,
+        int gap)
+{
+    asynUser *pasynUser;
+
+    if (epicsEventWaitWithTimeout(idlePort->idleEvent,
+            REPLAY_STARTUP_TIMEOUT) != epicsEventWaitOK)
+    {
+        printf("merlinTask did not start\n");
+        return -1;
+    }
+
+    if (pasynOctetSyncIO->connect(REPLAY_DATA_PORT, 0, &pasynUser, NULL)
+            != asynSuccess)
+    {
+        printf("cannot connect to %s\n", REPLAY_DATA_PORT);
+        return -1;
+    }
+    pDetector->dataConnection = new mpxConnection(pDetector->pasynUserSelf,
+            pasynUser, pDetector, MPX_DATA_STREAM_BUFFER_LEN);
+
+    pDetector->lock();
+    pDetector->setIntegerParam(pDetector->NDArrayCallbacks, 1);
+    pDetector->setIntegerParam(pDetector->merlinZeroCopy, zeroCopy);
+    pDetector->setIntegerParam(pDetector->merlinAttributeTemplate,
+            attributeTemplate);
+    pDetector->setIntegerParam(pDetector->merlinPackedOutput, packed);
+    pDetector->setIntegerParam(pDetector->merlinChipAssembly, gap >= 0);
+    pDetector->setIntegerParam(pDetector->merlinChipGap, gap);
+    pDetector->unlock();
+    return 0;
+}
+
+/** Puts every frame of the stream through the stages as merlinTask does */
+void mpxReplay::run()
+{
+    mpxFrame *frame = pDetector->getFreeFrame();
+    epicsTimeStamp t0, t1, t2, t3, start;
+    double times[REPLAY_STAGES];
+    replayClass *c;
+    asynStatus status;
+
+    epicsTimeGetCurrent(&start);
+    while (1)
+    {
+        epicsTimeGetCurrent(&t0);
+        status = pDetector->dataConnection->mpxReadHeader(&frame->bodySize,
+                0);
+        if (status != asynSuccess)
+        {
+            if (dataPort->pos == dataPort->len
+                    && dataPort->passesDone + 1 >= dataPort->passes)
+                break;
+            errors++;
+            continue;
+        }
+
+        status = pDetector->receiveFrame(frame);
+        epicsTimeGetCurrent(&t1);
+        if (status != asynSuccess)
+        {
+            errors++;
+            continue;
+        }
+
+        pDetector->decodeFrame(frame);
+        epicsTimeGetCurrent(&t2);
+        if (frame->error != NULL)
+            errors++;
+
+        pDetector->lock();
+        pDetector->publishFrame(frame);
+        pDetector->unlock();
+        epicsTimeGetCurrent(&t3);
+
+        if (frame->header != MPXQuadDataHeader)
+        {
+            otherFrames++;
+            continue;
+        }
+
+        times[0] = epicsTimeDiffInSeconds(&t1, &t0);
+        times[1] = epicsTimeDiffInSeconds(&t2, &t1);
+        times[2] = epicsTimeDiffInSeconds(&t3, &t2);
+        c = findClass(classes, &numClasses, &frame->mqHeader);
+        if (c != NULL)
+        {
+            addTimes(c, times, frame->bodySize + MPX_MSG_LEN_DIGITS
+                    + strlen(MPX_HEADER) + 2);
+        }
+    }
+    elapsed = epicsTimeDiffInSeconds(&t0, &start);
+    pDetector->releaseFrame(frame);
+}
+
+void mpxReplay::report()
+{
+    int frames = 0;
+    int i;
+
+    for (i = 0; i < numClasses; i++)
+    {
+        frames += classes[i].frames;
+        reportClass(&classes[i]);
+    }
+
+    printf("\n%d MQ1 frames, %d other frames, %d errors in %.3f s",
+            frames, otherFrames, errors, elapsed);
+    if (elapsed > 0)
+    {
+        printf(": %.1f frames/s, %.1f MB/s", frames / elapsed,
+                dataPort->len * (double) dataPort->passes / elapsed / 1e6);
+    }
+    printf("\n");
+}
+
+static void usage(const char *name)
+{
+    printf("Use: %s [-n repeats] [-z 0|1] [-a 0|1] [-p 0|1] [-g gap] "
+            "capture [capture ...]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int repeats = 1, zeroCopy = 1, attributeTemplate = 0, packed = 0;
+    int gap = -1;
+    int maxX = 0, maxY = 0;
+    char *stream = NULL;
+    size_t len = 0, capacity = 0;
+    replayPort *dataPort, *idlePort;
+    merlinDetector *pDetector;
+    mpxReplay *replay;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:z:a:p:g:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 'z':
+            zeroCopy = atoi(optarg);
+            break;
+        case 'a':
+            attributeTemplate = atoi(optarg);
+            break;
+        case 'p':
+            packed = atoi(optarg);
+            break;
+        case 'g':
+            gap = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || repeats < 1)
+        usage(argv[0]);
+
+    for (; optind < argc; optind++)
+    {
+        loadCapture(argv[optind], &stream, &len, &capacity, &maxX, &maxY);
+    }
+    if (len == 0 || maxX == 0)
+    {
+        printf("no MQ1 frames in the captures\n");
+        return EXIT_FAILURE;
+    }
+    printf("Replaying %.1f MB %d times, images up to %dx%d\n", len / 1e6,
+            repeats, maxX, maxY);
+
+    createPort(REPLAY_CMD_PORT, replayCommand);
+    idlePort = createPort(REPLAY_IDLE_PORT, replayIdle);
+    dataPort = createPort(REPLAY_DATA_PORT, replayData);
+    dataPort->data = stream;
+    dataPort->len = len;
+    dataPort->passes = repeats;
+
+    // merlinTask reads the idle port so that the data port is left to the
+    // replay, the chip gap may make the images larger than the frames
+    pDetector = new merlinDetector(REPLAY_PORT, REPLAY_CMD_PORT,
+            REPLAY_IDLE_PORT, maxX + 64, maxY + 64, MerlinQuad, 0, 0,
+            epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium), 0, NULL);
+    // there is no iocInit here
+    pDetector->iocRunning();
+
+    replay = new mpxReplay(pDetector, idlePort, dataPort);
+    if (replay->start(zeroCopy, attributeTemplate, packed, gap) != 0)
+        return EXIT_FAILURE;
+    replay->run();
+    replay->report();
+
+    epicsExit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
+}
@@ -1,8 +1,27 @@
 /**
- * Simple TCP server to simulate a merlin Labview system.
- * Arguments:
- *   port number - port number to listen for connections
- * 
+ * TCP server simulating a Merlin Labview system, also used as a load
+ * generator for benchmarking the receive path of the driver.
+ *
+ * Usage: merlin_sim [options] {command port} {data port}
+ *
+ *   -l layout   sensor layout 1x1 (Merlin, default), 2x2 (Quad) or Nx1
+ *   -n chips    number of chips for the Nx1 layout (default 4)
+ *   -d depth    counter depth 1, 6, 12 or 24 until the client sets
+ *               COUNTERDEPTH (default 12)
+ *   -r          send RAW (R64) frames instead of counts
+ *   -f rate     frames per second, 0 for as fast as the link allows. By
+ *               default the ACQUISITIONPERIOD set by the client is used.
+ *   -t count    number of distinct frame templates cycled through (16)
+ *   -s          send the pixel data with sendfile instead of writev
+ *   -b bytes    socket send buffer size of the data channel
+ *   -p seconds  interval between rate reports (1)
+ *   -v          print the command channel traffic
+ *
+ * The data channel carries an HDR acquisition header and then MQ1 frames as
+ * the detector sends them. The pixel data of all frames is built before the
+ * acquisition starts, only the frame number and time stamp of the header
+ * are filled in as each frame is sent.
+ *
  * Matthew Pearson
  * Oct 2011
  *
@@ -10,47 +29,171 @@
  * Jan 2012
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <string.h>
-#include <signal.h>
 #include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdint.h>
-
 #include <time.h>
 
 #define MAXLINE 256
-#define MAXDATA 256*256*2*2 // 256 X by 256 Y by 2 bytes per pixel * 2 for 24 bit depth (= 32 bits data)
-#define DATAHEADERLEN 252
-#define MPX_PROFILE_LEN 256 * 8
-#define MPX_SUM_LEN 4
-#define CMDLEN 4
 #define HEADER_LEN 15 // this includes 2 commas + the header and length fields
-/*Function prototypes.*/
-void sig_chld(int signo);
-int echo_request(int socket_fd);
-int produce_data(int socket_fd);
-void *commandThread(void* command_fd);
-void *dataThread(void* data_fd);
-int produce_data(int data_fd);
+#define ACQ_HEADER_LEN 2044 // body of an HDR frame
+#define MQ_HEADER_LEN 256 // MQ1 header of a frame, plus
+#define MQ_DAC_LEN 128 // this for each chip
+#define MAX_CHIPS 16
+#define CHIP_SIZE 256
+#define MAX_SETTINGS 64
+#define THSCAN_DEFAULT_STEPS 7
+
+/** command line options */
+typedef struct
+{
+    int cols;
+    int rows;
+    char layout[8];
+    int depth;
+    int raw;
+    double frameRate;       // < 0 to use the acquisition period
+    int templates;
+    int useSendfile;
+    int sendBuffer;
+    double reportPeriod;
+    int verbose;
+} simOptions;
+
+/** the values last SET by the client, returned by GET */
+typedef struct
+{
+    char name[32];
+    char value[64];
+} simSetting;
+
+/** An acquisition ready to send: the header of one frame, patched for each
+ * frame, and the pixel data of the templates one after another */
+typedef struct
+{
+    char header[HEADER_LEN + MQ_HEADER_LEN + MQ_DAC_LEN * MAX_CHIPS];
+    size_t headerLen;
+    size_t frameNumberPos;  // of the 6 digit frame number in header
+    size_t timeStampPos;    // of the 26 character time stamp
+    char* pixels;
+    size_t dataBytes;       // per frame
+    int templates;
+    int fd;                 // pixels as a file for sendfile, or -1
+    int depth;
+    int raw;
+} simFrames;
 
-int frame_count = 0;
-int frames_to_send = 0;
+/*Function prototypes.*/
+static int echo_request(int socket_fd);
+static int produce_data(int data_fd);
+static void *commandThread(void* command_fd);
+static void *dataThread(void* data_fd);
+
+static simOptions options =
+{ 1, 1, "1x1", 12, 0, -1, 16, 0, 0, 1.0, 0 };
+
+/* state shared by the two threads, protected by do_data_mutex */
+static int frame_count = 1;
+static int frames_to_send = 0;
+static int depth = 12;
+static double acquisition_period = 0; // ms
+static double th_start = 0, th_stop = 0, th_step = 0;
+static int acquiring = 0;
+static int stop_acquisition = 0;
+static simSetting settings[MAX_SETTINGS];
+static int num_settings = 0;
+
+static int incrementer = 0;
+
+static int data_exit = 0;
+static int do_data = 0;
+static pthread_mutex_t do_data_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t do_data_cond = PTHREAD_COND_INITIALIZER;
+
+static void usage(const char* name)
+{
+    printf("  ERROR: Use: %s [-l 1x1|2x2|Nx1] [-n chips] [-d depth] [-r] "
+            "[-f rate] [-t templates] [-s] [-b bytes] [-p seconds] [-v] "
+            "{command socket} {data socket}\n", name);
+    exit(EXIT_FAILURE);
+}
 
-int incrementer = 0;
+static void parse_options(int argc, char *argv[])
+{
+    int opt;
+    int chips = 4;
 
-int data_exit = 0;
-int do_data = 0;
-pthread_mutex_t do_data_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t do_data_cond = PTHREAD_COND_INITIALIZER;
+    while ((opt = getopt(argc, argv, "l:n:d:rf:t:sb:p:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            strncpy(options.layout, optarg, sizeof(options.layout) - 1);
+            break;
+        case 'n':
+            chips = atoi(optarg);
+            break;
+        case 'd':
+            options.depth = atoi(optarg);
+            break;
+        case 'r':
+            options.raw = 1;
+            break;
+        case 'f':
+            options.frameRate = atof(optarg);
+            break;
+        case 't':
+            options.templates = atoi(optarg);
+            break;
+        case 's':
+            options.useSendfile = 1;
+            break;
+        case 'b':
+            options.sendBuffer = atoi(optarg);
+            break;
+        case 'p':
+            options.reportPeriod = atof(optarg);
+            break;
+        case 'v':
+            options.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-int Depth = 12;
+    if (!strcmp(options.layout, "Nx1"))
+    {
+        options.cols = chips;
+        options.rows = 1;
+    }
+    else if (sscanf(options.layout, "%dx%d", &options.cols, &options.rows)
+            != 2)
+    {
+        usage(argv[0]);
+    }
+    if (options.cols < 1 || options.rows < 1
+            || options.cols * options.rows > MAX_CHIPS
+            || (options.depth != 1 && options.depth != 6
+                    && options.depth != 12 && options.depth != 24)
+            || options.templates < 1 || options.reportPeriod <= 0)
+    {
+        usage(argv[0]);
+    }
+    depth = options.depth;
+}
 
 int main(int argc, char *argv[])
 {
@@ -58,51 +201,48 @@ int main(int argc, char *argv[])
     socklen_t client_size;
     struct sockaddr_in server_addr, client_addr, server_addr_data,
             client_addr_data;
+    int on = 1;
 
     pthread_t tid, tid_data;
 
-    printf("Started Merlin simulation server...\n");
+    parse_options(argc, argv);
+    if (argc - optind != 2)
+        usage(argv[0]);
 
-    if (argc != 3)
-    {
-        printf("  ERROR: Use: %s {command socket} {data socket}\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+    printf("Started Merlin simulation server, %s layout of %d chips, "
+            "%s frames...\n", options.layout, options.cols * options.rows,
+            options.raw ? "RAW" : "counts");
 
     /* Create a TCP socket.*/
     fd = socket(AF_INET, SOCK_STREAM, 0);
     fd_data = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd_data, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
     /* Create and initialise a socket address structure.*/
     memset(&server_addr, 0, sizeof(struct sockaddr_in));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY );
-    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_port = htons(atoi(argv[optind]));
 
     memset(&server_addr_data, 0, sizeof(struct sockaddr_in));
     server_addr_data.sin_family = AF_INET;
     server_addr_data.sin_addr.s_addr = htonl(INADDR_ANY );
-    server_addr_data.sin_port = htons(atoi(argv[2]));
+    server_addr_data.sin_port = htons(atoi(argv[optind + 1]));
 
     /* Bind the socket address to the socket buffer.*/
-    bind(fd, (struct sockaddr *) &server_addr, sizeof(server_addr));
-    bind(fd_data, (struct sockaddr *) &server_addr_data,
-            sizeof(server_addr_data));
-
-    /* data socket timeout	 */
-    struct timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-
-    setsockopt(fd_data, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout,
-            sizeof(timeout));
+    if (bind(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0
+            || bind(fd_data, (struct sockaddr *) &server_addr_data,
+                    sizeof(server_addr_data)) < 0)
+    {
+        perror(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     /* Listen for incoming connections. */
     listen(fd, 10);
     listen(fd_data, 10);
 
-    /* Install signal handler to clean up children.*/
-    //  signal(SIGCHLD, sig_chld);
     /*Loop forever.*/
     while (1)
     {
@@ -124,66 +264,62 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (fd2 > 0)
+        /*Data socket*/
+        printf("Waiting for data socket...\n");
+        client_size = sizeof(client_addr_data);
+        if ((fd2_data = accept(fd_data, (struct sockaddr *) &client_addr_data,
+                &client_size)) < 0)
         {
-
-            /*Data socket*/
-            printf("Waiting for data socket...\n");
-            client_size = sizeof(client_addr_data);
-            if ((fd2_data = accept(fd_data,
-                    (struct sockaddr *) &client_addr_data, &client_size)) < 0)
-            {
-                if (errno == EINTR)
-                {
-                    continue; /*Deal with interupted system call, since this blocks.*/
-                }
-                else
-                {
-                    perror(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-            }
-
-            if (fd2_data > 0)
+            close(fd2);
+            if (errno == EINTR)
             {
-                pthread_create(&tid, NULL, &commandThread, (void *) fd2);
-                pthread_create(&tid_data, NULL, &dataThread, (void *) fd2_data);
-
-                /*Block here waiting for the threads to finish. This only allows a single client to
-                 connect, to keep it simple.*/
-                pthread_join(tid, NULL );
-                printf("thread 1 finished.\n");
-                pthread_join(tid_data, NULL );
-                printf("thread 2 finished.\n");
+                continue; /*Deal with interupted system call, since this blocks.*/
             }
             else
             {
-                close(fd2);
+                perror(argv[0]);
+                exit(EXIT_FAILURE);
             }
         }
 
+        if (options.sendBuffer > 0)
+        {
+            setsockopt(fd2_data, SOL_SOCKET, SO_SNDBUF, &options.sendBuffer,
+                    sizeof(options.sendBuffer));
+        }
+
+        pthread_create(&tid, NULL, &commandThread,
+                (void *) (intptr_t) fd2);
+        pthread_create(&tid_data, NULL, &dataThread,
+                (void *) (intptr_t) fd2_data);
+
+        /*Block here waiting for the threads to finish. This only allows a single client to
+         connect, to keep it simple.*/
+        pthread_join(tid, NULL );
+        printf("Command connection closed.\n");
+        pthread_join(tid_data, NULL );
+        printf("Data connection closed.\n");
     }
 
     /*Should never get here.*/
     printf("Finishing Merlin server.\n");
     return EXIT_SUCCESS;
-
 }
 
-void * commandThread(void *command_fd)
+static void *commandThread(void *command_fd)
 {
-    printf("Started commandThread.\n");
+    int fd = (int) (intptr_t) command_fd;
 
-    if (echo_request((int) command_fd) != EXIT_SUCCESS)
+    if (echo_request(fd) != EXIT_SUCCESS)
     {
         printf("  Client failed to handle protocol, or connection closed.\n");
         /*close connected socket*/
-        close((int) command_fd);
+        close(fd);
         /*signal data thread to exit.*/
-        printf("***signalling data thread to exit.\n");
         pthread_mutex_lock(&do_data_mutex);
         do_data = 1;
         data_exit = 1;
+        stop_acquisition = 1;
         pthread_cond_signal(&do_data_cond);
         pthread_mutex_unlock(&do_data_mutex);
         return (void *) EXIT_FAILURE;
@@ -191,160 +327,147 @@ void * commandThread(void *command_fd)
     return (void *) EXIT_SUCCESS;
 }
 
-void * dataThread(void *data_fd)
+static void *dataThread(void *data_fd)
 {
-    printf("Started dataThread.\n");
+    int fd = (int) (intptr_t) data_fd;
 
-    if (produce_data((int) data_fd) != EXIT_SUCCESS)
+    if (produce_data(fd) != EXIT_SUCCESS)
     {
-        printf(
-                "  Data client failed to handle protocol, or connection closed.\n");
-        /*close connected socket*/
-        close((int) data_fd);
-        return (void *) EXIT_FAILURE;
+        printf("  Data client failed to handle protocol, or connection closed.\n");
     }
+    /*close connected socket*/
+    close(fd);
     return (void *) EXIT_SUCCESS;
 }
 
-/**
- * Signal handler for SIGCHLD. NOT NEEDED NOW WE ARE USING PTHREADS.
- *
- */
-void sig_chld(int signo)
+/** remembers the value of a SET, call with do_data_mutex */
+static void store_setting(const char* name, const char* value)
 {
-    pid_t pid = 0;
-    int status = 1;
+    int i;
 
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    for (i = 0; i < num_settings; i++)
     {
-        printf("Child %d has terminated. Status = %d\n", pid, status);
+        if (!strcmp(settings[i].name, name))
+            break;
     }
+    if (i == num_settings)
+    {
+        if (num_settings == MAX_SETTINGS)
+            return;
+        num_settings++;
+        strncpy(settings[i].name, name, sizeof(settings[i].name) - 1);
+    }
+    strncpy(settings[i].value, value, sizeof(settings[i].value) - 1);
 }
 
-/**
- * Read from socket and send back response. 
- * Read a maximum of MAXLINE, or until a newline, then echo the command back.
- */
-int echo_request(int socket_fd)
+/** the value of an earlier SET or NULL, call with do_data_mutex */
+static const char* find_setting(const char* name)
 {
-    int nleft = HEADER_LEN;
-    int nread = 0;
-    char buffer[MAXLINE + 1] =
-    { '\0' };
-    char response[MAXLINE] =
-    { '\0' };
-    char *bptr = NULL;
-    int inheader = 1;
-    char *tok = NULL;
-    char *cmdType, *cmdName, *cmdValue;
-    int cmdIntValue;
-    int bodylen = 0;
+    int i;
+
+    for (i = 0; i < num_settings; i++)
+    {
+        if (!strcmp(settings[i].name, name))
+            return settings[i].value;
+    }
+    return NULL;
+}
 
-    bptr = buffer;
+/** reads exactly len bytes, returns 0 when the client has gone */
+static int read_all(int socket_fd, char* buffer, int len)
+{
+    int nread;
 
-    if (socket_fd == 0)
+    while (len > 0)
     {
-        printf("NULL socket fd in echo_request.\n");
-        return EXIT_FAILURE;
+        nread = read(socket_fd, buffer, len);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return 0;
+        buffer += nread;
+        len -= nread;
     }
+    return 1;
+}
+
+/**
+ * Read commands from the socket and send back responses until the client
+ * disconnects.
+ */
+static int echo_request(int socket_fd)
+{
+    char buffer[MAXLINE + 1];
+    char response[MAXLINE * 2];
+    char strResp[MAXLINE];
+    char *cmdType, *cmdName, *cmdValue;
+    const char* stored;
+    int bodylen = 0;
+    int value;
 
     // keep reading and responding until an error occurs
     while (1)
     {
-        // clear response
-        response[0] = (char) NULL;
-        // first time around following loop we read header_len bytes
-        nleft = HEADER_LEN;
-        // first pass of the while loop is reading header
-        inheader = 1;
-
-        /// Read until end of current block (header or body)
-        while (nleft > 0)
-        {
-            printf("reading socket...\n");
-            if ((nread = read(socket_fd, bptr, nleft)) < 0)
-            {
-                if (errno == EINTR)
-                {
-                    nread = 0;
-                    printf("EINTR");
-                }
-                else
-                {
-                    printf("Unknown read error.\n");
-                    return EXIT_FAILURE;
-                }
-            }
-            else if (nread == 0)
-            {
-                printf("Read nothing. Socket closed.\n");
-                return EXIT_FAILURE; //Done. Client has probably disconnected.
-            }
-
-            nleft = nleft - nread;
-            if (inheader)
-            {
-                if (nleft == 0)
-                {
-                    inheader = 0;
-                    bptr[HEADER_LEN] = (char) NULL;
-
-                    printf("received command header: %s\n", buffer);
-
-                    nleft = MAXLINE - HEADER_LEN;
-                    tok = strtok(bptr, ",");
-                    tok = strtok(NULL, ",");
-                    if (tok == NULL )
-                    {
-                        printf("MPX Command header is missing length field.\n");
-                        continue;
-                    }
-                    else
-                    {
-                        // subtract 1 from bodylen since we already read the 1st comma
-                        nleft = bodylen = atoi(tok) - 1;
-                    }
-                }
-            }
-            else
-            {
-            }
+        memset(buffer, 0, sizeof(buffer));
+        if (!read_all(socket_fd, buffer, HEADER_LEN))
+            return EXIT_FAILURE; //Done. Client has probably disconnected.
 
+        // subtract 1 from bodylen since we already read the 1st comma
+        bodylen = atoi(buffer + 4) - 1;
+        if (strncmp(buffer, "MPX,", 4) || bodylen <= 0 || bodylen > MAXLINE)
+        {
+            printf("Bad MPX command header: %s\n", buffer);
+            return EXIT_FAILURE;
         }
+        if (!read_all(socket_fd, buffer, bodylen))
+            return EXIT_FAILURE;
+        buffer[bodylen] = 0;
 
-        bptr[bodylen] = (char) NULL;
-        printf("received command body: %s\n", buffer);
+        if (options.verbose)
+            printf("received command: %s\n", buffer);
 
-        //Handle command
-        bptr = buffer;
-
-        cmdType = strtok(bptr, ",");
+        cmdType = strtok(buffer, ",");
         cmdName = strtok(NULL, ",");
         if (cmdType == NULL || cmdName == NULL )
         {
             printf("badly formed MPX command\n");
             sprintf(response, "MPX,0000000008,ERROR,1");
-            continue;
         }
-
-        if (!strncmp(cmdType, "SET", 3))
+        else if (!strncmp(cmdType, "SET", 3))
         {
             cmdValue = strtok(NULL, ",");
-            cmdIntValue = atoi(cmdValue);
+            if (cmdValue == NULL)
+                cmdValue = (char*) "0";
 
-            if (!strncmp(cmdName, "NUMFRAMESTOACQUIRE", MAXLINE))
+            pthread_mutex_lock(&do_data_mutex);
+            store_setting(cmdName, cmdValue);
+            if (!strcmp(cmdName, "NUMFRAMESTOACQUIRE"))
             {
-                printf("setting frame count to %d\n\n", cmdIntValue);
-                frame_count = cmdIntValue;
+                frame_count = atoi(cmdValue);
             }
             else if (!strcmp(cmdName, "COUNTERDEPTH"))
             {
-                if (!strcmp(cmdValue, "12"))
-                    Depth = 12;
-                else
-                    Depth = 24;
-                printf("switching counter depth to %d\n\n", Depth);
+                value = atoi(cmdValue);
+                if (value == 1 || value == 6 || value == 12 || value == 24)
+                    depth = value;
+            }
+            else if (!strcmp(cmdName, "ACQUISITIONPERIOD"))
+            {
+                acquisition_period = atof(cmdValue);
+            }
+            else if (!strcmp(cmdName, "THSTART"))
+            {
+                th_start = atof(cmdValue);
+            }
+            else if (!strcmp(cmdName, "THSTOP"))
+            {
+                th_stop = atof(cmdValue);
+            }
+            else if (!strcmp(cmdName, "THSTEP"))
+            {
+                th_step = atof(cmdValue);
             }
+            pthread_mutex_unlock(&do_data_mutex);
 
             // default response
             bodylen = strlen(cmdName) + 7;
@@ -352,28 +475,23 @@ int echo_request(int socket_fd)
         }
         else if (!strncmp(cmdType, "GET", 3))
         {
-            char strResp[MAXLINE];
-            sprintf(strResp, "%d", ++incrementer * 100);
-
-            if (!strncmp(cmdName, "DETECTORSTATUS", MAXLINE))
-                strcpy(strResp, "0");
-            if (!strncmp(cmdName, "GETSOFTWAREVERSION", MAXLINE))
+            pthread_mutex_lock(&do_data_mutex);
+            stored = find_setting(cmdName);
+            if (!strcmp(cmdName, "DETECTORSTATUS"))
+                strcpy(strResp, acquiring ? "1" : "0");
+            else if (!strcmp(cmdName, "SOFTWAREVERSION"))
                 strcpy(strResp, "2.2");
-
-            if (!strncmp(cmdName, "CONTINUOUSRW", MAXLINE))
+            else if (!strcmp(cmdName, "COUNTERDEPTH"))
+                sprintf(strResp, "%d", depth);
+            else if (stored != NULL)
+                strcpy(strResp, stored);
+            else if (!strcmp(cmdName, "CONTINUOUSRW"))
                 strcpy(strResp, "1");
-
-            if (!strncmp(cmdName, "ENABLECOUNTER1", MAXLINE))
+            else if (!strcmp(cmdName, "ENABLECOUNTER1"))
                 strcpy(strResp, "0");
-
-            /*
-             if(!strncmp(cmdName,"THSTART",MAXLINE))
-             strcpy(strResp, "2.0");
-             if(!strncmp(cmdName,"THSTOP",MAXLINE))
-             strcpy(strResp, "8.0");
-             if(!strncmp(cmdName,"THSTEP",MAXLINE))
-             strcpy(strResp, "1.0");
-             */
+            else
+                sprintf(strResp, "%d", ++incrementer * 100);
+            pthread_mutex_unlock(&do_data_mutex);
 
             bodylen = strlen(cmdName) + strlen(strResp) + 8;
             sprintf(response, "MPX,%010u,GET,%s,%s,0", bodylen, cmdName,
@@ -381,32 +499,35 @@ int echo_request(int socket_fd)
         }
         else if (!strncmp(cmdType, "CMD", 3))
         {
-            if (!strncmp(cmdName, "STARTACQUISITION", 16)
-                    || !strncmp(cmdName, "THSTART", 16)
-                    || !strncmp(cmdName, "PROFILES", 16))
+            pthread_mutex_lock(&do_data_mutex);
+            if (!strcmp(cmdName, "STARTACQUISITION")
+                    || !strcmp(cmdName, "THSCAN")
+                    || !strcmp(cmdName, "PROFILES"))
             {
-                if (!strncmp(cmdName, "THSTART", 16))
-                    frames_to_send = 7;
-                else
-                    frames_to_send = frame_count;
-
-                /*signal data thread to send some data back.*/
-                printf("***signalling data thread.\n");
-                pthread_mutex_lock(&do_data_mutex);
-                if (!strncmp(cmdName, "PROFILES", 16))
+                if (!strcmp(cmdName, "THSCAN"))
                 {
-                    // use do_data = 2 to indicate a profiles request
-                    do_data = 2;
+                    frames_to_send = THSCAN_DEFAULT_STEPS;
+                    if (th_step != 0 && (th_stop - th_start) / th_step >= 0)
+                    {
+                        frames_to_send = (int) ((th_stop - th_start) / th_step
+                                + 1.5);
+                    }
                 }
                 else
                 {
-                    // use do_data = 1 to indicate an image request
-                    do_data = 1;
+                    frames_to_send = frame_count;
                 }
+
+                /*signal data thread to send some data back.*/
+                stop_acquisition = 0;
+                do_data = 1;
                 pthread_cond_signal(&do_data_cond);
-                pthread_mutex_unlock(&do_data_mutex);
-                printf("***data thread singnalled.\n");
             }
+            else if (!strcmp(cmdName, "STOPACQUISITION"))
+            {
+                stop_acquisition = 1;
+            }
+            pthread_mutex_unlock(&do_data_mutex);
 
             // construct response
             bodylen = strlen(cmdName) + 7;
@@ -418,181 +539,447 @@ int echo_request(int socket_fd)
             sprintf(response, "MPX,0000000008,ERROR,1");
         }
 
-        // deliberately send junk to test re-synch capability
-        /*
-         printf("sending garbage..\n");
-         if(write(socket_fd, "garbage MP garbage", 15) <=0)
-         printf("garbage 1 failed\n");
-         */
-
-        printf("sending response: %s \n", response);
+        if (options.verbose)
+            printf("sending response: %s\n", response);
         if (write(socket_fd, response, strlen(response)) <= 0)
         {
             printf("Error writing back to client.\n");
-            // return EXIT_FAILURE;
         }
-
-        //Clear buffer for next command.
-        memset(&buffer[0], '\0', sizeof(buffer));
     }
 
-    printf("Buffer full. From client: %s\n", buffer);
-
     return EXIT_SUCCESS;
 }
 
-void endian_swap(uint64_t* x)
+static double now_seconds(void)
 {
-    *x =     ((((*x) & 0x00000000000000FFLL) << 0x38)
-            | (((*x) & 0x000000000000FF00LL) << 0x28)
-            | (((*x) & 0x0000000000FF0000LL) << 0x18)
-            | (((*x) & 0x00000000FF000000LL) << 0x08)
-            | (((*x) & 0x000000FF00000000LL) >> 0x08)
-            | (((*x) & 0x0000FF0000000000LL) >> 0x18)
-            | (((*x) & 0x00FF000000000000LL) >> 0x28)
-            | (((*x) & 0xFF00000000000000LL) >> 0x38));
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-/**
- * Produce simulation data when we start acquisition. 
- */
-int produce_data(int data_fd)
+/** writes the whole of iov, returns 0 on error */
+static int send_iov(int fd, struct iovec* iov, int count)
 {
-    //char *data = "Here is some data.\r\n";
-    //unsigned int trailer = 0xDA; /* CR LF */
+    ssize_t n;
 
-    // frame = header (including comma) + data frame type (3 chars) +
-    //		comma + data frame header + image data
-    int frameSize24 = HEADER_LEN + CMDLEN + DATAHEADERLEN + MAXDATA;
-    int frameSize12 = HEADER_LEN + CMDLEN + DATAHEADERLEN + MAXDATA / 2;
-    int frameSizeProfile = HEADER_LEN + CMDLEN + DATAHEADERLEN
-            + MPX_PROFILE_LEN * 2+ MPX_SUM_LEN;
-
-    char data[frameSize24];
-    unsigned int i, j;
-    int headersLength = HEADER_LEN + CMDLEN + DATAHEADERLEN;
-
-    while (1)
+    while (count > 0)
     {
-        printf("***taking mutex in data thread.\n");
-        /*Wait for signal to produce some data.*/
-        pthread_mutex_lock(&do_data_mutex);
-        while (do_data == 0)
+        n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        while (count > 0 && (size_t) n >= iov->iov_len)
         {
-            printf("***waiting in data thread.\n");
-            pthread_cond_wait(&do_data_cond, &do_data_mutex);
+            n -= iov->iov_len;
+            iov++;
+            count--;
         }
+        if (count > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
 
-        printf("***got signal in data thread.\n");
+/** writes len bytes of the file fd at offset, returns 0 on error */
+static int send_file(int data_fd, int fd, off_t offset, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = sendfile(data_fd, fd, &offset, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        len -= n;
+    }
+    return 1;
+}
 
-        //printf("data_fd: %d\n", data_fd);
-        //printf("data_exit: %d\n", data_exit);
-        //printf("do_data: %d\n", do_data);
+/** bytes of pixel data of a frame */
+static size_t data_bytes(int xSize, int ySize, int depth, int raw)
+{
+    size_t pixels = (size_t) xSize * ySize;
 
-        //printf("MAXDATA: %d\n", MAXDATA);
+    if (raw)
+    {
+        // 64 bit words of 64 x 1 bit, 8 x 6 bit or 4 x 12 bit pixels, 24
+        // bit frames are sent as two 12 bit images
+        switch (depth)
+        {
+        case 1:
+            return pixels / 8;
+        case 6:
+            return pixels;
+        case 12:
+            return pixels * 2;
+        default:
+            return pixels * 4;
+        }
+    }
+    return pixels * (depth <= 6 ? 1 : depth == 12 ? 2 : 4);
+}
 
-        if ((do_data > 0) && (data_exit == 0))
+/** fills in the pixel data of template t, counts are big endian */
+static void fill_template(simFrames* frames, int t, int xSize, int ySize)
+{
+    unsigned char* p = (unsigned char*) frames->pixels
+            + (size_t) t * frames->dataBytes;
+    uint32_t mask = (1u << frames->depth) - 1;
+    uint32_t state = 0x9e3779b9u * (t + 1);
+    uint32_t v;
+    size_t i;
+    int x, y;
+
+    if (frames->raw)
+    {
+        // the counters of a RAW frame are just noise
+        for (i = 0; i < frames->dataBytes; i++)
         {
-            printf("starting frame sending with do_data = %d\n", do_data);
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            p[i] = (unsigned char) state;
+        }
+        return;
+    }
 
-            // send a silly acquisition header
-            if (write(data_fd,
-                    "MPX,0000000433,HDR,dummy acquisition header.0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789END",
-                    433 + HEADER_LEN - 1) <= 0)
+    // a diagonal ramp that moves from one template to the next
+    for (y = 0; y < ySize; y++)
+    {
+        for (x = 0; x < xSize; x++)
+        {
+            v = (uint32_t) (x + 2 * y + 16 * t) & mask;
+            if (frames->depth <= 6)
+            {
+                *p++ = (unsigned char) v;
+            }
+            else if (frames->depth == 12)
             {
-                printf("Error writing acquisition header to client.\n");
-                do_data = 0;
-                pthread_mutex_unlock(&do_data_mutex);
-                //return EXIT_FAILURE;
+                *p++ = (unsigned char) (v >> 8);
+                *p++ = (unsigned char) v;
             }
-            printf("*** wrote data - acquisition header\n");
+            else
+            {
+                *p++ = (unsigned char) (v >> 24);
+                *p++ = (unsigned char) (v >> 16);
+                *p++ = (unsigned char) (v >> 8);
+                *p++ = (unsigned char) v;
+            }
+        }
+    }
+}
 
-            printf("*** writing %d data frames\n", frames_to_send);
+static void free_frames(simFrames* frames)
+{
+    if (frames->fd >= 0)
+        close(frames->fd);
+    free(frames->pixels);
+    frames->pixels = NULL;
+    frames->fd = -1;
+}
 
-            for (i = 0; i < frames_to_send; i++)
-            {
-                char timebuf[255];
-                char buf2[255];
-                time_t now;
-                struct tm *current;
-                int thisFrameSize = Depth == 12 ? frameSize12 : frameSize24;
+/** builds the MQ1 header and pixel data templates of an acquisition,
+ * returns 0 if memory runs out */
+static int build_frames(simFrames* frames, int depth)
+{
+    int chips = options.cols * options.rows;
+    int xSize = options.cols * CHIP_SIZE;
+    int ySize = options.rows * CHIP_SIZE;
+    size_t mqLen = MQ_HEADER_LEN + MQ_DAC_LEN * chips;
+    char* mq = frames->header + HEADER_LEN;
+    char pixelType[8];
+    size_t len;
+    int chip, i, t;
+
+    memset(frames, 0, sizeof(simFrames));
+    frames->fd = -1;
+    frames->depth = depth;
+    frames->raw = options.raw;
+    frames->templates = options.templates;
+    frames->dataBytes = data_bytes(xSize, ySize, depth, options.raw);
+
+    if (options.raw)
+        strcpy(pixelType, "R64");
+    else
+        sprintf(pixelType, "U%02d", depth <= 6 ? 8 : depth == 12 ? 16 : 32);
+
+    sprintf(frames->header, "MPX,%010lu,",
+            (unsigned long) (mqLen + frames->dataBytes + 1));
+
+    len = sprintf(mq, "MQ1,%06d,%05lu,%02d,%04d,%04d,%s,%6s,%02X,", 0,
+            (unsigned long) mqLen, chips, xSize, ySize, pixelType,
+            options.layout, (1 << chips) - 1);
+    frames->frameNumberPos = HEADER_LEN + 4;
+    frames->timeStampPos = HEADER_LEN + len;
+    len += sprintf(mq + len, "%-26s,%.6f,%d,%d,%d", "", 0.001, 0, 0, 0);
+    for (i = 0; i < 8; i++)
+    {
+        len += sprintf(mq + len, ",%.6E", i == 0 ? 10.0 : 0.0);
+    }
+    for (chip = 0; chip < chips; chip++)
+    {
+        len += sprintf(mq + len, ",3RX");
+        for (i = 0; i < 8; i++)
+        {
+            len += sprintf(mq + len, ",%03d", i == 0 ? 175 : 0);
+        }
+        for (i = 0; i < 19; i++)
+        {
+            len += sprintf(mq + len, ",%03d", (i * 37 + chip) % 256);
+        }
+    }
+    len += sprintf(mq + len, ",MQ1A,%-30s,%.6E,ns,%d", "", 1e6, depth);
+    memset(mq + len, ' ', mqLen - len);
+    frames->headerLen = HEADER_LEN + mqLen;
+
+    frames->pixels = (char*) malloc(frames->dataBytes * frames->templates);
+    if (frames->pixels == NULL)
+        return 0;
+    for (t = 0; t < frames->templates; t++)
+    {
+        fill_template(frames, t, xSize, ySize);
+    }
 
-                if (do_data == 2)
-                {
-                    thisFrameSize = frameSizeProfile;
-                }
+    if (options.useSendfile)
+    {
+        // sendfile reads from a file so the templates are put in memory
+        // backed one where the C library has them
+#ifdef MFD_CLOEXEC
+        frames->fd = memfd_create("merlin_sim", MFD_CLOEXEC);
+#else
+        FILE* fp = tmpfile();
+        frames->fd = fp != NULL ? dup(fileno(fp)) : -1;
+        if (fp != NULL)
+            fclose(fp);
+#endif
+        len = frames->dataBytes * frames->templates;
+        if (frames->fd < 0
+                || write(frames->fd, frames->pixels, len) != (ssize_t) len)
+        {
+            perror("sendfile templates");
+            free_frames(frames);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-                now = time(0); //current time in C representation
-                current = localtime(&now);
+/** fills in the frame number and time stamp of the next frame */
+static void stamp_frame(simFrames* frames, int frameNumber)
+{
+    static time_t lastSecond = 0;
+    static char secondText[32];
+    struct timespec ts;
+    struct tm tm;
+    char text[64];
+
+    // the date only changes once a second
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != lastSecond)
+    {
+        lastSecond = ts.tv_sec;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(secondText, sizeof(secondText), "%Y-%m-%d %H:%M:%S", &tm);
+    }
 
-                strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S.123",
-                        current);
+    sprintf(text, "%06d", frameNumber % 1000000);
+    memcpy(frames->header + frames->frameNumberPos, text, 6);
+    sprintf(text, "%s.%06ld", secondText, ts.tv_nsec / 1000);
+    memcpy(frames->header + frames->timeStampPos, text, 26);
+}
 
-                // ??? getting spurious one byte garbage - so adding 1 to length of data packet ???
-                snprintf(data, HEADER_LEN, "MPX,%010u,",
-                        thisFrameSize - HEADER_LEN + 1);
-                sprintf(buf2,
-                        "%4d,1,%s.007,1.5E-2,6.0,8.01E2,1,2,3,4,5,6,7,8,9,10,1,2,3,4,5,6,7,8,1,20,21,22,23,24,25,00014",
-                        i, timebuf);
+/** sends the HDR frame that starts an acquisition, returns 0 on error */
+static int send_acquisition_header(int data_fd, int frames, int depth)
+{
+    char data[HEADER_LEN + ACQ_HEADER_LEN + 1];
+    char stamp[32];
+    struct iovec iov;
+    time_t now = time(NULL);
+    size_t len;
+
+    strftime(stamp, sizeof(stamp), "%d/%m/%Y %H:%M:%S", localtime(&now));
+    len = sprintf(data, "MPX,%010u,HDR,\t\n", ACQ_HEADER_LEN + 1);
+    len += sprintf(data + len,
+            "Time and Date Stamp (day, mnth, yr, hr, min, s):\t%s\n"
+            "Chip ID:\tW000_A0\n"
+            "Chip Type (Medipix 3.0, Medipix 3.1, Medipix 3RX):\tMedipix 3RX\n"
+            "Assembly Size (NX1, 2X2):\t%6s\n"
+            "Chip Mode  (SPM, CSM, CM, CSCM):\tSPM\n"
+            "Counter Depth (number):\t%d\n"
+            "Gain:\tSLGM\n"
+            "Active Counters:\tAlternating\n"
+            "Thresholds (keV):\t1.000000E+1,0.000000E+0,0.000000E+0,"
+            "0.000000E+0,0.000000E+0,0.000000E+0,0.000000E+0,0.000000E+0\n"
+            "Frames in Acquisition (Number):\t%d\n"
+            "Frames per Trigger (Number):\t1\n"
+            "Trigger Start (Positive, Negative, Internal):\tInternal\n"
+            "Trigger Stop (Positive, Negative, Internal):\tInternal\n"
+            "Sensor Bias (V):\t120 V\n"
+            "Sensor Polarity (Positive, Negative):\tPositive\n"
+            "Temperature (C):\tBoard Temp 0.000000 Deg C\n"
+            "Humidity (%%):\tBoard Humidity 0.000000 \n"
+            "Medipix Clock (MHz):\t120MHz\n"
+            "Readout System:\tMerlin Quad\n"
+            "Software Version:\t2.2\n"
+            "End\t", stamp, options.layout, depth, frames);
+    memset(data + len, ' ', HEADER_LEN + ACQ_HEADER_LEN - len);
+
+    iov.iov_base = data;
+    iov.iov_len = HEADER_LEN + ACQ_HEADER_LEN;
+    return send_iov(data_fd, &iov, 1);
+}
 
-                if (do_data == 1)
-                {
-                    static int offset = 0;
+/** prints the achieved rate since the last report */
+static void report(const char* what, int frames, double bytes, double seconds)
+{
+    if (seconds <= 0)
+        return;
+    printf("%s: %d frames, %.1f frames/s, %.1f MB/s\n", what, frames,
+            frames / seconds, bytes / seconds / 1e6);
+    fflush(stdout);
+}
 
-                    printf("preparing image data\n");
-                    sprintf((data + HEADER_LEN), "%dB,%-251s", Depth, buf2);
+/** sends one acquisition, returns 0 if the client has gone */
+static int send_acquisition(int data_fd, int frames_wanted, int depth,
+        double period)
+{
+    simFrames frames;
+    struct iovec iov[2];
+    struct timespec deadline;
+    double start, now, lastReport;
+    double bytes = 0, reportBytes = 0;
+    size_t slot;
+    long long periodNs = (long long) (period * 1e9);
+    int frame = 0, reportFrame = 0;
+    int stop = 0;
+    int ok = 1;
+
+    if (!build_frames(&frames, depth))
+    {
+        printf("Cannot allocate %d frame templates\n", options.templates);
+        return 1;
+    }
 
-                    // create dummy data
-                    for (j = headersLength;
-                            j < MAXDATA / (24 / Depth) + headersLength; j++)
-                    {
-                        data[j] = (j+offset) / 20 % 255;
-                    }
-                    offset += 20;
-                }
-                else
-                {
-                    printf("preparing profile data\n");
-                    sprintf((data + HEADER_LEN), "P%d,%-251s", Depth, buf2);
+    printf("Sending %d %s frames of %lu bytes at depth %d, %s\n",
+            frames_wanted, options.raw ? "RAW" : "MQ1",
+            (unsigned long) (frames.headerLen + frames.dataBytes), depth,
+            period > 0 ? "paced" : "unpaced");
+    if (period > 0)
+        printf("Target rate %.1f frames/s\n", 1 / period);
 
-                    uint64_t* profileData = (uint64_t*) (data + headersLength);
+    ok = send_acquisition_header(data_fd, frames_wanted, depth);
 
-                    // create dummy data
-                    for (j = 0; j < 256 * 2; j++)
-                    {
-                        profileData[j] = (uint64_t)j;
-                        //endian_swap(&profileData[j]);
-                    }
-                }
-                // write an image
-                if (write(data_fd, data, thisFrameSize) <= 0)
-                {
-                    printf("Error writing data frame 1 to client.\n");
-                    do_data = 0;
-                    pthread_mutex_unlock(&do_data_mutex);
-                    //return EXIT_FAILURE;
-                }
-                printf("*** wrote data - image %d at time %s\n", i, timebuf);
-            }
+    start = lastReport = now_seconds();
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (ok && !stop && (frames_wanted <= 0 || frame < frames_wanted))
+    {
+        if (periodNs > 0)
+        {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+            deadline.tv_nsec += periodNs % 1000000000;
+            deadline.tv_sec += periodNs / 1000000000 + deadline.tv_nsec
+                    / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+        }
+
+        frame++;
+        stamp_frame(&frames, frame);
+        slot = (size_t) (frame % frames.templates) * frames.dataBytes;
 
-            do_data = 0;
+        if (frames.fd >= 0)
+        {
+            iov[0].iov_base = frames.header;
+            iov[0].iov_len = frames.headerLen;
+            ok = send_iov(data_fd, iov, 1)
+                    && send_file(data_fd, frames.fd, (off_t) slot,
+                            frames.dataBytes);
         }
         else
         {
-            if (data_exit)
-            {
-                printf("Exiting data thread.\n");
-                data_exit = 0;
-                do_data = 0;
-                pthread_mutex_unlock(&do_data_mutex);
-                break;
-            }
+            iov[0].iov_base = frames.header;
+            iov[0].iov_len = frames.headerLen;
+            iov[1].iov_base = frames.pixels + slot;
+            iov[1].iov_len = frames.dataBytes;
+            ok = send_iov(data_fd, iov, 2);
+        }
+        bytes += frames.headerLen + frames.dataBytes;
+
+        now = now_seconds();
+        if (now - lastReport >= options.reportPeriod)
+        {
+            report("sent", frame - reportFrame, bytes - reportBytes,
+                    now - lastReport);
+            reportFrame = frame;
+            reportBytes = bytes;
+            lastReport = now;
+        }
+
+        pthread_mutex_lock(&do_data_mutex);
+        stop = stop_acquisition;
+        pthread_mutex_unlock(&do_data_mutex);
+    }
+
+    if (!ok)
+        printf("Error writing data frame %d to client.\n", frame);
+    report(stop ? "acquisition stopped" : "acquisition complete", frame,
+            bytes, now_seconds() - start);
+
+    free_frames(&frames);
+    return ok;
+}
+
+/**
+ * Send the frames of each acquisition the command thread starts
+ */
+static int produce_data(int data_fd)
+{
+    int frames_wanted;
+    int acq_depth;
+    double period;
+
+    while (1)
+    {
+        /*Wait for signal to produce some data.*/
+        pthread_mutex_lock(&do_data_mutex);
+        while (do_data == 0)
+        {
+            pthread_cond_wait(&do_data_cond, &do_data_mutex);
         }
+        do_data = 0;
 
+        if (data_exit)
+        {
+            data_exit = 0;
+            pthread_mutex_unlock(&do_data_mutex);
+            return EXIT_SUCCESS;
+        }
+
+        frames_wanted = frames_to_send;
+        acq_depth = depth;
+        period = options.frameRate > 0 ? 1 / options.frameRate :
+                options.frameRate == 0 ? 0 : acquisition_period / 1000;
+        acquiring = 1;
         pthread_mutex_unlock(&do_data_mutex);
 
+        if (!send_acquisition(data_fd, frames_wanted, acq_depth, period))
+        {
+            pthread_mutex_lock(&do_data_mutex);
+            acquiring = 0;
+            pthread_mutex_unlock(&do_data_mutex);
+            return EXIT_FAILURE;
+        }
+
+        pthread_mutex_lock(&do_data_mutex);
+        acquiring = 0;
+        pthread_mutex_unlock(&do_data_mutex);
     }
-    pthread_mutex_unlock(&do_data_mutex);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,223 @@
+/* mpxBadPixel.cpp
+ *
+ * Bad pixel maps, see mpxBadPixel.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <epicsStdio.h>
+
+#include "mpxBadPixel.h"
+
+/** most neighbours a bad pixel can have, the 5 x 5 block less itself */
+#define MAX_NEIGHBOURS 24
+
+/** adds the good pixels within radius of x, y to list, returns how many */
+static int findNeighbours(const epicsUInt8* mask, int xSize, int ySize,
+        int x, int y, int radius, epicsUInt32* list)
+{
+    int n = 0;
+    int i, j;
+
+    for (j = y - radius; j <= y + radius; j++)
+    {
+        if (j < 0 || j >= ySize)
+            continue;
+        for (i = x - radius; i <= x + radius; i++)
+        {
+            if (i < 0 || i >= xSize || mask[(size_t) j * xSize + i])
+                continue;
+            list[n++] = (epicsUInt32) ((size_t) j * xSize + i);
+        }
+    }
+    return n;
+}
+
+mpxBadPixelMap* mpxBadPixelCompile(const epicsUInt8* mask, int xSize,
+        int ySize)
+{
+    mpxBadPixelMap* map;
+    size_t n = (size_t) xSize * ySize;
+    size_t i, count = 0, used = 0;
+    int found;
+    epicsUInt32* shrunk;
+
+    for (i = 0; i < n; i++)
+    {
+        if (mask[i])
+            count++;
+    }
+
+    map = (mpxBadPixelMap*) calloc(1, sizeof(mpxBadPixelMap));
+    if (map == NULL)
+        return NULL;
+    map->xSize = xSize;
+    map->ySize = ySize;
+    map->index = (epicsUInt32*) malloc((count + 1) * sizeof(epicsUInt32));
+    map->first = (epicsUInt32*) malloc((count + 1) * sizeof(epicsUInt32));
+    map->neighbour = (epicsUInt32*) malloc(
+            (count * MAX_NEIGHBOURS + 1) * sizeof(epicsUInt32));
+    if (map->index == NULL || map->first == NULL || map->neighbour == NULL)
+    {
+        mpxBadPixelFree(map);
+        return NULL;
+    }
+
+    // scanning the mask in order gives the indexes already sorted
+    for (i = 0; i < n; i++)
+    {
+        if (!mask[i])
+            continue;
+
+        map->index[map->count] = (epicsUInt32) i;
+        map->first[map->count] = (epicsUInt32) used;
+        found = findNeighbours(mask, xSize, ySize, (int) (i % xSize),
+                (int) (i / xSize), 1, map->neighbour + used);
+        if (found == 0)
+        {
+            // in a cluster, look a pixel further out
+            found = findNeighbours(mask, xSize, ySize, (int) (i % xSize),
+                    (int) (i / xSize), 2, map->neighbour + used);
+        }
+        used += found;
+        map->count++;
+    }
+    map->first[map->count] = (epicsUInt32) used;
+
+    shrunk = (epicsUInt32*) realloc(map->neighbour,
+            (used + 1) * sizeof(epicsUInt32));
+    if (shrunk != NULL)
+        map->neighbour = shrunk;
+
+    return map;
+}
+
+void mpxBadPixelFree(mpxBadPixelMap* map)
+{
+    if (map == NULL)
+        return;
+    free(map->index);
+    free(map->first);
+    free(map->neighbour);
+    free(map);
+}
+
+int mpxBadPixelReadFile(const char* path, epicsUInt8* mask, int xSize,
+        int ySize, char* error, size_t errorLen)
+{
+    FILE* fp;
+    char line[256];
+    char* p;
+    int x, y;
+    int count = 0;
+    int lineNumber = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        epicsSnprintf(error, errorLen, "Cannot open %s: %s", path,
+                strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNumber++;
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+            continue;
+
+        if (sscanf(p, "%d%*[ \t,]%d", &x, &y) != 2)
+        {
+            epicsSnprintf(error, errorLen, "%s line %d: expected x y", path,
+                    lineNumber);
+            fclose(fp);
+            return -1;
+        }
+        if (x < 0 || x >= xSize || y < 0 || y >= ySize)
+        {
+            epicsSnprintf(error, errorLen, "%s line %d: %d,%d is outside "
+                    "the image", path, lineNumber, x, y);
+            fclose(fp);
+            return -1;
+        }
+        if (!mask[(size_t) y * xSize + x])
+        {
+            mask[(size_t) y * xSize + x] = 1;
+            count++;
+        }
+    }
+
+    fclose(fp);
+    return count;
+}
+
+template<typename T>
+static void applyInteger(const mpxBadPixelMap* map, T* data)
+{
+    const epicsUInt32* neighbour = map->neighbour;
+    epicsUInt32 first, last, k;
+    epicsUInt64 sum;
+    size_t i;
+
+    for (i = 0; i < map->count; i++)
+    {
+        first = map->first[i];
+        last = map->first[i + 1];
+        sum = 0;
+        for (k = first; k < last; k++)
+        {
+            sum += data[neighbour[k]];
+        }
+        // the average of values of type T always fits in T
+        data[map->index[i]] = last > first ?
+                (T) ((sum + (last - first) / 2) / (last - first)) : 0;
+    }
+}
+
+static void applyFloat(const mpxBadPixelMap* map, float* data)
+{
+    const epicsUInt32* neighbour = map->neighbour;
+    epicsUInt32 first, last, k;
+    double sum;
+    size_t i;
+
+    for (i = 0; i < map->count; i++)
+    {
+        first = map->first[i];
+        last = map->first[i + 1];
+        sum = 0;
+        for (k = first; k < last; k++)
+        {
+            sum += data[neighbour[k]];
+        }
+        data[map->index[i]] = last > first ?
+                (float) (sum / (last - first)) : 0.f;
+    }
+}
+
+void mpxBadPixelApply(const mpxBadPixelMap* map, void* data, int pixelBytes,
+        int isFloat)
+{
+    if (isFloat)
+    {
+        applyFloat(map, (float*) data);
+        return;
+    }
+
+    switch (pixelBytes)
+    {
+    case 1:
+        applyInteger(map, (epicsUInt8*) data);
+        break;
+    case 2:
+        applyInteger(map, (epicsUInt16*) data);
+        break;
+    case 4:
+        applyInteger(map, (epicsUInt32*) data);
+        break;
+    }
+}
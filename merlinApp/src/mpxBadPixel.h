@@ -0,0 +1,58 @@
+/*
+ * mpxBadPixel.h
+ *
+ * Replacement of bad (hot or dead) pixels by the average of their good
+ * neighbours.
+ *
+ * A mask of the bad pixels is compiled once into a map: the sorted index of
+ * each bad pixel in the image and, for each of them, the indexes of the good
+ * pixels around it. Applying the map to an image then only touches the bad
+ * pixels and their neighbours, in image order, so it is cheap enough to be
+ * done on the decode path while the image is still in the cache.
+ */
+
+#ifndef MPXBADPIXEL_H_
+#define MPXBADPIXEL_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+/** A compiled bad pixel mask */
+typedef struct
+{
+    int xSize;              // size of the images the map applies to
+    int ySize;
+    size_t count;           // number of bad pixels
+    epicsUInt32 *index;     // index of each bad pixel, ascending
+    epicsUInt32 *first;     // neighbours of bad pixel i are neighbour[first[i]]
+                            // up to neighbour[first[i + 1]]
+    epicsUInt32 *neighbour;
+    int users;              // references held by frames, kept by the owner
+} mpxBadPixelMap;
+
+/** Compiles a mask of xSize x ySize bytes (non zero for a bad pixel) into a
+ * map. The neighbours of a bad pixel are the good pixels of the 3 x 3 block
+ * around it, or of the 5 x 5 block if there are none. Returns NULL if memory
+ * runs out. */
+mpxBadPixelMap* mpxBadPixelCompile(const epicsUInt8* mask, int xSize,
+        int ySize);
+
+void mpxBadPixelFree(mpxBadPixelMap* map);
+
+/** Sets the bytes of mask for the pixels listed in a text file, one "x y"
+ * or "x,y" pair per line (as in the published image, 0,0 top left). Blank
+ * lines and lines starting with # are ignored. Returns the number of
+ * pixels read or -1 if the file cannot be read or a pixel is outside the
+ * image, with the reason in error. */
+int mpxBadPixelReadFile(const char* path, epicsUInt8* mask, int xSize,
+        int ySize, char* error, size_t errorLen);
+
+/** Replaces the bad pixels of an image of map->xSize x map->ySize pixels.
+ * Integer pixels of pixelBytes (1, 2 or 4) are given the rounded average,
+ * isFloat selects float (Float32) pixels. Bad pixels with no good
+ * neighbours are set to 0. */
+void mpxBadPixelApply(const mpxBadPixelMap* map, void* data, int pixelBytes,
+        int isFloat);
+
+#endif /* MPXBADPIXEL_H_ */
@@ -9,11 +9,13 @@
 #include <epicsStdio.h>
 
 #include <asynOctetSyncIO.h>
+#include <asynCommonSyncIO.h>
 
 #include "ADDriver.h"
 
 #include "merlinDetector.h"
 #include "mpxConnection.h"
+#include "mpxStreamReader.h"
 
 // #######################################################################################
 // ##################### Header Parsing Functions          ###############################
@@ -21,12 +23,37 @@
 
 // Constructor
 mpxConnection::mpxConnection(asynUser* parentUser, asynUser* tcpUser,
-        merlinDetector* parentObj)
+        merlinDetector* parentObj, size_t readBufferSize, mpxSocket* socket)
 {
 	fromLabviewError = 0;
+    resyncCount = 0;
+    discardedBytes = 0;
+    batchCount = 0;
+    batchNext = 0;
     this->parentUser = parentUser;
     this->tcpUser = tcpUser;
     this->parentObj = parentObj;
+    this->socket = socket;
+    this->commonUser = NULL;
+    this->readLost = 0;
+
+    // the socket does its own reads, tcpUser is then only for tracing
+    if (socket != NULL)
+    {
+        this->reader = new mpxStreamReader(socket, readBufferSize);
+        return;
+    }
+
+    // MPX frames are length prefixed and read in blocks, an input EOS would
+    // cut the blocks short at any newline in the data
+    pasynOctetSyncIO->setInputEos(tcpUser, "", 0);
+    this->reader = new mpxStreamReader(tcpUser, readBufferSize);
+
+    const char* portName;
+    if (pasynManager->getPortName(tcpUser, &portName) == asynSuccess)
+    {
+        pasynCommonSyncIO->connect(portName, 0, &this->commonUser, NULL);
+    }
 }
 
 // parses the start of the data header and returns its type
@@ -50,197 +77,6 @@ merlinDataHeader mpxConnection::parseDataHeader(const char* header)
 }
 
 
-// Data Frame Header Parser for frames from Merlin Quad
-// (This data format intended to extend to future products)
-// parses the data header and adds appropriate attributes to pImage
-void mpxConnection::parseMqDataFrame(NDAttributeList* pAttr, const char* header,
-        size_t *xsize, size_t *ysize, int* pixelDepth, int* offset,
-        int* profileSelect)
-{
-
-    char buff[MPX_IMG_HDR_FULL_LEN + 1];
-    unsigned int uVal;
-    double dVal;
-    int iVal, i, chipCount, chip, dacsPreset = 1;
-    //int dacNum;
-    char thresholdName[30];
-    char* tok;
-    char* save_ptr = NULL;
-
-    *profileSelect = 0;
-
-    // make a copy since epicsStrtok_r is destructive
-    strncpy(buff, header, MPX_IMG_HDR_FULL_LEN);
-    buff[MPX_IMG_HDR_FULL_LEN + 1] = 0;
-
-    asynPrint(this->parentUser, ASYN_TRACE_MPX, "Image frame Header: %s\n\n",
-            buff);
-
-    tok = epicsStrtok_r(buff, ",", &save_ptr);
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);  // skip the (HDR already parsed)
-    if (tok != NULL)
-    {
-        iVal = atol(tok);
-        pAttr->add("Frame Number", "", NDAttrInt32, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-    	// this needs to be pushed up to caller since it changes depending on no. of chips
-        iVal = atoi(tok);
-        *offset = iVal;
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-    	chipCount = atoi(tok);
-        pAttr->add("Chip Count", "", NDAttrInt8, &chipCount);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        *xsize = iVal;
-        pAttr->add("X Size", "", NDAttrInt32, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        *ysize = iVal;
-        pAttr->add("Y Size", "", NDAttrInt32, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-    	tok++; // skip the leading U (on this strangely represented field)
-    	iVal = atoi(tok);
-        pAttr->add("Pixel Depth", "", NDAttrInt32, &iVal);
-        *pixelDepth = iVal;
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        pAttr->add("Sensor Layout", "", NDAttrString, tok);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = strtoul(tok, NULL, 16);
-        pAttr->add("Chip Select", "", NDAttrInt8, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-    	// TODO - need to convert time to useful (numeric) format
-        pAttr->add("Time stamp", "", NDAttrInt32, 0);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        dVal = atof(tok);
-        pAttr->add("Shutter Time", "", NDAttrFloat64, &dVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        pAttr->add("Counter", "", NDAttrInt8, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        pAttr->add("Colour Mode", "", NDAttrInt8, &iVal);
-    }
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        pAttr->add("Gain Mode", "", NDAttrInt8, &iVal);
-    }
-
-    for (i = 0; i <= 7; i++)
-    {
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        dVal = atof(tok);
-			epicsSnprintf(thresholdName, sizeof(thresholdName), "Threshold %d", i);
-			pAttr->add(thresholdName, "", NDAttrFloat64, &dVal);
-        }
-    }
-
-    tok = epicsStrtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL && strncmp(tok, OPT_START_STRING, OPT_TOKEN_LEN) == 0)
-    {
-        // this section reads the optional extension fields
-        int done = false, count = 0;
-
-        count = 0;
-        do
-        {
-            if (tok != NULL && strncmp(tok, OPT_END_STRING, OPT_TOKEN_LEN) == 0)
-            {
-                iVal = atoi(tok);
-                pAttr->add(optFields[count], "", NDAttrInt16, &iVal);
-                tok = epicsStrtok_r(NULL, ",", &save_ptr);
-                switch (count)
-                {
-                case PROFILE_SELECT_POS:
-                    *profileSelect = iVal;
-                    break;
-                case DACS_PRESENT_POS:
-                    dacsPreset = iVal;
-                    break;
-                }
-                count++;
-            }
-            else
-            {
-                done = true;
-            }
-        } while (!done && count < optFieldsCount);
-    }
-
-    // this section reads chip dac info blocks for each of the chips on the device
-    for (chip = 0; chip < chipCount && dacsPreset; chip++)
-    {
-        tok = epicsStrtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            epicsSnprintf(thresholdName, sizeof(thresholdName), "DAC %d Format",
-                    chip);
-            pAttr->add(thresholdName, "", NDAttrString, tok);
-        }
-        for (i = 0; i <= 7; i++)
-        {
-            tok = epicsStrtok_r(NULL, ",", &save_ptr);
-            if (tok != NULL)
-            {
-                uVal = atol(tok);
-                epicsSnprintf(thresholdName, sizeof(thresholdName),
-                        "Chip %d Threshold bits %d", chip, i);
-                pAttr->add(thresholdName, "", NDAttrUInt16, &uVal);
-            }
-        }
-
-        for (i = 0; i < dacInfoCount; i++)
-        {
-            tok = epicsStrtok_r(NULL, ",", &save_ptr);
-            if (tok != NULL)
-            {
-                iVal = atoi(tok);
-                epicsSnprintf(thresholdName, sizeof(thresholdName), "Chip %d %s",
-                        chip + 1, dacInfo[i]);
-                pAttr->add(thresholdName, "", NDAttrInt16, &iVal);
-            }
-        }
-
-    }
-}
-
-
 //
 //// Data Frame Header Parser for original Frames of type 12B and 24B
 //// Also parses generic Frames of type IMG (originally developed for UoM XBPM
@@ -574,7 +410,7 @@ asynStatus mpxConnection::mpxWrite(double timeout)
 }
 
 /**
- * Reads in a raw MPX frame from a pasynOctetSyncIO handle
+ * Reads in a raw MPX frame from the connection
  *
  * This function skips any leading data, looking for the pattern
  * MPX,0000000000,
@@ -582,143 +418,177 @@ asynStatus mpxConnection::mpxWrite(double timeout)
  * Where
  *      0000000000 = the no. of bytes in body of the
  *          frame in decimal (inclusive of comma after 000000000)
- * Reads the rest of the body into the passed bodyBuf
- *
+ * On success body points at the frame body in the stream buffer, it remains
+ * valid until the next read on this connection.
  */
-asynStatus mpxConnection::mpxRead(asynUser* pasynUser, char* bodyBuf,
-        int bufSize, int* bytesRead, double timeout)
+asynStatus mpxConnection::mpxReadFrame(const char** body, int* bodySize,
+        double timeout)
 {
-    size_t nread = 0;
     asynStatus status = asynSuccess;
-    int eomReason;
-    const char *functionName = "mpxRead";
-    int headerSize = strlen(MPX_HEADER) + MPX_MSG_LEN_DIGITS + 2;
-    int mpxLen = strlen(MPX_HEADER);
-    int bodySize;
-    int readCount = 0;
-    int leadingJunk = 0;
-    int headerChar = 0;
-
-    char headerStr[] = MPX_HEADER;
-    char* tok;
-    char* save_ptr = NULL;
-    char header[MPX_MAXLINE];
+    const char *functionName = "mpxReadFrame";
 
     // default to this error for any following parsing issues
     fromLabviewError = MPX_ERR_UNEXPECTED;
-    // clear previous contents of buffer in case of error
-    bodyBuf[0] = 0;
-    *bytesRead = 0;
+    *body = NULL;
 
-    // look for MPX in the stream, throw away any preceding data
-    // this is to re-synch with server after an error or reboot
-    while (headerChar < mpxLen)
+    status = mpxReadHeader(bodySize, timeout);
+    if (status != asynSuccess)
+        return status;
+
+    if ((size_t) *bodySize > reader->getCapacity())
     {
-        status = pasynOctetSyncIO->read(pasynUser, header + headerChar, 1,
-                timeout, &nread, &eomReason);
-        if (status != asynSuccess)
-            return status;
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, frame size %d not supported\n",
+                driverName, functionName, *bodySize);
+        mpxDiscardBody(*bodySize, timeout);
+        return asynError;
+    }
 
-        if (header[headerChar] == headerStr[headerChar])
-        {
-            headerChar++;
-        }
-        else
-        {
-            leadingJunk++;
-            headerChar = 0;
-        }
+    // now get the rest of the message (the body)
+    status = reader->peek(*bodySize, body, timeout);
+    if (status != asynSuccess)
+    {
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, timeout=%f, status=%d incomplete MPX frame body\n",
+                driverName, functionName, timeout, status);
+        fromLabviewError = MPX_ERR_LEN;
+        return status;
     }
+    reader->consume(*bodySize);
+
+    fromLabviewError = MPX_OK;
+    return status;
+}
+
+/**
+ * Reads the MPX,0000000000, prefix of a frame from the connection
+ *
+ * Any data preceding the MPX pattern is discarded. On success bodySize is the
+ * number of bytes that follow the prefix, i.e. the frame body that the caller
+ * must consume with mpxReadBody (in one or more calls) before reading the
+ * next prefix. Splitting the read this way allows the caller to decide where
+ * each part of the body lands, e.g. the pixel data straight into an NDArray.
+ */
+asynStatus mpxConnection::mpxReadHeader(int* bodySize, double timeout)
+{
+    asynStatus status = asynSuccess;
+    const char *functionName = "mpxReadHeader";
+    int headerSize = strlen(MPX_HEADER) + MPX_MSG_LEN_DIGITS + 2;
+    size_t leadingJunk = 0;
+    const char* view;
+    char header[MPX_MAXLINE];
+    char* end;
+
+    *bodySize = 0;
+    readLost = 0;
+
+    // look for MPX in the stream, throw away any preceding data
+    // this is to re-synch with server after an error or reboot
+    status = reader->sync(MPX_HEADER ",", strlen(MPX_HEADER) + 1, &leadingJunk,
+            timeout);
 
     if (leadingJunk > 0)
     {
-        asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                "%s:%s, status=%d %d bytes of leading garbage discarded before header %s \n",
-                driverName, functionName, status, leadingJunk,
+        resyncCount++;
+        discardedBytes += leadingJunk;
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, status=%d %lu bytes of leading garbage discarded before header %s \n",
+                driverName, functionName, status, (unsigned long) leadingJunk,
                 this->fromLabview);
     }
-
-    // read the rest of the header block including message length
-    readCount = 0;
-    do
+    if (status != asynSuccess)
     {
-        status = pasynOctetSyncIO->read(pasynUser, header + mpxLen + readCount,
-                (headerSize - mpxLen) - readCount, timeout, &nread, &eomReason);
-        if (status == asynSuccess)
-            readCount += nread;
-    } while (nread != 0 && readCount < (headerSize - mpxLen)
-            && status == asynSuccess);
+        readLost = status != asynTimeout;
+        return status;
+    }
 
+    // get the rest of the header block including message length
+    status = reader->peek(headerSize, &view, timeout);
     if (status != asynSuccess)
     {
-        asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                "%s:%s, timeout=%f, status=%d received %d bytes\n%s\n",
-                driverName, functionName, timeout, status, readCount,
-                this->fromLabview);
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, timeout=%f, status=%d Header too short\n",
+                driverName, functionName, timeout, status);
+        readLost = status != asynTimeout;
+        return status;
     }
-    else
-    {
-        if (readCount != (headerSize - mpxLen))
-        {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, Header too short\n",
-                    driverName, functionName);
-            return asynError;
-        }
 
-        // terminate the response for string handling
-        header[readCount + mpxLen] = (char) NULL;
-        strncpy(fromLabviewHeader, header, MPX_MAXLINE);
+    // terminate the response for string handling
+    memcpy(header, view, headerSize);
+    header[headerSize] = 0;
+    strncpy(fromLabviewHeader, header, MPX_MAXLINE);
 
-        asynPrint(this->parentUser, ASYN_TRACE_MPX,
-                "mpxRead: Response Header: %s\n", header);
+    asynPrint(this->parentUser, ASYN_TRACE_MPX,
+            "mpxRead: Response Header: %s\n", header);
 
-        // parse the header
-        tok = epicsStrtok_r(header, ",", &save_ptr); // this first element already verified above
+    // the length is the digits between the two commas, if it is not then
+    // this was not really a header, skip the MPX and let the next read resync
+    *bodySize = strtol(header + strlen(MPX_HEADER) + 1, &end, 10);
+    if (end != header + headerSize - 1 || *end != ',')
+    {
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, Header has bad length field\n",
+                driverName, functionName);
+        reader->consume(strlen(MPX_HEADER));
+        resyncCount++;
+        discardedBytes += strlen(MPX_HEADER);
+        *bodySize = 0;
+        return asynError;
+    }
+    reader->consume(headerSize);
 
-        tok = epicsStrtok_r(NULL, ",", &save_ptr);
-        if (tok == NULL)
-        {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, Header missing first comma\n",
-                    driverName, functionName);
-            return asynError;
-        }
-        // subtract one from bodySize since we already read the 1st comma
-        bodySize = atoi(tok) - 1;
+    // subtract one from bodySize since we already read the 1st comma
+    *bodySize -= 1;
 
-        if (bodySize == 0 || bodySize >= bufSize)
-        {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, frame size %d not supported\n",
-                    driverName, functionName, bodySize);
-            return asynError;
-        }
-        // now read the rest of the message (the body)
-        readCount = 0;
-        do
-        {
-            status = pasynOctetSyncIO->read(pasynUser, bodyBuf + readCount,
-                    bodySize - readCount, timeout, &nread, &eomReason);
-            if (status == asynSuccess)
-                readCount += nread;
-        } while (nread != 0 && readCount < bodySize && status == asynSuccess);
+    if (*bodySize <= 0)
+    {
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, frame size %d not supported\n",
+                driverName, functionName, *bodySize);
+        return asynError;
+    }
 
-        if (readCount < bodySize)
-        {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, timeout=%f, status=%d received %d bytes in MPX command body, expected %d\n",
-                    driverName, functionName, timeout, status, readCount,
-                    bodySize);
-            fromLabviewError = MPX_ERR_LEN;
-            return status = asynSuccess ? asynError : status;
-        }
+    return asynSuccess;
+}
+
+/**
+ * Returns 1 if the last mpxReadHeader failed because the connection could
+ * not be read, 0 if it timed out or found a bad header on a working one
+ */
+int mpxConnection::mpxReadLost()
+{
+    return readLost;
+}
+
+/**
+ * Reads exactly size bytes of an MPX frame body into bodyBuf
+ */
+asynStatus mpxConnection::mpxReadBody(char* bodyBuf, int size, double timeout)
+{
+    asynStatus status = asynSuccess;
+    const char *functionName = "mpxReadBody";
 
-        *bytesRead = readCount;
+    status = reader->readInto(bodyBuf, size, timeout);
+    if (status != asynSuccess)
+    {
+        asynPrint(tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, timeout=%f, status=%d short MPX frame body, expected %d bytes\n",
+                driverName, functionName, timeout, status, size);
+        fromLabviewError = MPX_ERR_LEN;
+        return status;
     }
 
-    fromLabviewError = MPX_OK;
-    return status;
+    return asynSuccess;
+}
+
+/**
+ * Reads and throws away size bytes of an MPX frame body, used to keep in
+ * step with the stream when a frame cannot be used
+ */
+asynStatus mpxConnection::mpxDiscardBody(int size, double timeout)
+{
+    discardedBytes += size;
+    return reader->discard(size, timeout);
 }
 
 /**
@@ -732,6 +602,7 @@ asynStatus mpxConnection::mpxReadCmd(char* cmdType, char* cmdName,
     static const char *functionName = "mpxReadCmd";
     int nread = 0;
     asynStatus status = asynSuccess;
+    const char* body;
     char buff[MPX_MAXLINE];
     char* tok;
     char* save_ptr = NULL;
@@ -749,11 +620,20 @@ asynStatus mpxConnection::mpxReadCmd(char* cmdType, char* cmdName,
     // at either end
     while (status == asynSuccess)
     {
-        status = mpxRead(this->tcpUser, buff, MPX_MAXLINE, &nread, timeout);
+        status = mpxReadFrame(&body, &nread, timeout);
+
+        if (status == asynSuccess && nread >= MPX_MAXLINE)
+        {
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s, response of %d bytes too long\n", driverName,
+                    functionName, nread);
+            nread = MPX_MAXLINE - 1;
+        }
 
         if (status == asynSuccess)
         {
             // terminate the response for string handling
+            memcpy(buff, body, nread);
             buff[nread] = (char) NULL;
             // update the member variables with relevant parts of the response
             strncpy(fromLabviewBody, buff, MPX_MAXLINE);
@@ -819,6 +699,245 @@ asynStatus mpxConnection::mpxWriteRead(char* cmdType, char* cmdName,
     return asynSuccess;
 }
 
+// #######################################################################################
+// ##################### Batched commands                         ########################
+// #######################################################################################
+
+/**
+ * Starts a new batch of commands
+ *
+ * The commands are added with mpxBatchSet, mpxBatchGet and mpxBatchCommand
+ * and then sent with mpxBatchRun, which writes them all before reading any
+ * of the responses so the batch costs one round trip instead of one for
+ * each command. The server handles the commands in order so a GET after a
+ * SET of the same variable reads back the value that was applied.
+ */
+void mpxConnection::mpxBatchBegin()
+{
+    batchCount = 0;
+}
+
+int mpxConnection::batchAdd(const char* type, const char* name,
+        const char* value)
+{
+    mpxBatchItem* item;
+
+    if (batchCount == MPX_BATCH_MAX)
+    {
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:batchAdd, too many commands in batch, %s %s dropped\n",
+                driverName, type, name);
+        return -1;
+    }
+
+    item = &batch[batchCount];
+    item->type = type;
+    strncpy(item->name, name, MPX_MAXLINE - 1);
+    item->name[MPX_MAXLINE - 1] = 0;
+    strncpy(item->value, value, MPX_MAXLINE - 1);
+    item->value[MPX_MAXLINE - 1] = 0;
+    item->status = asynError;
+    item->error = MPX_ERR_UNEXPECTED;
+    return batchCount++;
+}
+
+/**
+ * Adds a SET of valueId to the batch, returns the index of the command in
+ * batch or -1 if the batch is full
+ */
+int mpxConnection::mpxBatchSet(char* valueId, const char* value)
+{
+    return batchAdd(MPX_SET, valueId, value);
+}
+
+/**
+ * Adds a GET of valueId to the batch, the value is in batch[index].value
+ * once mpxBatchRun has returned
+ */
+int mpxConnection::mpxBatchGet(char* valueId)
+{
+    return batchAdd(MPX_GET, valueId, "");
+}
+
+int mpxConnection::mpxBatchCommand(char* commandId)
+{
+    return batchAdd(MPX_CMD, commandId, "");
+}
+
+/**
+ * Fills in the batch item that a response belongs to. Responses come back
+ * in the order the commands were sent, a response for a later command means
+ * the ones before it were lost.
+ */
+void mpxConnection::batchResponse(char* body)
+{
+    static const char *functionName = "batchResponse";
+    mpxBatchItem* item;
+    char* type;
+    char* name;
+    char* tok;
+    char* save_ptr = NULL;
+    int i;
+
+    type = epicsStrtok_r(body, ",", &save_ptr);
+    name = epicsStrtok_r(NULL, ",", &save_ptr);
+    if (type == NULL || name == NULL)
+        return;
+
+    for (i = batchNext; i < batchCount; i++)
+    {
+        if (!strcmp(batch[i].type, type) && !strcmp(batch[i].name, name))
+            break;
+    }
+    if (i == batchCount)
+    {
+        // left over from an earlier command that timed out
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, unexpected response from labview: '%s,%s'\n",
+                driverName, functionName, type, name);
+        return;
+    }
+    for (; batchNext < i; batchNext++)
+    {
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, no response to %s %s\n", driverName, functionName,
+                batch[batchNext].type, batch[batchNext].name);
+    }
+
+    item = &batch[batchNext++];
+    if (!strcmp(item->type, MPX_GET))
+    {
+        // GET,name,value,error
+        tok = epicsStrtok_r(NULL, ",", &save_ptr);
+        if (tok == NULL)
+            return;
+        strncpy(item->value, tok, MPX_MAXLINE - 1);
+        item->value[MPX_MAXLINE - 1] = 0;
+    }
+    // SET,name,error or CMD,name,error
+    tok = epicsStrtok_r(NULL, ",", &save_ptr);
+    if (tok == NULL)
+        return;
+    item->error = atoi(tok);
+    item->status = item->error == MPX_OK ? asynSuccess : asynError;
+}
+
+/**
+ * Writes all the commands of the batch and then reads the responses,
+ * the outcome of each command is in its batch item.
+ * Returns asynSuccess if every command succeeded.
+ */
+asynStatus mpxConnection::mpxBatchRun(double timeout)
+{
+    static const char *functionName = "mpxBatchRun";
+    char buff[MPX_BATCH_MAX * MPX_MAXLINE];
+    char body[MPX_MAXLINE];
+    char* pos = buff;
+    const char* response;
+    size_t nwrite;
+    int nread;
+    int msg_len;
+    int i;
+    asynStatus status = asynSuccess;
+
+    if (batchCount == 0)
+        return asynSuccess;
+
+    for (i = 0; i < batchCount; i++)
+    {
+        // the length counts the characters after the comma following it
+        msg_len = strlen(batch[i].type) + strlen(batch[i].name) + 2;
+        if (!strcmp(batch[i].type, MPX_SET))
+            msg_len += strlen(batch[i].value) + 1;
+
+        if (!strcmp(batch[i].type, MPX_SET))
+            sprintf(toLabview, "%s,%010u,%s,%s,%s", MPX_HEADER, msg_len,
+                    batch[i].type, batch[i].name, batch[i].value);
+        else
+            sprintf(toLabview, "%s,%010u,%s,%s", MPX_HEADER, msg_len,
+                    batch[i].type, batch[i].name);
+
+        asynPrint(this->parentUser, ASYN_TRACE_MPX,
+                "mpxBatchRun: Request: %s\n", toLabview);
+        parentObj->toLabViewStr(this->toLabview);
+
+        strcpy(pos, toLabview);
+        pos += strlen(toLabview);
+        if (!strcmp(batch[i].type, MPX_GET))
+            batch[i].value[0] = 0;
+    }
+
+    status = pasynOctetSyncIO->write(this->tcpUser, buff, pos - buff,
+            timeout, &nwrite);
+    if (status != asynSuccess)
+    {
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, status=%d, writing %d commands\n", driverName,
+                functionName, status, batchCount);
+        fromLabviewError = MPX_ERR_WRITE;
+        for (i = 0; i < batchCount; i++)
+        {
+            batch[i].status = status;
+            batch[i].error = MPX_ERR_WRITE;
+        }
+        return status;
+    }
+
+    batchNext = 0;
+    while (batchNext < batchCount)
+    {
+        status = mpxReadFrame(&response, &nread, timeout);
+        if (status != asynSuccess)
+        {
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s, status=%d, no response to %s %s\n", driverName,
+                    functionName, status, batch[batchNext].type,
+                    batch[batchNext].name);
+            for (i = batchNext; i < batchCount; i++)
+            {
+                batch[i].status = status;
+                batch[i].error = MPX_ERR_READ;
+            }
+            break;
+        }
+
+        if (nread >= MPX_MAXLINE)
+            nread = MPX_MAXLINE - 1;
+        memcpy(body, response, nread);
+        body[nread] = 0;
+
+        strncpy(fromLabviewBody, body, MPX_MAXLINE);
+        strncpy(fromLabview, fromLabviewHeader, MPX_MAXLINE);
+        strncat(fromLabview, fromLabviewBody, MPX_MAXLINE);
+        parentObj->fromLabViewStr(this->fromLabview);
+        asynPrint(this->parentUser, ASYN_TRACE_MPX,
+                "mpxBatchRun: Response: %s\n", fromLabview);
+
+        batchResponse(body);
+    }
+
+    status = asynSuccess;
+    for (i = 0; i < batchCount; i++)
+    {
+        if (batch[i].status != asynSuccess)
+        {
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s, %s %s failed, error=%d\n", driverName,
+                    functionName, batch[i].type, batch[i].name,
+                    batch[i].error);
+            if (status == asynSuccess)
+            {
+                status = batch[i].status;
+                fromLabviewError = batch[i].error;
+            }
+        }
+    }
+    if (status == asynSuccess)
+        fromLabviewError = MPX_OK;
+
+    return status;
+}
+
 // #######################################################################################
 // ##################### Helper functions                         ########################
 // #######################################################################################
@@ -871,3 +990,76 @@ void mpxConnection::dumpData(char* sdata, int size)
     printf("\n\n");
 }
 
+/**
+ * Returns non zero if the last batch failed because the connection went,
+ * rather than because the server refused a command or was slow to answer
+ */
+/**
+ * Returns the number of commands that can still be added to the batch
+ */
+int mpxConnection::mpxBatchRoom()
+{
+    return MPX_BATCH_MAX - batchCount;
+}
+
+int mpxConnection::mpxBatchLost()
+{
+    int i;
+
+    for (i = 0; i < batchCount; i++)
+    {
+        if ((batch[i].error == MPX_ERR_WRITE || batch[i].error == MPX_ERR_READ)
+                && batch[i].status != asynTimeout)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Drops the TCP connection of the port and makes it again. A direct socket
+ * is only connected if the reader has closed it.
+ * Returns asynSuccess once the port is connected.
+ */
+asynStatus mpxConnection::mpxReconnect()
+{
+    static const char *functionName = "mpxReconnect";
+    int connected = 0;
+
+    // merlinTask closes a socket when a read from it fails, one that is
+    // still open is left to it
+    if (socket != NULL)
+        return mpxSocketConnect(socket);
+    if (commonUser == NULL)
+        return asynError;
+
+    // the port may already have dropped the connection, or have connected
+    // again by itself, so only the final state counts
+    pasynCommonSyncIO->disconnectDevice(commonUser);
+    pasynCommonSyncIO->connectDevice(commonUser);
+    if (pasynManager->isConnected(commonUser, &connected) != asynSuccess
+            || !connected)
+    {
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, could not connect\n", driverName, functionName);
+        return asynDisconnected;
+    }
+    return asynSuccess;
+}
+
+/**
+ * Throws away everything buffered from the old connection, called by the
+ * thread that reads from this connection
+ */
+void mpxConnection::mpxFlush()
+{
+    reader->flush();
+}
+
+/**
+ * Returns the kernel time at which the last data arrived, in ns since the
+ * epoch, or 0 if it is not known (only a direct socket on Linux has it)
+ */
+epicsUInt64 mpxConnection::mpxReceiveTime()
+{
+    return reader->receiveTime();
+}
@@ -15,7 +15,23 @@ typedef enum
     MPXUnknownHeader
 } merlinDataHeader;
 
+/** most commands in one batch */
+#define MPX_BATCH_MAX 64
+
+/** A command of a batch and its response */
+typedef struct
+{
+    const char* type;           // MPX_SET, MPX_GET or MPX_CMD
+    char name[MPX_MAXLINE];
+    char value[MPX_MAXLINE];    // the value to SET, or the value from a GET
+    asynStatus status;          // asynSuccess if the command succeeded
+    int error;                  // MPX_OK or the error code of the response
+} mpxBatchItem;
+
+#include "mpxSocket.h"
+
 class merlinDetector;
+class mpxStreamReader;
 
 class mpxConnection
 {
@@ -28,10 +44,16 @@ public:
     char fromLabviewValue[MPX_MAXLINE];
     int fromLabviewError;
 
+    /* running totals of what was thrown away to keep in step with the data
+     * channel, read by the driver after each frame */
+    int resyncCount;
+    double discardedBytes;
+
 public:
     // Constructor
     mpxConnection(asynUser* parentUser, asynUser* tcpUser,
-            merlinDetector* parentObj);
+            merlinDetector* parentObj, size_t readBufferSize,
+            mpxSocket* socket = NULL);
 
     /* The labview communication primitives */
     asynStatus mpxGet(char* valueId, double timeout);
@@ -40,21 +62,46 @@ public:
     asynStatus mpxWrite(double timeout);
     asynStatus mpxReadCmd(char* cmdType, char* cmdName, double timeout);
     asynStatus mpxWriteRead(char* cmdType, char* cmdName, double timeout);
-    asynStatus mpxRead(asynUser* pasynUser, char* bodyBuf, int bufSize,
-            int* bytesRead, double timeout);
+    asynStatus mpxReadFrame(const char** body, int* bodySize, double timeout);
+    asynStatus mpxReadHeader(int* bodySize, double timeout);
+    int mpxReadLost();
+    asynStatus mpxReadBody(char* bodyBuf, int size, double timeout);
+    asynStatus mpxDiscardBody(int size, double timeout);
+
+    /* Batches of commands written together, the responses are read back
+     * once all the commands have been sent */
+    void mpxBatchBegin();
+    int mpxBatchSet(char* valueId, const char* value);
+    int mpxBatchGet(char* valueId);
+    int mpxBatchCommand(char* commandId);
+    asynStatus mpxBatchRun(double timeout);
+    mpxBatchItem batch[MPX_BATCH_MAX];
+    int batchCount;
+    int mpxBatchLost();
+    int mpxBatchRoom();
+
+    /* Remaking the connection after it was lost or the server was reset */
+    asynStatus mpxReconnect();
+    void mpxFlush();
+    epicsUInt64 mpxReceiveTime();
 
     /* Helper functions */
     merlinDataHeader parseDataHeader(const char* header);
-    void parseMqDataFrame(NDAttributeList* pAttr, const char* header,
-    		size_t *xsize, size_t *ysize, int* pixelDepth, int* offset,
-    		int* profileSelect);
 
     void dumpData(char* sdata, int size);
 
 private:
+    int batchAdd(const char* type, const char* name, const char* value);
+    void batchResponse(char* body);
+
     asynUser* parentUser;
     asynUser* tcpUser;
+    asynUser* commonUser;   // asynCommon of the port, to reconnect it
+    mpxSocket* socket;      // direct socket used instead of the port
+    int readLost;           // the last mpxReadHeader failed to read
     merlinDetector* parentObj;
+    mpxStreamReader* reader;
+    int batchNext;          // first batch item still waiting for a response
 };
 
 #endif
@@ -0,0 +1,510 @@
+/* mpxDecode.cpp
+ *
+ * Pixel conversion kernels for Merlin data frames, see mpxDecode.h
+ *
+ * Each kernel converts a pair of rows at a time (the top and bottom rows
+ * of what is left of the image) so that the same code serves for copying
+ * out of a receive buffer and for converting an NDArray in place.
+ * The byte swap is a byte shuffle with a constant mask, the identity mask
+ * is used when no swap is required.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <epicsExport.h>
+
+#include "mpxDecode.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MPX_DECODE_X86
+#include <immintrin.h>
+#if defined(__clang__) || __GNUC__ >= 6
+#define MPX_DECODE_AVX512
+#endif
+#endif
+
+int mpxDecodeStreamBytes = 1024 * 1024;
+
+/** converts bytes of the rows sTop and sBot into dTop and dBot, the row
+ * contents are exchanged and each element of swapSize bytes is reversed
+ * stream: use non-temporal stores, rows are then 16 byte aligned */
+typedef void (*mpxRowPairFunc)(char* dTop, char* dBot, const char* sTop,
+        const char* sBot, size_t bytes, int swapSize, int stream);
+
+static mpxRowPairFunc rowPairKernel = NULL;
+static const char* kernelName = "none";
+static int flatFieldAvx2 = 0;
+
+// pshufb masks (indices are within each 16 byte lane)
+static const unsigned char swapMask1[16] =
+{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+static const unsigned char swapMask2[16] =
+{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+static const unsigned char swapMask4[16] =
+{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+
+static inline uint16_t swap16(uint16_t x)
+{
+    return (uint16_t) ((x >> 8) | (x << 8));
+}
+
+static inline uint32_t swap32(uint32_t x)
+{
+    return (x >> 24) | ((x << 8) & 0x00FF0000) | ((x >> 8) & 0x0000FF00)
+            | (x << 24);
+}
+
+// the reference implementation, also used for the tail of each row
+static void rowPairScalar(char* dTop, char* dBot, const char* sTop,
+        const char* sBot, size_t bytes, int swapSize, int stream)
+{
+    size_t i;
+
+    switch (swapSize)
+    {
+    case 2:
+        for (i = 0; i + 2 <= bytes; i += 2)
+        {
+            uint16_t top, bottom;
+            memcpy(&top, sTop + i, 2);
+            memcpy(&bottom, sBot + i, 2);
+            top = swap16(top);
+            bottom = swap16(bottom);
+            memcpy(dTop + i, &bottom, 2);
+            memcpy(dBot + i, &top, 2);
+        }
+        break;
+    case 4:
+        for (i = 0; i + 4 <= bytes; i += 4)
+        {
+            uint32_t top, bottom;
+            memcpy(&top, sTop + i, 4);
+            memcpy(&bottom, sBot + i, 4);
+            top = swap32(top);
+            bottom = swap32(bottom);
+            memcpy(dTop + i, &bottom, 4);
+            memcpy(dBot + i, &top, 4);
+        }
+        break;
+    default:
+        for (i = 0; i + 8 <= bytes; i += 8)
+        {
+            uint64_t top, bottom;
+            memcpy(&top, sTop + i, 8);
+            memcpy(&bottom, sBot + i, 8);
+            memcpy(dTop + i, &bottom, 8);
+            memcpy(dBot + i, &top, 8);
+        }
+        for (; i < bytes; i++)
+        {
+            char top = sTop[i];
+            char bottom = sBot[i];
+            dTop[i] = bottom;
+            dBot[i] = top;
+        }
+        break;
+    }
+}
+
+#ifdef MPX_DECODE_X86
+
+static const unsigned char* swapMask(int swapSize)
+{
+    return swapSize == 4 ? swapMask4 : swapSize == 2 ? swapMask2 : swapMask1;
+}
+
+__attribute__((target("ssse3")))
+static void rowPairSsse3(char* dTop, char* dBot, const char* sTop,
+        const char* sBot, size_t bytes, int swapSize, int stream)
+{
+    __m128i mask = _mm_loadu_si128((const __m128i*) swapMask(swapSize));
+    __m128i top, bottom;
+    size_t i;
+
+    for (i = 0; i + 16 <= bytes; i += 16)
+    {
+        top = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (sTop + i)),
+                mask);
+        bottom = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (sBot + i)),
+                mask);
+        if (stream)
+        {
+            _mm_stream_si128((__m128i*) (dTop + i), bottom);
+            _mm_stream_si128((__m128i*) (dBot + i), top);
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i*) (dTop + i), bottom);
+            _mm_storeu_si128((__m128i*) (dBot + i), top);
+        }
+    }
+    rowPairScalar(dTop + i, dBot + i, sTop + i, sBot + i, bytes - i, swapSize,
+            0);
+}
+
+// non-temporal store of 32 bytes to a 16 byte aligned address
+__attribute__((target("avx2")))
+static inline void stream256(char* p, __m256i v)
+{
+    if (((uintptr_t) p & 31) == 0)
+    {
+        _mm256_stream_si256((__m256i*) p, v);
+    }
+    else
+    {
+        _mm_stream_si128((__m128i*) p, _mm256_castsi256_si128(v));
+        _mm_stream_si128((__m128i*) (p + 16), _mm256_extracti128_si256(v, 1));
+    }
+}
+
+__attribute__((target("avx2")))
+static void rowPairAvx2(char* dTop, char* dBot, const char* sTop,
+        const char* sBot, size_t bytes, int swapSize, int stream)
+{
+    __m256i mask = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) swapMask(swapSize)));
+    __m256i top, bottom;
+    size_t i;
+
+    for (i = 0; i + 32 <= bytes; i += 32)
+    {
+        top = _mm256_shuffle_epi8(
+                _mm256_loadu_si256((const __m256i*) (sTop + i)), mask);
+        bottom = _mm256_shuffle_epi8(
+                _mm256_loadu_si256((const __m256i*) (sBot + i)), mask);
+        if (stream)
+        {
+            stream256(dTop + i, bottom);
+            stream256(dBot + i, top);
+        }
+        else
+        {
+            _mm256_storeu_si256((__m256i*) (dTop + i), bottom);
+            _mm256_storeu_si256((__m256i*) (dBot + i), top);
+        }
+    }
+    rowPairScalar(dTop + i, dBot + i, sTop + i, sBot + i, bytes - i, swapSize,
+            0);
+}
+
+#ifdef MPX_DECODE_AVX512
+__attribute__((target("avx512f,avx512bw")))
+static void rowPairAvx512(char* dTop, char* dBot, const char* sTop,
+        const char* sBot, size_t bytes, int swapSize, int stream)
+{
+    unsigned char lanes[64];
+    __m512i mask, top, bottom;
+    size_t i;
+
+    for (i = 0; i < 64; i += 16)
+        memcpy(lanes + i, swapMask(swapSize), 16);
+    mask = _mm512_loadu_si512((const void*) lanes);
+
+    // 512 bit non-temporal stores need 64 byte alignment, AVX2 copes with 16
+    if (stream && (((uintptr_t) dTop | (uintptr_t) dBot) & 63) != 0)
+    {
+        rowPairAvx2(dTop, dBot, sTop, sBot, bytes, swapSize, stream);
+        return;
+    }
+
+    for (i = 0; i + 64 <= bytes; i += 64)
+    {
+        top = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*) (sTop + i)),
+                mask);
+        bottom = _mm512_shuffle_epi8(
+                _mm512_loadu_si512((const void*) (sBot + i)), mask);
+        if (stream)
+        {
+            _mm512_stream_si512((__m512i*) (dTop + i), bottom);
+            _mm512_stream_si512((__m512i*) (dBot + i), top);
+        }
+        else
+        {
+            _mm512_storeu_si512((void*) (dTop + i), bottom);
+            _mm512_storeu_si512((void*) (dBot + i), top);
+        }
+    }
+    rowPairScalar(dTop + i, dBot + i, sTop + i, sBot + i, bytes - i, swapSize,
+            0);
+}
+#endif /* MPX_DECODE_AVX512 */
+
+__attribute__((target("sse2")))
+static void streamFence(void)
+{
+    _mm_sfence();
+}
+
+#endif /* MPX_DECODE_X86 */
+
+void mpxDecodeInit(void)
+{
+    if (rowPairKernel != NULL)
+        return;
+
+    rowPairKernel = rowPairScalar;
+    kernelName = "scalar";
+
+#ifdef MPX_DECODE_X86
+    __builtin_cpu_init();
+    flatFieldAvx2 = __builtin_cpu_supports("avx2");
+#ifdef MPX_DECODE_AVX512
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        rowPairKernel = rowPairAvx512;
+        kernelName = "AVX-512";
+        return;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2"))
+    {
+        rowPairKernel = rowPairAvx2;
+        kernelName = "AVX2";
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        rowPairKernel = rowPairSsse3;
+        kernelName = "SSSE3";
+    }
+#endif
+}
+
+const char* mpxDecodeKernelName(void)
+{
+    return kernelName;
+}
+
+static void invertRows(void* dst, const void* src, size_t rowBytes,
+        size_t ysize, int swapSize)
+{
+    char* pDst = (char*) dst;
+    const char* pSrc = (const char*) src;
+    size_t y, yFlip;
+    int stream = 0;
+
+    if (rowPairKernel == NULL)
+        mpxDecodeInit();
+
+#ifdef MPX_DECODE_X86
+    // non-temporal stores need every row to start 16 byte aligned
+    stream = rowPairKernel != rowPairScalar && mpxDecodeStreamBytes > 0
+            && rowBytes * ysize >= (size_t) mpxDecodeStreamBytes
+            && ((uintptr_t) pDst & 15) == 0 && (rowBytes & 15) == 0;
+#endif
+
+    // swap pairs of rows from the outside in, the middle row of an odd
+    // sized image is swapped with itself
+    for (y = 0; y < (ysize + 1) / 2; y++)
+    {
+        yFlip = ysize - 1 - y;
+        rowPairKernel(pDst + y * rowBytes, pDst + yFlip * rowBytes,
+                pSrc + y * rowBytes, pSrc + yFlip * rowBytes, rowBytes,
+                swapSize, stream);
+    }
+
+#ifdef MPX_DECODE_X86
+    if (stream)
+        streamFence();
+#endif
+}
+
+void mpxInvertRows8(void* dst, const void* src, size_t xsize, size_t ysize)
+{
+    invertRows(dst, src, xsize, ysize, 1);
+}
+
+void mpxInvertRows16(void* dst, const void* src, size_t xsize, size_t ysize,
+        int swap)
+{
+    invertRows(dst, src, xsize * 2, ysize, swap ? 2 : 1);
+}
+
+void mpxInvertRows32(void* dst, const void* src, size_t xsize, size_t ysize,
+        int swap)
+{
+    invertRows(dst, src, xsize * 4, ysize, swap ? 4 : 1);
+}
+
+// pixel values of 1, 2 or 4 bytes
+static inline float pixelAt(const void* src, int pixelBytes, size_t i)
+{
+    switch (pixelBytes)
+    {
+    case 1:
+        return (float) ((const uint8_t*) src)[i];
+    case 2:
+        return (float) ((const uint16_t*) src)[i];
+    default:
+        return (float) ((const uint32_t*) src)[i];
+    }
+}
+
+static void flatFieldToFloatScalar(float* dst, const void* src, int pixelBytes,
+        const float* factors, size_t start, size_t n)
+{
+    size_t i;
+
+    for (i = start; i < n; i++)
+    {
+        dst[i] = pixelAt(src, pixelBytes, i) * factors[i];
+    }
+}
+
+static void flatFieldScaleScalar(void* data, int pixelBytes,
+        const float* factors, size_t start, size_t n)
+{
+    size_t i;
+    float v;
+
+    // rounds half up and saturates to the pixel type, as the AVX2 kernel
+    for (i = start; i < n; i++)
+    {
+        v = pixelAt(data, pixelBytes, i) * factors[i] + 0.5f;
+        if (v < 0.f)
+            v = 0.f;
+        switch (pixelBytes)
+        {
+        case 1:
+            ((uint8_t*) data)[i] = v >= 255.f ? 255 : (uint8_t) v;
+            break;
+        case 2:
+            ((uint16_t*) data)[i] = v >= 65535.f ? 65535 : (uint16_t) v;
+            break;
+        default:
+            ((uint32_t*) data)[i] = v >= 4294967040.f ?
+                    0xFFFFFFFF : (uint32_t) v;
+            break;
+        }
+    }
+}
+
+#ifdef MPX_DECODE_X86
+
+// 8 pixels from src widened to 32 bit integers, the counters are at most
+// 24 bits so 32 bit pixels are treated as signed
+__attribute__((target("avx2")))
+static inline __m256i loadPixels8(const void* src, int pixelBytes, size_t i)
+{
+    switch (pixelBytes)
+    {
+    case 1:
+        return _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i*) ((const uint8_t*) src + i)));
+    case 2:
+        return _mm256_cvtepu16_epi32(
+                _mm_loadu_si128((const __m128i*) ((const uint16_t*) src + i)));
+    default:
+        return _mm256_loadu_si256((const __m256i*) ((const uint32_t*) src + i));
+    }
+}
+
+__attribute__((target("avx2")))
+static void flatFieldToFloatAvx2(float* dst, const void* src, int pixelBytes,
+        const float* factors, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(
+                _mm256_cvtepi32_ps(loadPixels8(src, pixelBytes, i)),
+                _mm256_loadu_ps(factors + i)));
+    }
+    flatFieldToFloatScalar(dst, src, pixelBytes, factors, i, n);
+}
+
+// 8 floats truncated to uint32, saturating as flatFieldScaleScalar does.
+// Values of 2^31 and above are brought into int32 range for the conversion
+// and the top bit put back afterwards
+__attribute__((target("avx2")))
+static inline __m256i truncateUint32(__m256 v)
+{
+    const __m256 top = _mm256_set1_ps(2147483648.f);
+    __m256 big = _mm256_cmp_ps(v, top, _CMP_GE_OQ);
+    __m256 full = _mm256_cmp_ps(v, _mm256_set1_ps(4294967040.f), _CMP_GE_OQ);
+    __m256i x;
+
+    x = _mm256_cvttps_epi32(_mm256_sub_ps(v, _mm256_and_ps(big, top)));
+    x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_castps_si256(big),
+            _mm256_set1_epi32((int) 0x80000000)));
+    return _mm256_or_si256(x, _mm256_castps_si256(full));
+}
+
+__attribute__((target("avx2")))
+static void flatFieldScaleAvx2(void* data, int pixelBytes,
+        const float* factors, size_t n)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 v;
+    __m256i x;
+    __m128i packed;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        // round half up and clamp to the type in float, as the scalar
+        // kernel, so the conversion never sees a value out of range
+        v = _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(loadPixels8(data, pixelBytes, i)),
+                _mm256_loadu_ps(factors + i)), half), zero);
+        switch (pixelBytes)
+        {
+        case 1:
+            x = _mm256_cvttps_epi32(_mm256_min_ps(v, _mm256_set1_ps(255.f)));
+            packed = _mm_packus_epi32(_mm256_castsi256_si128(x),
+                    _mm256_extracti128_si256(x, 1));
+            _mm_storel_epi64((__m128i*) ((uint8_t*) data + i),
+                    _mm_packus_epi16(packed, packed));
+            break;
+        case 2:
+            x = _mm256_cvttps_epi32(
+                    _mm256_min_ps(v, _mm256_set1_ps(65535.f)));
+            _mm_storeu_si128((__m128i*) ((uint16_t*) data + i),
+                    _mm_packus_epi32(_mm256_castsi256_si128(x),
+                            _mm256_extracti128_si256(x, 1)));
+            break;
+        default:
+            _mm256_storeu_si256((__m256i*) ((uint32_t*) data + i),
+                    truncateUint32(v));
+            break;
+        }
+    }
+    flatFieldScaleScalar(data, pixelBytes, factors, i, n);
+}
+
+#endif /* MPX_DECODE_X86 */
+
+void mpxFlatFieldToFloat(float* dst, const void* src, int pixelBytes,
+        const float* factors, size_t n)
+{
+#ifdef MPX_DECODE_X86
+    if (flatFieldAvx2)
+    {
+        flatFieldToFloatAvx2(dst, src, pixelBytes, factors, n);
+        return;
+    }
+#endif
+    flatFieldToFloatScalar(dst, src, pixelBytes, factors, 0, n);
+}
+
+void mpxFlatFieldScale(void* data, int pixelBytes, const float* factors,
+        size_t n)
+{
+#ifdef MPX_DECODE_X86
+    if (flatFieldAvx2)
+    {
+        flatFieldScaleAvx2(data, pixelBytes, factors, n);
+        return;
+    }
+#endif
+    flatFieldScaleScalar(data, pixelBytes, factors, 0, n);
+}
+
+extern "C"
+{
+epicsExportAddress(int, mpxDecodeStreamBytes);
+}
@@ -0,0 +1,47 @@
+/*
+ * mpxDecode.h
+ *
+ * Pixel conversion kernels for Merlin data frames.
+ *
+ * Merlin sends images bottom row first with big endian pixels. These functions
+ * invert the row order and (optionally) swap each pixel to native byte order
+ * in a single pass. A vectorised implementation is chosen once at startup
+ * by mpxDecodeInit() according to the instruction sets the CPU supports.
+ */
+
+#ifndef MPXDECODE_H_
+#define MPXDECODE_H_
+
+#include <stddef.h>
+
+/** Copies ysize rows of xsize pixels from src to dst in reverse row order.
+ * If swap is set each 16 or 32 bit pixel is converted from big endian.
+ * src and dst may be the same buffer, in which case the conversion is done
+ * in place, otherwise they must not overlap.
+ */
+void mpxInvertRows8(void* dst, const void* src, size_t xsize, size_t ysize);
+void mpxInvertRows16(void* dst, const void* src, size_t xsize, size_t ysize,
+        int swap);
+void mpxInvertRows32(void* dst, const void* src, size_t xsize, size_t ysize,
+        int swap);
+
+/** Multiplies n pixels of pixelBytes (1, 2 or 4) at src by the flat field
+ * factors and writes the results to dst as floats */
+void mpxFlatFieldToFloat(float* dst, const void* src, int pixelBytes,
+        const float* factors, size_t n);
+/** Multiplies n pixels by the flat field factors in place, rounding to the
+ * nearest count and clamping to the range of the pixel type */
+void mpxFlatFieldScale(void* data, int pixelBytes, const float* factors,
+        size_t n);
+
+/** Selects the kernels for this CPU, safe to call more than once */
+void mpxDecodeInit(void);
+/** Name of the selected kernel set e.g. "AVX2" */
+const char* mpxDecodeKernelName(void);
+
+/** Frames of at least this many bytes are written with non-temporal stores
+ * so that converting them does not evict the rest of the cache.
+ * 0 disables non-temporal stores. Settable from iocsh with var. */
+extern int mpxDecodeStreamBytes;
+
+#endif /* MPXDECODE_H_ */
@@ -0,0 +1,429 @@
+/* mpxFrameHeader.cpp
+ *
+ * Decoder for the header of MQ1 data frames, see mpxFrameHeader.h
+ *
+ * The fields are walked with a cursor over the received bytes and converted
+ * in place, nothing is allocated and the buffer is not modified.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsStdio.h>
+
+#include "NDAttribute.h"
+
+#include "mpxFrameHeader.h"
+
+/** a cursor over the comma separated fields of a header */
+typedef struct
+{
+    const char* pos;
+    const char* end;
+} mqCursor;
+
+/** moves the cursor past the next field, returns 0 if there are no more */
+static int nextField(mqCursor* c, const char** field, size_t* len)
+{
+    const char* comma;
+
+    if (c->pos >= c->end)
+        return 0;
+
+    comma = (const char*) memchr(c->pos, ',', c->end - c->pos);
+    if (comma == NULL)
+        comma = c->end;
+
+    *field = c->pos;
+    *len = comma - c->pos;
+    c->pos = comma + 1;
+    return 1;
+}
+
+static int fieldIs(const char* field, size_t len, const char* token)
+{
+    return len == strlen(token) && memcmp(field, token, len) == 0;
+}
+
+static long fieldToLong(const char* field, size_t len, int base)
+{
+    char buff[MQ_FIELD_LEN];
+
+    if (len >= sizeof(buff))
+        len = sizeof(buff) - 1;
+    memcpy(buff, field, len);
+    buff[len] = 0;
+    return strtol(buff, NULL, base);
+}
+
+static double fieldToDouble(const char* field, size_t len)
+{
+    char buff[MQ_FIELD_LEN];
+
+    if (len >= sizeof(buff))
+        len = sizeof(buff) - 1;
+    memcpy(buff, field, len);
+    buff[len] = 0;
+    return strtod(buff, NULL);
+}
+
+static void fieldToString(const char* field, size_t len, char* dst)
+{
+    if (len >= MQ_FIELD_LEN)
+        len = MQ_FIELD_LEN - 1;
+    memcpy(dst, field, len);
+    dst[len] = 0;
+}
+
+int mqHeaderLength(const char* header, size_t len)
+{
+    mqCursor c = { header, header + len };
+    const char* field;
+    size_t flen;
+
+    // MQ1, Frame Number, Data Offset
+    if (!nextField(&c, &field, &flen) || !nextField(&c, &field, &flen)
+            || !nextField(&c, &field, &flen) || c.pos > c.end)
+        return -1;
+
+    return (int) fieldToLong(field, flen, 10);
+}
+
+int mqFrameNumber(const char* header, size_t len)
+{
+    mqCursor c = { header, header + len };
+    const char* field;
+    size_t flen;
+
+    // MQ1, Frame Number
+    if (!nextField(&c, &field, &flen) || !nextField(&c, &field, &flen)
+            || c.pos > c.end)
+        return -1;
+
+    return (int) fieldToLong(field, flen, 10);
+}
+
+int mqDecodeHeader(const char* header, size_t len, MqFrameHeader* pHeader)
+{
+    mqCursor c = { header, header + len };
+    const char* field;
+    size_t flen;
+    int i, chip;
+
+    memset(pHeader, 0, sizeof(MqFrameHeader));
+    pHeader->dacsPresent = 1;
+
+    if (!nextField(&c, &field, &flen))      // MQ1, already identified
+        return -1;
+
+    if (!nextField(&c, &field, &flen))
+        return -1;
+    pHeader->frameNumber = (int) fieldToLong(field, flen, 10);
+
+    if (!nextField(&c, &field, &flen))
+        return -1;
+    pHeader->dataOffset = (int) fieldToLong(field, flen, 10);
+    // the offset changes with the number of chips, the header ends where
+    // the pixel data starts
+    if (pHeader->dataOffset > 0 && (size_t) pHeader->dataOffset < len)
+        c.end = header + pHeader->dataOffset;
+
+    if (!nextField(&c, &field, &flen))
+        return -1;
+    pHeader->chipCount = (int) fieldToLong(field, flen, 10);
+
+    if (!nextField(&c, &field, &flen))
+        return -1;
+    pHeader->xSize = (int) fieldToLong(field, flen, 10);
+
+    if (!nextField(&c, &field, &flen))
+        return -1;
+    pHeader->ySize = (int) fieldToLong(field, flen, 10);
+
+    // pixel depth is a type letter followed by the number of bits e.g. U16
+    if (!nextField(&c, &field, &flen) || flen < 2)
+        return -1;
+    pHeader->pixelFormat = field[0];
+    pHeader->pixelDepth = (int) fieldToLong(field + 1, flen - 1, 10);
+
+    // the rest of the header is decoded as far as it goes
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    fieldToString(field, flen, pHeader->sensorLayout);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    pHeader->chipSelect = (int) fieldToLong(field, flen, 16);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    fieldToString(field, flen, pHeader->timeStamp);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    pHeader->shutterTime = fieldToDouble(field, flen);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    pHeader->counter = (int) fieldToLong(field, flen, 10);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    pHeader->colourMode = (int) fieldToLong(field, flen, 10);
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+    pHeader->gainMode = (int) fieldToLong(field, flen, 10);
+
+    for (i = 0; i < MQ_NUM_THRESHOLDS; i++)
+    {
+        if (!nextField(&c, &field, &flen))
+            return 0;
+        pHeader->threshold[i] = fieldToDouble(field, flen);
+        pHeader->numThresholds++;
+    }
+
+    if (!nextField(&c, &field, &flen))
+        return 0;
+
+    if (fieldIs(field, flen, OPT_START_STRING))
+    {
+        // this section reads the optional extension fields
+        while (nextField(&c, &field, &flen)
+                && !fieldIs(field, flen, OPT_END_STRING))
+        {
+            if (pHeader->numOptFields < MQ_NUM_OPT_FIELDS)
+            {
+                pHeader->optField[pHeader->numOptFields++] =
+                        (int) fieldToLong(field, flen, 10);
+            }
+        }
+        if (pHeader->numOptFields > PROFILE_SELECT_POS)
+            pHeader->profileSelect = pHeader->optField[PROFILE_SELECT_POS];
+        if (pHeader->numOptFields > DACS_PRESENT_POS)
+            pHeader->dacsPresent = pHeader->optField[DACS_PRESENT_POS];
+
+        if (!nextField(&c, &field, &flen))
+            return 0;
+    }
+
+    // this section reads chip dac info blocks for each of the chips on the
+    // device, field already holds the format of the first block
+    for (chip = 0; chip < pHeader->chipCount && chip < MPX_IMG_HDR_MAX_CHIPS
+            && pHeader->dacsPresent; chip++)
+    {
+        if (chip > 0 && !nextField(&c, &field, &flen))
+            return 0;
+        fieldToString(field, flen, pHeader->dacFormat[chip]);
+        pHeader->numDacChips = chip + 1;
+
+        for (i = 0; i < MQ_NUM_THRESHOLDS; i++)
+        {
+            if (!nextField(&c, &field, &flen))
+                return 0;
+            pHeader->thresholdBits[chip][i] =
+                    (epicsUInt16) fieldToLong(field, flen, 10);
+        }
+
+        for (i = 0; i < MQ_NUM_DACS; i++)
+        {
+            if (!nextField(&c, &field, &flen))
+                return 0;
+            pHeader->dac[chip][i] = (epicsInt16) fieldToLong(field, flen, 10);
+        }
+    }
+
+    // RAW frames end with the counter depth the pixels are packed at
+    if (pHeader->pixelFormat == 'R')
+    {
+        while (nextField(&c, &field, &flen))
+        {
+            i = (int) fieldToLong(field, flen, 10);
+            if (i > 0)
+                pHeader->counterDepth = i;
+        }
+    }
+
+    return 0;
+}
+
+int mqHeaderStaticEqual(const MqFrameHeader* a, const MqFrameHeader* b)
+{
+    int chip;
+
+    if (a->chipCount != b->chipCount || a->xSize != b->xSize
+            || a->ySize != b->ySize || a->pixelFormat != b->pixelFormat
+            || a->pixelDepth != b->pixelDepth
+            || a->counterDepth != b->counterDepth
+            || strcmp(a->sensorLayout, b->sensorLayout) != 0
+            || a->chipSelect != b->chipSelect
+            || a->colourMode != b->colourMode || a->gainMode != b->gainMode
+            || a->numThresholds != b->numThresholds
+            || memcmp(a->threshold, b->threshold,
+                    sizeof(a->threshold[0]) * a->numThresholds) != 0
+            || a->numOptFields != b->numOptFields
+            || memcmp(a->optField, b->optField,
+                    sizeof(a->optField[0]) * a->numOptFields) != 0
+            || a->numDacChips != b->numDacChips)
+        return 0;
+
+    for (chip = 0; chip < a->numDacChips; chip++)
+    {
+        if (strcmp(a->dacFormat[chip], b->dacFormat[chip]) != 0
+                || memcmp(a->thresholdBits[chip], b->thresholdBits[chip],
+                        sizeof(a->thresholdBits[chip])) != 0
+                || memcmp(a->dac[chip], b->dac[chip], sizeof(a->dac[chip]))
+                        != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+void mqHeaderAttributes(const MqFrameHeader* pHeader, NDAttributeList* pAttr)
+{
+    mqHeaderFrameAttributes(pHeader, pAttr);
+    mqHeaderStaticAttributes(pHeader, pAttr);
+}
+
+void mqHeaderFrameAttributes(const MqFrameHeader* pHeader,
+        NDAttributeList* pAttr)
+{
+    epicsInt32 iVal;
+    epicsInt8 cVal;
+    double dVal;
+
+    iVal = pHeader->frameNumber;
+    pAttr->add("Frame Number", "", NDAttrInt32, &iVal);
+    // TODO - need to convert time to useful (numeric) format
+    pAttr->add("Time stamp", "", NDAttrInt32, 0);
+    dVal = pHeader->shutterTime;
+    pAttr->add("Shutter Time", "", NDAttrFloat64, &dVal);
+    cVal = (epicsInt8) pHeader->counter;
+    pAttr->add("Counter", "", NDAttrInt8, &cVal);
+}
+
+void mqHeaderStaticAttributes(const MqFrameHeader* pHeader,
+        NDAttributeList* pAttr)
+{
+    char name[30];
+    epicsInt32 iVal;
+    epicsInt8 cVal;
+    epicsInt16 sVal;
+    epicsUInt16 uVal;
+    double dVal;
+    int i, chip;
+
+    cVal = (epicsInt8) pHeader->chipCount;
+    pAttr->add("Chip Count", "", NDAttrInt8, &cVal);
+    iVal = pHeader->xSize;
+    pAttr->add("X Size", "", NDAttrInt32, &iVal);
+    iVal = pHeader->ySize;
+    pAttr->add("Y Size", "", NDAttrInt32, &iVal);
+    iVal = pHeader->pixelDepth;
+    pAttr->add("Pixel Depth", "", NDAttrInt32, &iVal);
+    if (pHeader->pixelFormat == 'R')
+    {
+        iVal = pHeader->counterDepth;
+        pAttr->add("Counter Depth", "", NDAttrInt32, &iVal);
+    }
+    pAttr->add("Sensor Layout", "", NDAttrString,
+            (void*) pHeader->sensorLayout);
+    cVal = (epicsInt8) pHeader->chipSelect;
+    pAttr->add("Chip Select", "", NDAttrInt8, &cVal);
+    cVal = (epicsInt8) pHeader->colourMode;
+    pAttr->add("Colour Mode", "", NDAttrInt8, &cVal);
+    cVal = (epicsInt8) pHeader->gainMode;
+    pAttr->add("Gain Mode", "", NDAttrInt8, &cVal);
+
+    for (i = 0; i < pHeader->numThresholds; i++)
+    {
+        dVal = pHeader->threshold[i];
+        epicsSnprintf(name, sizeof(name), "Threshold %d", i);
+        pAttr->add(name, "", NDAttrFloat64, &dVal);
+    }
+
+    for (i = 0; i < pHeader->numOptFields; i++)
+    {
+        sVal = (epicsInt16) pHeader->optField[i];
+        pAttr->add(optFields[i], "", NDAttrInt16, &sVal);
+    }
+
+    for (chip = 0; chip < pHeader->numDacChips; chip++)
+    {
+        epicsSnprintf(name, sizeof(name), "DAC %d Format", chip);
+        pAttr->add(name, "", NDAttrString, (void*) pHeader->dacFormat[chip]);
+
+        for (i = 0; i < MQ_NUM_THRESHOLDS; i++)
+        {
+            uVal = pHeader->thresholdBits[chip][i];
+            epicsSnprintf(name, sizeof(name), "Chip %d Threshold bits %d",
+                    chip, i);
+            pAttr->add(name, "", NDAttrUInt16, &uVal);
+        }
+
+        for (i = 0; i < MQ_NUM_DACS; i++)
+        {
+            sVal = pHeader->dac[chip][i];
+            epicsSnprintf(name, sizeof(name), "Chip %d %s", chip + 1,
+                    dacInfo[i]);
+            pAttr->add(name, "", NDAttrInt16, &sVal);
+        }
+    }
+}
+
+void mqAcquisitionAttributes(const char* header, size_t len,
+        NDAttributeList* pAttr)
+{
+    const char* line = header;
+    const char* end = header + len;
+    const char* eol;
+    const char* tab;
+    const char* nameEnd;
+    char name[MQ_FIELD_LEN * 2];
+    char value[MPX_MAXLINE];
+    size_t nameLen, valueLen;
+
+    // the header is lines of "Name (hint):<tab>value" between the "HDR,"
+    // and "End" lines, which have no value
+    while (line < end && *line != 0)
+    {
+        eol = (const char*) memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        tab = (const char*) memchr(line, '\t', eol - line);
+        if (tab != NULL)
+        {
+            // drop the trailing colon and any hint in brackets from the name
+            nameEnd = (const char*) memchr(line, '(', tab - line);
+            if (nameEnd == NULL)
+                nameEnd = tab;
+            while (nameEnd > line
+                    && (nameEnd[-1] == ':' || nameEnd[-1] == ' '))
+                nameEnd--;
+
+            nameLen = nameEnd - line;
+            if (nameLen > sizeof(name) - 5)
+                nameLen = sizeof(name) - 5;
+            valueLen = eol - (tab + 1);
+            while (valueLen > 0 && (tab[valueLen] == '\r'
+                    || tab[valueLen] == 0))
+                valueLen--;
+            if (valueLen >= sizeof(value))
+                valueLen = sizeof(value) - 1;
+
+            if (nameLen > 0 && valueLen > 0)
+            {
+                memcpy(name, "HDR ", 4);
+                memcpy(name + 4, line, nameLen);
+                name[nameLen + 4] = 0;
+                memcpy(value, tab + 1, valueLen);
+                value[valueLen] = 0;
+                pAttr->add(name, "", NDAttrString, value);
+            }
+        }
+        line = eol + 1;
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * mpxFrameHeader.h
+ *
+ * Decoder for the header of MQ1 data frames.
+ *
+ * The header is a comma separated list of fixed fields, an optional section
+ * between OPT1 and END1 and then a block of DAC values for each chip. It is
+ * decoded in a single pass into an MqFrameHeader without modifying or
+ * copying the receive buffer. NDAttributes are only made from the decoded
+ * header when an NDArray is passed on to the plugins.
+ */
+
+#ifndef MPXFRAMEHEADER_H_
+#define MPXFRAMEHEADER_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "merlin_low.h"
+
+#define MQ_NUM_THRESHOLDS 8
+#define MQ_NUM_DACS 19
+#define MQ_NUM_OPT_FIELDS 6
+#define MQ_FIELD_LEN 32
+
+/** The decoded header of an MQ1 data frame */
+typedef struct
+{
+    int frameNumber;
+    int dataOffset;         // header length, the pixel data follows
+    int chipCount;
+    int xSize;
+    int ySize;
+    char pixelFormat;       // U for counts, R for raw packed data
+    int pixelDepth;         // bits per pixel, 64 for RAW (R64)
+    int counterDepth;       // bits per counter of a RAW frame, 0 if not sent
+    char sensorLayout[MQ_FIELD_LEN];
+    int chipSelect;
+    char timeStamp[MQ_FIELD_LEN];
+    double shutterTime;
+    int counter;
+    int colourMode;
+    int gainMode;
+    int numThresholds;
+    double threshold[MQ_NUM_THRESHOLDS];
+
+    int numOptFields;       // 0 if there is no OPT1 section
+    int optField[MQ_NUM_OPT_FIELDS];
+    int profileSelect;
+    int dacsPresent;
+
+    int numDacChips;        // number of chips with a DAC block
+    char dacFormat[MPX_IMG_HDR_MAX_CHIPS][MQ_FIELD_LEN];
+    epicsUInt16 thresholdBits[MPX_IMG_HDR_MAX_CHIPS][MQ_NUM_THRESHOLDS];
+    epicsInt16 dac[MPX_IMG_HDR_MAX_CHIPS][MQ_NUM_DACS];
+} MqFrameHeader;
+
+/** Returns the length of an MQ1 frame header, i.e. the offset of the pixel
+ * data from the start of the frame body. Only the first few fields of the
+ * header need to be in the len bytes at header. Returns -1 if the field is
+ * missing. */
+int mqHeaderLength(const char* header, size_t len);
+
+/** Returns the frame number of an MQ1 frame from the first len bytes of its
+ * header, or -1 if the field is missing. */
+int mqFrameNumber(const char* header, size_t len);
+
+/** Decodes the MQ1 header in the first len bytes at header, the header
+ * need not be terminated. Returns 0 on success or -1 if the fixed fields
+ * up to the image dimensions and pixel depth are not all present. */
+int mqDecodeHeader(const char* header, size_t len, MqFrameHeader* pHeader);
+
+class NDAttributeList;
+
+/** Adds an attribute for each field of the decoded header to pAttr */
+void mqHeaderAttributes(const MqFrameHeader* pHeader, NDAttributeList* pAttr);
+/** Adds the attributes that change from frame to frame (frame number,
+ * time stamp, shutter time and counter) */
+void mqHeaderFrameAttributes(const MqFrameHeader* pHeader,
+        NDAttributeList* pAttr);
+/** Adds the attributes that normally stay the same for a whole acquisition */
+void mqHeaderStaticAttributes(const MqFrameHeader* pHeader,
+        NDAttributeList* pAttr);
+/** Returns 1 if the fields behind mqHeaderStaticAttributes are the same */
+int mqHeaderStaticEqual(const MqFrameHeader* a, const MqFrameHeader* b);
+
+/** Adds a string attribute "HDR <name>" for each "name:<tab>value" line of
+ * an acquisition (HDR) header */
+void mqAcquisitionAttributes(const char* header, size_t len,
+        NDAttributeList* pAttr);
+
+#endif /* MPXFRAMEHEADER_H_ */
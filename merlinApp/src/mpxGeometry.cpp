@@ -0,0 +1,251 @@
+/* mpxGeometry.cpp
+ *
+ * Assembly of multi chip images, see mpxGeometry.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+
+#include "mpxGeometry.h"
+
+static void freeAxis(mpxGeometryAxis* axis)
+{
+    free(axis->src0);
+    free(axis->src1);
+    free(axis->weight0);
+    free(axis->weight1);
+    free(axis->runOut);
+    free(axis->runSrc);
+    free(axis->runLen);
+    free(axis->mixed);
+}
+
+/** fills in the table for numChips chips of chipSize pixels. Input pixel i
+ * covers [start[i], start[i] + width[i]) of the output axis, an edge pixel
+ * next to a gap being 1 + gap / 2 pixels wide. Each output pixel takes the
+ * fraction of the counts of each input pixel that it overlaps. */
+static int buildAxis(mpxGeometryAxis* axis, int numChips, int chipSize,
+        int gap)
+{
+    int n = numChips * chipSize;
+    int i, o, local, chip;
+    double* start;
+    double* width;
+    double lo, hi, overlap;
+    int s;
+
+    memset(axis, 0, sizeof(mpxGeometryAxis));
+    axis->inSize = n;
+    axis->outSize = n + gap * (numChips - 1);
+
+    start = (double*) malloc((n + 1) * sizeof(double));
+    width = (double*) malloc(n * sizeof(double));
+    axis->src0 = (int*) malloc(axis->outSize * sizeof(int));
+    axis->src1 = (int*) malloc(axis->outSize * sizeof(int));
+    axis->weight0 = (float*) malloc(axis->outSize * sizeof(float));
+    axis->weight1 = (float*) malloc(axis->outSize * sizeof(float));
+    axis->runOut = (int*) malloc(axis->outSize * sizeof(int));
+    axis->runSrc = (int*) malloc(axis->outSize * sizeof(int));
+    axis->runLen = (int*) malloc(axis->outSize * sizeof(int));
+    axis->mixed = (int*) malloc(axis->outSize * sizeof(int));
+    if (start == NULL || width == NULL || axis->src0 == NULL
+            || axis->src1 == NULL || axis->weight0 == NULL
+            || axis->weight1 == NULL || axis->runOut == NULL
+            || axis->runSrc == NULL || axis->runLen == NULL
+            || axis->mixed == NULL)
+    {
+        free(start);
+        free(width);
+        return -1;
+    }
+
+    start[0] = 0;
+    for (i = 0; i < n; i++)
+    {
+        chip = i / chipSize;
+        local = i % chipSize;
+        width[i] = 1;
+        if (local == 0 && chip > 0)
+            width[i] += gap / 2.0;
+        if (local == chipSize - 1 && chip < numChips - 1)
+            width[i] += gap / 2.0;
+        start[i + 1] = start[i] + width[i];
+    }
+
+    // input pixels are at least one output pixel wide so no output pixel
+    // overlaps more than two of them
+    s = 0;
+    for (o = 0; o < axis->outSize; o++)
+    {
+        while (s < n - 1 && start[s + 1] <= o)
+            s++;
+
+        axis->src0[o] = s;
+        lo = o > start[s] ? o : start[s];
+        hi = o + 1 < start[s + 1] ? o + 1 : start[s + 1];
+        overlap = hi - lo;
+        axis->weight0[o] = (float) (overlap / width[s]);
+
+        axis->src1[o] = s;
+        axis->weight1[o] = 0;
+        if (s < n - 1 && start[s + 1] < o + 1)
+        {
+            axis->src1[o] = s + 1;
+            axis->weight1[o] = (float) ((o + 1 - start[s + 1]) / width[s + 1]);
+        }
+
+        if (axis->weight0[o] == 1 && axis->weight1[o] == 0)
+        {
+            // extend the run if this follows on from the last output pixel
+            if (axis->numRuns > 0
+                    && axis->runOut[axis->numRuns - 1]
+                            + axis->runLen[axis->numRuns - 1] == o
+                    && axis->runSrc[axis->numRuns - 1]
+                            + axis->runLen[axis->numRuns - 1] == s)
+            {
+                axis->runLen[axis->numRuns - 1]++;
+            }
+            else
+            {
+                axis->runOut[axis->numRuns] = o;
+                axis->runSrc[axis->numRuns] = s;
+                axis->runLen[axis->numRuns] = 1;
+                axis->numRuns++;
+            }
+        }
+        else
+        {
+            axis->mixed[axis->numMixed++] = o;
+        }
+    }
+
+    free(start);
+    free(width);
+    return 0;
+}
+
+mpxGeometry* mpxGeometryCreate(int cols, int rows, int chipX, int chipY,
+        int gap)
+{
+    mpxGeometry* geometry;
+
+    geometry = (mpxGeometry*) calloc(1, sizeof(mpxGeometry));
+    if (geometry == NULL)
+        return NULL;
+
+    geometry->cols = cols;
+    geometry->rows = rows;
+    geometry->chipX = chipX;
+    geometry->chipY = chipY;
+    geometry->gap = gap;
+    if (buildAxis(&geometry->x, cols, chipX, gap) != 0
+            || buildAxis(&geometry->y, rows, chipY, gap) != 0)
+    {
+        mpxGeometryFree(geometry);
+        return NULL;
+    }
+    return geometry;
+}
+
+void mpxGeometryFree(mpxGeometry* geometry)
+{
+    if (geometry == NULL)
+        return;
+    freeAxis(&geometry->x);
+    freeAxis(&geometry->y);
+    free(geometry);
+}
+
+template<typename T>
+static inline T toPixel(float value)
+{
+    return (T) (value + 0.5f);
+}
+
+template<>
+inline float toPixel<float>(float value)
+{
+    return value;
+}
+
+/** maps one input row onto an output row */
+template<typename T>
+static void mapRow(const mpxGeometryAxis* x, T* out, const T* in)
+{
+    int i, o;
+
+    for (i = 0; i < x->numRuns; i++)
+    {
+        memcpy(out + x->runOut[i], in + x->runSrc[i],
+                x->runLen[i] * sizeof(T));
+    }
+    for (i = 0; i < x->numMixed; i++)
+    {
+        o = x->mixed[i];
+        out[o] = toPixel<T>(x->weight0[o] * in[x->src0[o]]
+                + x->weight1[o] * in[x->src1[o]]);
+    }
+}
+
+/** maps a row that is shared between two input rows, or a fraction of one */
+template<typename T>
+static void mapRowWeighted(const mpxGeometryAxis* x, T* out, const T* in0,
+        float w0, const T* in1, float w1)
+{
+    int o;
+    float a, b;
+
+    for (o = 0; o < x->outSize; o++)
+    {
+        a = x->weight0[o] * in0[x->src0[o]] + x->weight1[o] * in0[x->src1[o]];
+        b = x->weight0[o] * in1[x->src0[o]] + x->weight1[o] * in1[x->src1[o]];
+        out[o] = toPixel<T>(w0 * a + w1 * b);
+    }
+}
+
+template<typename T>
+static void assemble(const mpxGeometry* g, T* dst, const T* src)
+{
+    const mpxGeometryAxis* y = &g->y;
+    size_t inX = g->x.inSize;
+    size_t outX = g->x.outSize;
+    int o;
+
+    for (o = 0; o < y->outSize; o++)
+    {
+        if (y->weight0[o] == 1 && y->weight1[o] == 0)
+        {
+            mapRow(&g->x, dst + o * outX, src + y->src0[o] * inX);
+        }
+        else
+        {
+            mapRowWeighted(&g->x, dst + o * outX, src + y->src0[o] * inX,
+                    y->weight0[o], src + y->src1[o] * inX, y->weight1[o]);
+        }
+    }
+}
+
+void mpxGeometryApply(const mpxGeometry* geometry, void* dst,
+        const void* src, int pixelBytes, int isFloat)
+{
+    if (isFloat)
+    {
+        assemble(geometry, (float*) dst, (const float*) src);
+        return;
+    }
+
+    switch (pixelBytes)
+    {
+    case 1:
+        assemble(geometry, (epicsUInt8*) dst, (const epicsUInt8*) src);
+        break;
+    case 2:
+        assemble(geometry, (epicsUInt16*) dst, (const epicsUInt16*) src);
+        break;
+    case 4:
+        assemble(geometry, (epicsUInt32*) dst, (const epicsUInt32*) src);
+        break;
+    }
+}
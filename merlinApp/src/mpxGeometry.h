@@ -0,0 +1,68 @@
+/*
+ * mpxGeometry.h
+ *
+ * Assembly of multi chip images into the physical geometry of the sensor.
+ *
+ * The chips of a Merlin sensor are butted with a gap between them which is
+ * bridged by the edge pixels, so the pixels along an inner chip edge are
+ * larger than the others. The detector sends the chips side by side with no
+ * gap. Assembly inserts gap pixels between the chips and spreads the counts
+ * of each large edge pixel evenly over the area it covers, which is its own
+ * pixel and half of the gap next to it. Counts are kept (up to rounding for
+ * integer images).
+ *
+ * The geometry is separable so each axis has a small table giving, for each
+ * output pixel, the (at most two) input pixels that cover it and their
+ * weights. Stretches where output pixels map one to one onto input pixels
+ * are kept as runs that are copied whole, only the pixels around the gaps
+ * are weighted.
+ */
+
+#ifndef MPXGEOMETRY_H_
+#define MPXGEOMETRY_H_
+
+#include <stddef.h>
+
+/** The mapping of one axis of the image */
+typedef struct
+{
+    int inSize;
+    int outSize;
+    int *src0;          // input pixels covering each output pixel
+    int *src1;
+    float *weight0;     // and the share of their counts it gets
+    float *weight1;
+    int numRuns;        // output pixels that are a straight copy
+    int *runOut;
+    int *runSrc;
+    int *runLen;
+    int numMixed;       // output pixels that are weighted
+    int *mixed;
+} mpxGeometryAxis;
+
+/** The mapping of an image of cols x rows chips */
+typedef struct
+{
+    int cols;
+    int rows;
+    int chipX;
+    int chipY;
+    int gap;            // pixels inserted between chips
+    mpxGeometryAxis x;
+    mpxGeometryAxis y;
+} mpxGeometry;
+
+/** Builds the mapping for cols x rows chips of chipX x chipY pixels with gap
+ * pixels between them. Returns NULL if memory runs out. */
+mpxGeometry* mpxGeometryCreate(int cols, int rows, int chipX, int chipY,
+        int gap);
+
+void mpxGeometryFree(mpxGeometry* geometry);
+
+/** Assembles the image at src (geometry->x.inSize x geometry->y.inSize)
+ * into dst (x.outSize x y.outSize). Integer pixels of pixelBytes (1, 2 or
+ * 4) are rounded to the nearest count, isFloat selects float pixels. */
+void mpxGeometryApply(const mpxGeometry* geometry, void* dst,
+        const void* src, int pixelBytes, int isFloat);
+
+#endif /* MPXGEOMETRY_H_ */
@@ -0,0 +1,659 @@
+/* mpxRawDecode.cpp
+ *
+ * Unpacking of Merlin RAW format frames, see mpxRawDecode.h
+ *
+ * Each kernel unpacks a run of pixels from one raw row (one chip's row) into
+ * consecutive pixels of the image. 6 and 12 bit data only needs each 64 bit
+ * word reversing, 1 bit data is expanded with a byte shuffle that copies
+ * each byte to 8 lanes followed by a test of one bit per lane.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mpxRawDecode.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MPX_RAW_X86
+#include <immintrin.h>
+#endif
+
+/** unpacks pixels from the raw row at src into dst, src2 is the second
+ * (least significant) image of a 24 bit frame */
+typedef void (*mpxRawRowFunc)(void* dst, const char* src, const char* src2,
+        size_t pixels);
+
+typedef struct
+{
+    mpxRawRowFunc unpack1;
+    mpxRawRowFunc unpack6;
+    mpxRawRowFunc unpack12;
+    mpxRawRowFunc unpack24;
+    mpxRawRowFunc pack1;        // bytes of 0 or 1 to a bitmap
+    const char* name;
+} mpxRawKernels;
+
+static const mpxRawKernels* kernels = NULL;
+
+// the 8 pixels for each value of a byte of 1 bit data, least significant first
+static unsigned char bitLut[256][8];
+// each byte value with its bits in the opposite order
+static unsigned char bitReverse[256];
+
+static void unpack1Scalar(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    unsigned char* d = (unsigned char*) dst;
+    const unsigned char* s = (const unsigned char*) src;
+    size_t w;
+    int b;
+
+    for (w = 0; w < pixels / 64; w++)
+    {
+        for (b = 0; b < 8; b++)
+        {
+            memcpy(d + w * 64 + b * 8, bitLut[s[w * 8 + 7 - b]], 8);
+        }
+    }
+}
+
+// reverses the bytes of each 64 bit word
+static void swap64Scalar(void* dst, const char* src, size_t bytes)
+{
+    char* d = (char*) dst;
+    size_t w;
+    int b;
+
+    for (w = 0; w + 8 <= bytes; w += 8)
+    {
+        for (b = 0; b < 8; b++)
+        {
+            d[w + b] = src[w + 7 - b];
+        }
+    }
+}
+
+static void unpack6Scalar(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    swap64Scalar(dst, src, pixels);
+}
+
+static void unpack12Scalar(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    uint16_t* d = (uint16_t*) dst;
+    const unsigned char* s = (const unsigned char*) src;
+    size_t w;
+    int k;
+
+    for (w = 0; w < pixels / 4; w++)
+    {
+        for (k = 0; k < 4; k++)
+        {
+            d[w * 4 + k] = (uint16_t) ((s[w * 8 + 6 - 2 * k] << 8)
+                    | s[w * 8 + 7 - 2 * k]);
+        }
+    }
+}
+
+static void unpack24Scalar(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    uint32_t* d = (uint32_t*) dst;
+    const unsigned char* hi = (const unsigned char*) src;
+    const unsigned char* lo = (const unsigned char*) src2;
+    size_t w;
+    int k, i;
+
+    for (w = 0; w < pixels / 4; w++)
+    {
+        for (k = 0; k < 4; k++)
+        {
+            i = (int) w * 8 + 6 - 2 * k;
+            d[w * 4 + k] = (((uint32_t) hi[i] << 8 | hi[i + 1]) << 12)
+                    | ((uint32_t) lo[i] << 8 | lo[i + 1]);
+        }
+    }
+}
+
+static void pack1Scalar(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    unsigned char* d = (unsigned char*) dst;
+    size_t i;
+    int k;
+
+    for (i = 0; i < pixels / 8; i++)
+    {
+        d[i] = 0;
+        for (k = 0; k < 8; k++)
+        {
+            if (src[i * 8 + k])
+                d[i] |= (unsigned char) (1 << k);
+        }
+    }
+}
+
+static const mpxRawKernels scalarKernels =
+{ unpack1Scalar, unpack6Scalar, unpack12Scalar, unpack24Scalar, pack1Scalar,
+        "scalar" };
+
+#ifdef MPX_RAW_X86
+
+// pshufb mask reversing each 64 bit word
+static const unsigned char swap64Mask[16] =
+{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 };
+
+// one bit per byte lane, 8 lanes per source byte
+static const unsigned char bitMask[16] =
+{ 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+// pshufb masks copying the bytes of a big endian word to 8 lanes each, in
+// the order the pixels are stored. SSSE3 uses 4 of 16 lanes, AVX2 2 of 32.
+static const unsigned char bitSelect[4][16] =
+{
+{ 7, 7, 7, 7, 7, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6 },
+{ 5, 5, 5, 5, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4 },
+{ 3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2 },
+{ 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 } };
+
+__attribute__((target("ssse3")))
+static void swap64Ssse3(void* dst, const char* src, size_t bytes)
+{
+    __m128i mask = _mm_loadu_si128((const __m128i*) swap64Mask);
+    char* d = (char*) dst;
+    size_t i;
+
+    for (i = 0; i + 16 <= bytes; i += 16)
+    {
+        _mm_storeu_si128((__m128i*) (d + i),
+                _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + i)),
+                        mask));
+    }
+    swap64Scalar(d + i, src + i, bytes - i);
+}
+
+__attribute__((target("ssse3")))
+static void unpack1Ssse3(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m128i bits = _mm_loadu_si128((const __m128i*) bitMask);
+    __m128i one = _mm_set1_epi8(1);
+    __m128i sel[4];
+    __m128i word, x;
+    unsigned char* d = (unsigned char*) dst;
+    size_t w;
+    int j;
+
+    for (j = 0; j < 4; j++)
+        sel[j] = _mm_loadu_si128((const __m128i*) bitSelect[j]);
+
+    for (w = 0; w < pixels / 64; w++)
+    {
+        word = _mm_loadl_epi64((const __m128i*) (src + w * 8));
+        for (j = 0; j < 4; j++)
+        {
+            x = _mm_and_si128(_mm_shuffle_epi8(word, sel[j]), bits);
+            x = _mm_and_si128(_mm_cmpeq_epi8(x, bits), one);
+            _mm_storeu_si128((__m128i*) (d + w * 64 + j * 16), x);
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void unpack6Ssse3(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    swap64Ssse3(dst, src, pixels);
+}
+
+__attribute__((target("ssse3")))
+static void unpack12Ssse3(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    // a big endian word of 4 big endian pixels reversed is 4 little endian
+    // pixels in the right order
+    swap64Ssse3(dst, src, pixels * 2);
+}
+
+__attribute__((target("ssse3")))
+static void unpack24Ssse3(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m128i mask = _mm_loadu_si128((const __m128i*) swap64Mask);
+    __m128i zero = _mm_setzero_si128();
+    __m128i hi, lo;
+    char* d = (char*) dst;
+    size_t i;
+
+    for (i = 0; i + 8 <= pixels; i += 8)
+    {
+        hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src + i * 2)),
+                mask);
+        lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (src2 + i * 2)),
+                mask);
+        _mm_storeu_si128((__m128i*) (d + i * 4),
+                _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi16(hi, zero), 12),
+                        _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i*) (d + i * 4 + 16),
+                _mm_or_si128(_mm_slli_epi32(_mm_unpackhi_epi16(hi, zero), 12),
+                        _mm_unpackhi_epi16(lo, zero)));
+    }
+    unpack24Scalar(d + i * 4, src + i * 2, src2 + i * 2, pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void pack1Ssse3(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m128i zero = _mm_setzero_si128();
+    unsigned char* d = (unsigned char*) dst;
+    unsigned int bits;
+    size_t i;
+
+    // the sign bit of each byte that is zero, inverted, is the bitmap
+    for (i = 0; i + 16 <= pixels; i += 16)
+    {
+        bits = ~(unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i*) (src + i)), zero));
+        d[i / 8] = (unsigned char) bits;
+        d[i / 8 + 1] = (unsigned char) (bits >> 8);
+    }
+    pack1Scalar(d + i / 8, src + i, NULL, pixels - i);
+}
+
+static const mpxRawKernels ssse3Kernels =
+{ unpack1Ssse3, unpack6Ssse3, unpack12Ssse3, unpack24Ssse3, pack1Ssse3,
+        "SSSE3" };
+
+__attribute__((target("avx2")))
+static void swap64Avx2(void* dst, const char* src, size_t bytes)
+{
+    __m256i mask = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) swap64Mask));
+    char* d = (char*) dst;
+    size_t i;
+
+    for (i = 0; i + 32 <= bytes; i += 32)
+    {
+        _mm256_storeu_si256((__m256i*) (d + i),
+                _mm256_shuffle_epi8(
+                        _mm256_loadu_si256((const __m256i*) (src + i)), mask));
+    }
+    swap64Scalar(d + i, src + i, bytes - i);
+}
+
+__attribute__((target("avx2")))
+static void unpack1Avx2(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m256i bits = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) bitMask));
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i sel0 = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*) bitSelect[0])),
+            _mm_loadu_si128((const __m128i*) bitSelect[1]), 1);
+    __m256i sel1 = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*) bitSelect[2])),
+            _mm_loadu_si128((const __m128i*) bitSelect[3]), 1);
+    __m256i word, x;
+    unsigned char* d = (unsigned char*) dst;
+    uint64_t w64;
+    size_t w;
+
+    for (w = 0; w < pixels / 64; w++)
+    {
+        // the shuffle works within each 128 bit lane so both get the word
+        memcpy(&w64, src + w * 8, 8);
+        word = _mm256_set1_epi64x((long long) w64);
+        x = _mm256_and_si256(_mm256_shuffle_epi8(word, sel0), bits);
+        x = _mm256_and_si256(_mm256_cmpeq_epi8(x, bits), one);
+        _mm256_storeu_si256((__m256i*) (d + w * 64), x);
+        x = _mm256_and_si256(_mm256_shuffle_epi8(word, sel1), bits);
+        x = _mm256_and_si256(_mm256_cmpeq_epi8(x, bits), one);
+        _mm256_storeu_si256((__m256i*) (d + w * 64 + 32), x);
+    }
+}
+
+__attribute__((target("avx2")))
+static void unpack6Avx2(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    swap64Avx2(dst, src, pixels);
+}
+
+__attribute__((target("avx2")))
+static void unpack12Avx2(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    swap64Avx2(dst, src, pixels * 2);
+}
+
+__attribute__((target("avx2")))
+static void unpack24Avx2(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m128i mask = _mm_loadu_si128((const __m128i*) swap64Mask);
+    __m256i hi, lo;
+    char* d = (char*) dst;
+    size_t i;
+
+    for (i = 0; i + 8 <= pixels; i += 8)
+    {
+        hi = _mm256_cvtepu16_epi32(_mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (src + i * 2)), mask));
+        lo = _mm256_cvtepu16_epi32(_mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*) (src2 + i * 2)), mask));
+        _mm256_storeu_si256((__m256i*) (d + i * 4),
+                _mm256_or_si256(_mm256_slli_epi32(hi, 12), lo));
+    }
+    unpack24Scalar(d + i * 4, src + i * 2, src2 + i * 2, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void pack1Avx2(void* dst, const char* src, const char* src2,
+        size_t pixels)
+{
+    __m256i zero = _mm256_setzero_si256();
+    unsigned char* d = (unsigned char*) dst;
+    uint32_t bits;
+    size_t i;
+
+    for (i = 0; i + 32 <= pixels; i += 32)
+    {
+        bits = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i*) (src + i)), zero));
+        memcpy(d + i / 8, &bits, 4);
+    }
+    pack1Scalar(d + i / 8, src + i, NULL, pixels - i);
+}
+
+static const mpxRawKernels avx2Kernels =
+{ unpack1Avx2, unpack6Avx2, unpack12Avx2, unpack24Avx2, pack1Avx2, "AVX2" };
+
+#endif /* MPX_RAW_X86 */
+
+void mpxRawDecodeInit(void)
+{
+    int value, bit;
+
+    if (kernels != NULL)
+        return;
+
+    for (value = 0; value < 256; value++)
+    {
+        for (bit = 0; bit < 8; bit++)
+        {
+            bitLut[value][bit] = (unsigned char) ((value >> bit) & 1);
+            if (value & (1 << bit))
+                bitReverse[value] |= (unsigned char) (0x80 >> bit);
+        }
+    }
+
+    kernels = &scalarKernels;
+
+#ifdef MPX_RAW_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels = &avx2Kernels;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        kernels = &ssse3Kernels;
+    }
+#endif
+}
+
+const char* mpxRawKernelName(void)
+{
+    return kernels == NULL ? "none" : kernels->name;
+}
+
+/** bits each pixel takes up in the raw data, 24 bit frames are two images
+ * of 16 bit pixels */
+static int rawBits(int counterDepth)
+{
+    switch (counterDepth)
+    {
+    case 1:
+        return 1;
+    case 6:
+        return 8;
+    case 12:
+    case 24:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+int mpxRawPixelBytes(int counterDepth)
+{
+    switch (counterDepth)
+    {
+    case 1:
+    case 6:
+        return 1;
+    case 12:
+        return 2;
+    case 24:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+size_t mpxRawDataBytes(int xSize, int ySize, int counterDepth)
+{
+    size_t bytes = (size_t) xSize * ySize * rawBits(counterDepth) / 8;
+
+    return counterDepth == 24 ? bytes * 2 : bytes;
+}
+
+int mpxRawCounterDepth(size_t dataBytes, int xSize, int ySize)
+{
+    static const int depths[] = { 1, 6, 12, 24 };
+    size_t i;
+
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+    {
+        if (mpxRawDataBytes(xSize, ySize, depths[i]) == dataBytes)
+            return depths[i];
+    }
+    return 0;
+}
+
+int mpxRawLayoutInit(mpxRawLayout* layout, const char* sensorLayout,
+        int chipCount, int xSize, int ySize)
+{
+    int cols = 0, rows = 0;
+    int chip;
+
+    memset(layout, 0, sizeof(mpxRawLayout));
+
+    while (*sensorLayout == ' ')
+        sensorLayout++;
+
+    // e.g. 1x1, 2x2 or 2x2G, Nx1 is a row of chipCount chips
+    if (sensorLayout[0] == 'N'
+            || sscanf(sensorLayout, "%dx%d", &cols, &rows) != 2)
+    {
+        cols = chipCount;
+        rows = 1;
+    }
+
+    if (cols <= 0 || rows <= 0 || rows > 2 || cols * rows != chipCount
+            || chipCount > MPX_IMG_HDR_MAX_CHIPS || xSize % cols != 0
+            || ySize % rows != 0)
+    {
+        return -1;
+    }
+
+    layout->numChips = chipCount;
+    layout->chipX = xSize / cols;
+    layout->chipY = ySize / rows;
+    layout->xSize = xSize;
+    layout->ySize = ySize;
+
+    // a whole number of 64 bit words per chip row at every depth
+    if (layout->chipX % 64 != 0 || layout->chipX > MPX_RAW_MAX_CHIP_X)
+        return -1;
+
+    // the first row of chips is upright in chip order, the chips of a
+    // second row face the other way so are turned and run right to left
+    for (chip = 0; chip < chipCount; chip++)
+    {
+        if (chip < cols)
+        {
+            layout->xOffset[chip] = chip * layout->chipX;
+            layout->yOffset[chip] = 0;
+            layout->rotate[chip] = 0;
+        }
+        else
+        {
+            layout->xOffset[chip] = (2 * cols - 1 - chip) * layout->chipX;
+            layout->yOffset[chip] = layout->chipY;
+            layout->rotate[chip] = 1;
+        }
+    }
+
+    return 0;
+}
+
+static void reverseCopy(void* dst, const void* src, size_t pixels,
+        int pixelBytes)
+{
+    size_t i;
+
+    switch (pixelBytes)
+    {
+    case 1:
+        for (i = 0; i < pixels; i++)
+            ((uint8_t*) dst)[i] = ((const uint8_t*) src)[pixels - 1 - i];
+        break;
+    case 2:
+        for (i = 0; i < pixels; i++)
+            ((uint16_t*) dst)[i] = ((const uint16_t*) src)[pixels - 1 - i];
+        break;
+    default:
+        for (i = 0; i < pixels; i++)
+            ((uint32_t*) dst)[i] = ((const uint32_t*) src)[pixels - 1 - i];
+        break;
+    }
+}
+
+/** unpacks into pixels of pixelBytes, or for packed 1 bit data copies the
+ * bits into a bitmap (pixelBytes 0) */
+static void unpackRaw(void* dst, const void* src, const mpxRawLayout* layout,
+        int counterDepth, int packed)
+{
+    uint32_t rowBuffer[MPX_RAW_MAX_CHIP_X];
+    const char* pSrc = (const char*) src;
+    char* pDst = (char*) dst;
+    mpxRawRowFunc unpack;
+    size_t chipRowBytes = (size_t) layout->chipX * rawBits(counterDepth) / 8;
+    size_t rawRowBytes = chipRowBytes * layout->numChips;
+    size_t imageBytes = rawRowBytes * layout->chipY;
+    size_t rowPixels = layout->chipX;
+    size_t i;
+    int pixelBytes = mpxRawPixelBytes(counterDepth);
+    const char *s, *s2;
+    unsigned char* r;
+    char* d;
+    int row, chip, y;
+
+    if (kernels == NULL)
+        mpxRawDecodeInit();
+
+    switch (counterDepth)
+    {
+    case 1:
+        unpack = kernels->unpack1;
+        break;
+    case 6:
+        unpack = kernels->unpack6;
+        break;
+    case 12:
+        unpack = kernels->unpack12;
+        break;
+    case 24:
+        unpack = kernels->unpack24;
+        break;
+    default:
+        return;
+    }
+
+    if (packed)
+    {
+        // the words reversed are the bitmap, least significant bit first
+        unpack = kernels->unpack6;
+        rowPixels = chipRowBytes;
+        pixelBytes = 1;
+    }
+
+    for (row = 0; row < layout->chipY; row++)
+    {
+        for (chip = 0; chip < layout->numChips; chip++)
+        {
+            s = pSrc + row * rawRowBytes + chip * chipRowBytes;
+            s2 = s + imageBytes;
+
+            // y is the row as received, the image is written top row first
+            y = layout->yOffset[chip]
+                    + (layout->rotate[chip] ? layout->chipY - 1 - row : row);
+            d = pDst + ((size_t) (layout->ySize - 1 - y) * layout->xSize
+                    + layout->xOffset[chip]) / (packed ? 8 : 1) * pixelBytes;
+
+            if (layout->rotate[chip])
+            {
+                unpack(rowBuffer, s, s2, rowPixels);
+                if (packed)
+                {
+                    r = (unsigned char*) rowBuffer;
+                    for (i = 0; i < rowPixels; i++)
+                        d[i] = (char) bitReverse[r[rowPixels - 1 - i]];
+                }
+                else
+                {
+                    reverseCopy(d, rowBuffer, rowPixels, pixelBytes);
+                }
+            }
+            else
+            {
+                unpack(d, s, s2, rowPixels);
+            }
+        }
+    }
+}
+
+void mpxUnpackRaw(void* dst, const void* src, const mpxRawLayout* layout,
+        int counterDepth)
+{
+    unpackRaw(dst, src, layout, counterDepth, 0);
+}
+
+void mpxUnpackRawPacked(void* dst, const void* src,
+        const mpxRawLayout* layout)
+{
+    unpackRaw(dst, src, layout, 1, 1);
+}
+
+void mpxPackRows1(void* dst, const void* src, size_t xsize, size_t ysize)
+{
+    const char* pSrc = (const char*) src;
+    char* pDst = (char*) dst;
+    size_t y;
+
+    if (kernels == NULL)
+        mpxRawDecodeInit();
+
+    for (y = 0; y < ysize; y++)
+    {
+        kernels->pack1(pDst + (ysize - 1 - y) * (xsize / 8),
+                pSrc + y * xsize, NULL, xsize);
+    }
+}
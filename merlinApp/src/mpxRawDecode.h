@@ -0,0 +1,83 @@
+/*
+ * mpxRawDecode.h
+ *
+ * Unpacking of Merlin RAW format frames (pixel depth token R64).
+ *
+ * In RAW mode the detector sends the counters as read from the chips. The
+ * pixel data is a sequence of big endian 64 bit words, each holding 64
+ * pixels at 1 bit, 8 pixels at 6 bit (one byte each) or 4 pixels at 12 bit
+ * (two bytes each). A 24 bit frame is two 12 bit images, the first holding
+ * the most significant 12 bits of each pixel.
+ *
+ * Each raw row holds the same row of every chip, one chip after another, so
+ * the rows of a multi chip detector have to be de-interleaved into the image
+ * according to the sensor layout. mpxRawLayout is the table that does this.
+ * As for the other formats the rows arrive bottom row first, the unpacked
+ * image is written top row first.
+ *
+ * 1 bit images can also be output as a bitmap, 8 pixels to a byte with the
+ * leftmost pixel in the least significant bit.
+ */
+
+#ifndef MPXRAWDECODE_H_
+#define MPXRAWDECODE_H_
+
+#include <stddef.h>
+
+#include "merlin_low.h"
+
+/** Largest chip width handled, Medipix3 chips are 256 x 256 */
+#define MPX_RAW_MAX_CHIP_X 1024
+
+/** Position of each chip of a raw frame in the unpacked image */
+typedef struct
+{
+    int numChips;       // chips in each raw row
+    int chipX;          // size of a chip in pixels
+    int chipY;
+    int xSize;          // size of the unpacked image
+    int ySize;
+    int xOffset[MPX_IMG_HDR_MAX_CHIPS];     // top left of the chip as received
+    int yOffset[MPX_IMG_HDR_MAX_CHIPS];
+    int rotate[MPX_IMG_HDR_MAX_CHIPS];      // chip is turned by 180 degrees
+} mpxRawLayout;
+
+/** Fills in layout for the sensorLayout string of an MQ1 header (e.g. "2x2",
+ * "Nx1") and the image size. Returns 0 on success or -1 if the chips do not
+ * fit the image. */
+int mpxRawLayoutInit(mpxRawLayout* layout, const char* sensorLayout,
+        int chipCount, int xSize, int ySize);
+
+/** Number of bytes of raw data in a frame of xSize x ySize pixels at the
+ * given counter depth (1, 6, 12 or 24), 0 for any other depth */
+size_t mpxRawDataBytes(int xSize, int ySize, int counterDepth);
+
+/** Works out the counter depth from the amount of raw pixel data,
+ * returns 0 if dataBytes does not match any depth */
+int mpxRawCounterDepth(size_t dataBytes, int xSize, int ySize);
+
+/** Bytes per pixel of the unpacked image: 1 for 1 and 6 bit counters,
+ * 2 for 12 bit and 4 for 24 bit */
+int mpxRawPixelBytes(int counterDepth);
+
+/** Unpacks mpxRawDataBytes() bytes of raw data at src into the image at dst,
+ * which has layout->xSize x layout->ySize pixels of mpxRawPixelBytes() */
+void mpxUnpackRaw(void* dst, const void* src, const mpxRawLayout* layout,
+        int counterDepth);
+
+/** Unpacks 1 bit raw data into a bitmap of layout->xSize / 8 bytes by
+ * layout->ySize rows */
+void mpxUnpackRawPacked(void* dst, const void* src,
+        const mpxRawLayout* layout);
+
+/** Packs ysize rows of xsize bytes (each 0 or 1) into a bitmap of xsize / 8
+ * bytes per row, inverting the row order like mpxInvertRows8. xsize must be
+ * a multiple of 8 */
+void mpxPackRows1(void* dst, const void* src, size_t xsize, size_t ysize);
+
+/** Selects the unpack kernels for this CPU, safe to call more than once */
+void mpxRawDecodeInit(void);
+/** Name of the selected kernel set e.g. "AVX2" */
+const char* mpxRawKernelName(void);
+
+#endif /* MPXRAWDECODE_H_ */
@@ -0,0 +1,318 @@
+/* mpxRecorder.cpp
+ *
+ * Records the frames of the data channel to a MIB file, see mpxRecorder.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define RECORD_OPEN_FLAGS (O_WRONLY | O_CREAT | O_TRUNC | O_BINARY)
+#define ftruncate _chsize_s
+#else
+#include <unistd.h>
+#define RECORD_OPEN_FLAGS (O_WRONLY | O_CREAT | O_TRUNC)
+#endif
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include "mpxRecorder.h"
+
+static const char *recorderName = "mpxRecorder";
+
+/** O_DIRECT writes must be a multiple of this and start at this alignment */
+#define RECORD_BLOCK 4096
+
+static void mpxRecorderTaskC(void *drvPvt)
+{
+    mpxRecorder *pRecorder = (mpxRecorder *) drvPvt;
+
+    pRecorder->writerTask();
+}
+
+static char* allocBuffer(size_t size)
+{
+#ifdef _WIN32
+    return (char*) _aligned_malloc(size, RECORD_BLOCK);
+#else
+    void* p = NULL;
+
+    if (posix_memalign(&p, RECORD_BLOCK, size) != 0)
+        return NULL;
+    return (char*) p;
+#endif
+}
+
+mpxRecorder::mpxRecorder(size_t bufferSize)
+{
+    // whole blocks so that every full buffer can be written with O_DIRECT
+    this->bufferSize = (bufferSize + RECORD_BLOCK - 1)
+            & ~(size_t) (RECORD_BLOCK - 1);
+    buffers[0] = allocBuffer(this->bufferSize);
+    buffers[1] = allocBuffer(this->bufferSize);
+    active = 0;
+    fill = 0;
+    pending = -1;
+    pendingLen = 0;
+    fd = -1;
+    direct = 0;
+    path[0] = 0;
+    bytesQueued = 0;
+    bytesWritten = 0;
+    error = NULL;
+
+    mutex = epicsMutexMustCreate();
+    statusMutex = epicsMutexMustCreate();
+    writeEvent = epicsEventMustCreate(epicsEventEmpty);
+    doneEvent = epicsEventMustCreate(epicsEventEmpty);
+
+    epicsThreadCreate("merlinRecord", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC) mpxRecorderTaskC, this);
+}
+
+/** Writes each buffer handed over by queueBuffer */
+void mpxRecorder::writerTask()
+{
+    const char *functionName = "writerTask";
+    const char* p;
+    size_t left;
+    long n;
+
+    while (1)
+    {
+        epicsEventWait(writeEvent);
+        if (pending < 0)
+            continue;
+
+        p = buffers[pending];
+        left = pendingLen;
+        while (left > 0)
+        {
+            n = (long) ::write(fd, p, (unsigned int) left);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                printf("%s:%s: error writing %s: %s\n", recorderName,
+                        functionName, path, strerror(errno));
+                epicsMutexLock(statusMutex);
+                error = "Error: writing record file failed";
+                epicsMutexUnlock(statusMutex);
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+
+        epicsMutexLock(statusMutex);
+        bytesWritten += pendingLen - left;
+        epicsMutexUnlock(statusMutex);
+
+        pending = -1;
+        epicsEventSignal(doneEvent);
+    }
+}
+
+/** waits for the writer to finish the buffer it has, call with mutex */
+void mpxRecorder::waitWriter()
+{
+    while (pending >= 0)
+    {
+        epicsEventWait(doneEvent);
+    }
+}
+
+/** hands the active buffer to the writer and starts filling the other,
+ * call with mutex */
+asynStatus mpxRecorder::queueBuffer()
+{
+    waitWriter();
+    pending = active;
+    pendingLen = fill;
+    active = 1 - active;
+    fill = 0;
+    epicsEventSignal(writeEvent);
+    return asynSuccess;
+}
+
+asynStatus mpxRecorder::open(const char* path, double preallocate)
+{
+    const char *functionName = "open";
+    int flags = RECORD_OPEN_FLAGS;
+
+    if (buffers[0] == NULL || buffers[1] == NULL)
+        return asynError;
+
+    close();
+
+    epicsMutexLock(mutex);
+    strncpy(this->path, path, sizeof(this->path) - 1);
+    this->path[sizeof(this->path) - 1] = 0;
+
+#ifdef O_DIRECT
+    // not every filesystem takes O_DIRECT, fall back to buffered writes
+    direct = 1;
+    fd = ::open(this->path, flags | O_DIRECT, 0644);
+    if (fd < 0)
+#endif
+    {
+        direct = 0;
+        fd = ::open(this->path, flags, 0644);
+    }
+    if (fd < 0)
+    {
+        printf("%s:%s: cannot create %s: %s\n", recorderName, functionName,
+                this->path, strerror(errno));
+        epicsMutexUnlock(mutex);
+        return asynError;
+    }
+
+#ifdef __linux__
+    if (preallocate > 0 && posix_fallocate(fd, 0, (off_t) preallocate) != 0)
+    {
+        printf("%s:%s: cannot pre-allocate %.0f bytes for %s\n", recorderName,
+                functionName, preallocate, this->path);
+    }
+#endif
+
+    active = 0;
+    fill = 0;
+    bytesQueued = 0;
+    epicsMutexLock(statusMutex);
+    bytesWritten = 0;
+    error = NULL;
+    epicsMutexUnlock(statusMutex);
+    epicsMutexUnlock(mutex);
+    return asynSuccess;
+}
+
+asynStatus mpxRecorder::close()
+{
+    const char *functionName = "close";
+    size_t padded;
+
+    epicsMutexLock(mutex);
+    if (fd < 0)
+    {
+        epicsMutexUnlock(mutex);
+        return asynSuccess;
+    }
+
+    // the last buffer is padded to a whole block for O_DIRECT, the file is
+    // then cut back to the recorded length (also removing any pre-allocation)
+    if (fill > 0)
+    {
+        padded = fill;
+        if (direct)
+            padded = (fill + RECORD_BLOCK - 1) & ~(size_t) (RECORD_BLOCK - 1);
+        memset(buffers[active] + fill, 0, padded - fill);
+        fill = padded;
+        queueBuffer();
+    }
+    waitWriter();
+
+    if (ftruncate(fd, (off_t) bytesQueued) != 0)
+    {
+        printf("%s:%s: cannot set length of %s\n", recorderName, functionName,
+                path);
+    }
+    epicsMutexLock(statusMutex);
+    bytesWritten = bytesQueued;
+    epicsMutexUnlock(statusMutex);
+
+    ::close(fd);
+    fd = -1;
+    epicsMutexUnlock(mutex);
+    return asynSuccess;
+}
+
+asynStatus mpxRecorder::append(const char* data, size_t len)
+{
+    size_t chunk;
+
+    epicsMutexLock(mutex);
+    if (fd < 0)
+    {
+        epicsMutexUnlock(mutex);
+        return asynError;
+    }
+
+    bytesQueued += len;
+    while (len > 0)
+    {
+        chunk = bufferSize - fill < len ? bufferSize - fill : len;
+        memcpy(buffers[active] + fill, data, chunk);
+        fill += chunk;
+        data += chunk;
+        len -= chunk;
+        if (fill == bufferSize)
+        {
+            // waits here if the disk is not keeping up, nothing is dropped
+            queueBuffer();
+        }
+    }
+
+    epicsMutexUnlock(mutex);
+    return asynSuccess;
+}
+
+asynStatus mpxRecorder::writeHeader(const char* data, size_t len)
+{
+    const char *functionName = "writeHeader";
+    char hdrPath[sizeof(path) + 8];
+    char* dot;
+    FILE* fp;
+
+    epicsMutexLock(mutex);
+    if (fd < 0)
+    {
+        epicsMutexUnlock(mutex);
+        return asynError;
+    }
+
+    // name.mib -> name.hdr
+    strcpy(hdrPath, path);
+    dot = strrchr(hdrPath, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL)
+        dot = hdrPath + strlen(hdrPath);
+    strcpy(dot, ".hdr");
+    epicsMutexUnlock(mutex);
+
+    fp = fopen(hdrPath, "wb");
+    if (fp == NULL || fwrite(data, 1, len, fp) != len)
+    {
+        printf("%s:%s: cannot write %s\n", recorderName, functionName,
+                hdrPath);
+        if (fp != NULL)
+            fclose(fp);
+        return asynError;
+    }
+    fclose(fp);
+    return asynSuccess;
+}
+
+double mpxRecorder::getBytesWritten()
+{
+    double bytes;
+
+    epicsMutexLock(statusMutex);
+    bytes = bytesWritten;
+    epicsMutexUnlock(statusMutex);
+    return bytes;
+}
+
+const char* mpxRecorder::getError()
+{
+    const char* err;
+
+    epicsMutexLock(statusMutex);
+    err = error;
+    epicsMutexUnlock(statusMutex);
+    return err;
+}
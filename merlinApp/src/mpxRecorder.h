@@ -0,0 +1,73 @@
+/*
+ * mpxRecorder.h
+ *
+ * Records the frames of the data channel to a MIB file as they arrive.
+ *
+ * The MQ1 frames (header and pixel data exactly as sent by the detector)
+ * are appended to the MIB file and the acquisition header is written to a
+ * .hdr file alongside it, which is the layout Merlin itself uses and that
+ * MIB readers expect. Frames are copied into one of two large aligned
+ * buffers, a writer thread writes each full buffer while the other fills.
+ * On Linux the file is opened with O_DIRECT (when the filesystem supports
+ * it) and can be pre-allocated so that writing does not go through the page
+ * cache or extend the file on each write.
+ */
+
+#ifndef MPXRECORDER_H_
+#define MPXRECORDER_H_
+
+#include <stddef.h>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <asynDriver.h>
+
+/** Size of each of the two record buffers */
+#define MPX_RECORD_BUFFER_LEN (16 * 1024 * 1024)
+
+class mpxRecorder
+{
+public:
+    mpxRecorder(size_t bufferSize);
+
+    /** Creates the file at path, pre-allocating preallocate bytes */
+    asynStatus open(const char* path, double preallocate);
+    /** Writes out what is buffered and closes the file */
+    asynStatus close();
+    /** Copies len bytes to the end of the file */
+    asynStatus append(const char* data, size_t len);
+    /** Writes the acquisition header to the .hdr file next to the MIB file */
+    asynStatus writeHeader(const char* data, size_t len);
+
+    bool isOpen() const { return fd >= 0; }
+    double getBytesWritten();
+    /** The reason the last write failed, or NULL */
+    const char* getError();
+
+    void writerTask();
+
+private:
+    asynStatus queueBuffer();
+    void waitWriter();
+
+    char* buffers[2];
+    size_t bufferSize;
+    int active;             // the buffer being filled
+    size_t fill;            // bytes in the active buffer
+    int pending;            // index of the buffer being written, or -1
+    size_t pendingLen;
+
+    int fd;
+    int direct;             // the file was opened with O_DIRECT
+    char path[256];
+    double bytesQueued;     // bytes given to append since open
+    double bytesWritten;    // bytes on disk
+    const char* error;
+
+    epicsMutexId mutex;         // serialises the callers
+    epicsMutexId statusMutex;   // bytesWritten and error
+    epicsEventId writeEvent;    // a buffer is waiting to be written
+    epicsEventId doneEvent;     // the writer has finished a buffer
+};
+
+#endif /* MPXRECORDER_H_ */
@@ -0,0 +1,106 @@
+/* mpxShadow.cpp
+ *
+ * Shadow copy of the server variables, see mpxShadow.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpxShadow.h"
+
+/** a variable and the variables the server may change when it is SET */
+typedef struct
+{
+    const char *name;
+    const char *depends[MPX_SHADOW_MAX_DEPS];
+} mpxDependency;
+
+/** Variables not listed here are not read back. The thresholds and the
+ * threshold scan limits are clamped to the range of the detector, the
+ * energy sets the range of the thresholds, only one of the counter 1 and
+ * continuous read/write modes can be on, and the period is lengthened to
+ * fit the exposure and the readout of the counters. */
+static const mpxDependency dependencies[] =
+{
+    { MPXVAR_THRESHOLD0, { MPXVAR_THRESHOLD0 } },
+    { MPXVAR_THRESHOLD1, { MPXVAR_THRESHOLD1 } },
+    { MPXVAR_THRESHOLD2, { MPXVAR_THRESHOLD2 } },
+    { MPXVAR_THRESHOLD3, { MPXVAR_THRESHOLD3 } },
+    { MPXVAR_THRESHOLD4, { MPXVAR_THRESHOLD4 } },
+    { MPXVAR_THRESHOLD5, { MPXVAR_THRESHOLD5 } },
+    { MPXVAR_THRESHOLD6, { MPXVAR_THRESHOLD6 } },
+    { MPXVAR_THRESHOLD7, { MPXVAR_THRESHOLD7 } },
+    { MPXVAR_OPERATINGENERGY, { MPXVAR_OPERATINGENERGY, MPXVAR_THRESHOLD0,
+            MPXVAR_THRESHOLD1, MPXVAR_THRESHOLD2, MPXVAR_THRESHOLD3,
+            MPXVAR_THRESHOLD4, MPXVAR_THRESHOLD5, MPXVAR_THRESHOLD6,
+            MPXVAR_THRESHOLD7 } },
+    { MPXVAR_ENABLECOUNTER1, { MPXVAR_ENABLECOUNTER1, MPXVAR_CONTINUOUSRW } },
+    { MPXVAR_CONTINUOUSRW, { MPXVAR_CONTINUOUSRW, MPXVAR_ENABLECOUNTER1 } },
+    { MPXVAR_ACQUISITIONTIME, { MPXVAR_ACQUISITIONPERIOD } },
+    { MPXVAR_ACQUISITIONPERIOD, { MPXVAR_ACQUISITIONPERIOD } },
+    { MPXVAR_COUNTERDEPTH, { MPXVAR_ACQUISITIONPERIOD } },
+    { MPXVAR_THSTART, { MPXVAR_THSTART } },
+    { MPXVAR_THSTOP, { MPXVAR_THSTOP } },
+    { MPXVAR_THSTEP, { MPXVAR_THSTEP } },
+    { MPXVAR_THSSCAN, { MPXVAR_THSSCAN } }
+};
+
+static const char *const noDependencies[] = { NULL };
+
+mpxShadowVar* mpxShadowAdd(mpxShadow *shadow, const char *name, int param,
+        int isInteger, double scale)
+{
+    mpxShadowVar *var;
+    size_t i;
+
+    if (shadow->count == MPX_SHADOW_MAX)
+        return NULL;
+
+    var = &shadow->var[shadow->count++];
+    memset(var, 0, sizeof(mpxShadowVar));
+    var->name = name;
+    var->param = param;
+    var->isInteger = isInteger;
+    var->scale = scale;
+    var->depends = noDependencies;
+    var->setIndex = -1;
+    var->getIndex = -1;
+
+    for (i = 0; i < sizeof(dependencies) / sizeof(dependencies[0]); i++)
+    {
+        if (!strcmp(dependencies[i].name, name))
+        {
+            var->depends = dependencies[i].depends;
+            break;
+        }
+    }
+    return var;
+}
+
+mpxShadowVar* mpxShadowFind(mpxShadow *shadow, const char *name)
+{
+    int i;
+
+    for (i = 0; i < shadow->count; i++)
+    {
+        if (!strcmp(shadow->var[i].name, name))
+            return &shadow->var[i];
+    }
+    return NULL;
+}
+
+int mpxShadowSame(const mpxShadowVar *var, const char *value)
+{
+    double held, wanted;
+    char *end1, *end2;
+
+    if (!var->valid)
+        return 0;
+
+    held = strtod(var->value, &end1);
+    wanted = strtod(value, &end2);
+    if (end1 != var->value && *end1 == 0 && end2 != value && *end2 == 0)
+        return held == wanted;
+
+    return !strcmp(var->value, value);
+}
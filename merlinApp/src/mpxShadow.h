@@ -0,0 +1,57 @@
+/*
+ * mpxShadow.h
+ *
+ * Shadow copy of the MPX variables on the Labview server.
+ *
+ * Each variable remembers the value last written to or read from the
+ * server. A SET of the value the server already holds is not sent, and
+ * after a SET only the variables that the server may have changed as a
+ * result are read back, as given by a fixed dependency table (e.g. setting
+ * the operating energy can move the thresholds, setting the acquisition
+ * time can move the period). A variable is only trusted once a SET or GET
+ * of it has succeeded, and is forgotten again if one fails.
+ */
+
+#ifndef MPXSHADOW_H_
+#define MPXSHADOW_H_
+
+#include "merlin_low.h"
+
+#define MPX_SHADOW_MAX 32
+/** most variables read back after a SET, including the terminating NULL */
+#define MPX_SHADOW_MAX_DEPS 10
+
+/** A variable on the server */
+typedef struct
+{
+    const char *name;
+    int param;              // asyn parameter showing the value, -1 for none
+    int isInteger;          // the parameter is an Int32, otherwise Float64
+    double scale;           // parameter = server value * scale
+    const char *const *depends; // variables to read back after a SET
+    char value[MPX_MAXLINE];
+    int valid;              // value is what the server holds
+    int setIndex;           // batch index of a SET in the current batch
+    int getIndex;           // and of a GET, -1 for none
+    int readback;           // a SET in this batch may have changed it
+    int written;            // the parameter was written and not yet sent
+} mpxShadowVar;
+
+typedef struct
+{
+    int count;
+    mpxShadowVar var[MPX_SHADOW_MAX];
+} mpxShadow;
+
+/** Adds a variable and picks up its dependencies, returns NULL if the table
+ * is full */
+mpxShadowVar* mpxShadowAdd(mpxShadow *shadow, const char *name, int param,
+        int isInteger, double scale);
+
+mpxShadowVar* mpxShadowFind(mpxShadow *shadow, const char *name);
+
+/** Returns non zero if value is the value held for the variable, numbers
+ * are compared by value so that e.g. 10 matches 10.000000 */
+int mpxShadowSame(const mpxShadowVar *var, const char *value);
+
+#endif /* MPXSHADOW_H_ */
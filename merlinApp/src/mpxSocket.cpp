@@ -0,0 +1,253 @@
+/* mpxSocket.cpp
+ *
+ * Direct TCP socket for the data channel, see mpxSocket.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsString.h>
+
+#include "mpxSocket.h"
+
+static const char *socketName = "mpxSocket";
+
+mpxSocket* mpxSocketCreate(const char *options)
+{
+    const char *functionName = "mpxSocketCreate";
+    mpxSocket *sock;
+    char buff[256];
+    char *tok;
+    char *save_ptr = NULL;
+
+    if (!osiSockAttach())
+        return NULL;
+
+    sock = (mpxSocket*) calloc(1, sizeof(mpxSocket));
+    if (sock == NULL)
+        return NULL;
+    sock->fd = INVALID_SOCKET;
+    sock->timeout = -1;
+    sock->lock = epicsMutexMustCreate();
+
+    strncpy(buff, options, sizeof(buff) - 1);
+    buff[sizeof(buff) - 1] = 0;
+
+    tok = epicsStrtok_r(buff, ",", &save_ptr);
+    if (tok == NULL || aToIPAddr(tok, 0, &sock->peer) != 0)
+    {
+        printf("%s:%s: cannot find host:port in '%s'\n", socketName,
+                functionName, options);
+        epicsMutexDestroy(sock->lock);
+        free(sock);
+        return NULL;
+    }
+    strncpy(sock->address, tok, sizeof(sock->address) - 1);
+
+    while ((tok = epicsStrtok_r(NULL, ",", &save_ptr)) != NULL)
+    {
+        if (sscanf(tok, "rcvbuf=%d", &sock->receiveBuffer) == 1)
+            continue;
+        if (sscanf(tok, "busypoll=%d", &sock->busyPoll) == 1)
+            continue;
+        printf("%s:%s: unknown option '%s'\n", socketName, functionName,
+                tok);
+        epicsMutexDestroy(sock->lock);
+        free(sock);
+        return NULL;
+    }
+    return sock;
+}
+
+/** sets the options that have to be set before connecting, so that the
+ * TCP window is scaled for the receive buffer */
+static void setOptions(mpxSocket *sock)
+{
+    const char *functionName = "setOptions";
+    osiSocklen_t len;
+
+    if (sock->receiveBuffer > 0
+            && setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF,
+                    (char*) &sock->receiveBuffer, sizeof(int)) != 0)
+    {
+        printf("%s:%s: cannot set SO_RCVBUF to %d\n", socketName,
+                functionName, sock->receiveBuffer);
+    }
+    len = sizeof(int);
+    getsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, (char*) &sock->actualBuffer,
+            &len);
+
+    if (sock->busyPoll > 0)
+    {
+#ifdef SO_BUSY_POLL
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL,
+                (char*) &sock->busyPoll, sizeof(int)) != 0)
+#endif
+        {
+            printf("%s:%s: busy polling is not available\n", socketName,
+                    functionName);
+        }
+    }
+
+#ifdef SO_TIMESTAMPNS
+    int on = 1;
+
+    setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPNS, (char*) &on,
+            sizeof(on));
+#endif
+}
+
+static void closeSocket(mpxSocket *sock)
+{
+    if (sock->fd != INVALID_SOCKET)
+    {
+        epicsSocketDestroy(sock->fd);
+        sock->fd = INVALID_SOCKET;
+    }
+    sock->timeout = -1;
+}
+
+asynStatus mpxSocketConnect(mpxSocket *sock)
+{
+    const char *functionName = "mpxSocketConnect";
+    char error[64];
+    SOCKET fd;
+
+    // the reader and the command thread may both get here after an error,
+    // only the first one connects
+    epicsMutexLock(sock->lock);
+    if (sock->fd != INVALID_SOCKET)
+    {
+        epicsMutexUnlock(sock->lock);
+        return asynSuccess;
+    }
+
+    fd = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET)
+    {
+        epicsSocketConvertErrnoToString(error, sizeof(error));
+        printf("%s:%s: cannot create socket: %s\n", socketName,
+                functionName, error);
+        epicsMutexUnlock(sock->lock);
+        return asynError;
+    }
+    sock->fd = fd;
+    setOptions(sock);
+
+    if (connect(sock->fd, (struct sockaddr*) &sock->peer,
+            sizeof(sock->peer)) != 0)
+    {
+        epicsSocketConvertErrnoToString(error, sizeof(error));
+        printf("%s:%s: cannot connect to %s: %s\n", socketName,
+                functionName, sock->address, error);
+        closeSocket(sock);
+        epicsMutexUnlock(sock->lock);
+        return asynDisconnected;
+    }
+    epicsMutexUnlock(sock->lock);
+    return asynSuccess;
+}
+
+void mpxSocketClose(mpxSocket *sock)
+{
+    epicsMutexLock(sock->lock);
+    closeSocket(sock);
+    epicsMutexUnlock(sock->lock);
+}
+
+static void setTimeout(mpxSocket *sock, double timeout)
+{
+#ifdef _WIN32
+    DWORD ms = (DWORD) (timeout * 1000);
+
+    setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, (char*) &ms, sizeof(ms));
+#else
+    struct timeval tv;
+
+    tv.tv_sec = (long) timeout;
+    tv.tv_usec = (long) ((timeout - tv.tv_sec) * 1e6);
+    setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, (char*) &tv, sizeof(tv));
+#endif
+    sock->timeout = timeout;
+}
+
+/** a read that also picks up the kernel receive time where there is one */
+static int receive(mpxSocket *sock, char *dst, size_t len, int flags)
+{
+#ifdef SO_TIMESTAMPNS
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    int n;
+
+    iov.iov_base = dst;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    n = recvmsg(sock->fd, &msg, flags);
+    for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            sock->receiveTime = (epicsUInt64) ts.tv_sec * 1000000000u
+                    + ts.tv_nsec;
+        }
+    }
+    return n;
+#else
+    return recv(sock->fd, dst, (int) len, flags);
+#endif
+}
+
+asynStatus mpxSocketRead(mpxSocket *sock, char *dst, size_t len,
+        size_t *nread, double timeout, int waitAll)
+{
+    const char *functionName = "mpxSocketRead";
+    char error[64];
+    int n;
+
+    // only the reader closes the socket, so it cannot go while in recv
+    *nread = 0;
+    if (sock->fd == INVALID_SOCKET && mpxSocketConnect(sock) != asynSuccess)
+        return asynDisconnected;
+
+    if (timeout != sock->timeout)
+        setTimeout(sock, timeout);
+
+    n = receive(sock, dst, len, waitAll ? MSG_WAITALL : 0);
+    if (n > 0)
+    {
+        // less than len if the timeout cut a MSG_WAITALL short
+        *nread = n;
+        return asynSuccess;
+    }
+    if (n < 0 && (SOCKERRNO == SOCK_EWOULDBLOCK || SOCKERRNO == SOCK_EINTR
+            || SOCKERRNO == SOCK_ETIMEDOUT))
+    {
+        return asynTimeout;
+    }
+
+    if (n == 0)
+    {
+        printf("%s:%s: %s closed the connection\n", socketName, functionName,
+                sock->address);
+    }
+    else
+    {
+        epicsSocketConvertErrnoToString(error, sizeof(error));
+        printf("%s:%s: error reading from %s: %s\n", socketName,
+                functionName, sock->address, error);
+    }
+    mpxSocketClose(sock);
+    return asynError;
+}
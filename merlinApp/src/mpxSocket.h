@@ -0,0 +1,57 @@
+/*
+ * mpxSocket.h
+ *
+ * Direct TCP socket for the data channel.
+ *
+ * An alternative to reading the data channel through a drvAsynIPPort,
+ * which costs a queued request, the port lock and a copy for every read.
+ * The socket is read and closed by the reader in merlinTask, the command
+ * thread connects it again while recovering the connection. Large reads use
+ * MSG_WAITALL so that a frame body arrives in one call straight into its
+ * buffer. The receive buffer size and busy polling can be set, and on
+ * Linux the kernel time at which the data arrived is kept.
+ *
+ * Selected by the dataSocket argument of merlinDetectorConfig:
+ *     host:port[,rcvbuf=<bytes>][,busypoll=<us>]
+ */
+
+#ifndef MPXSOCKET_H_
+#define MPXSOCKET_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <osiSock.h>
+#include <asynDriver.h>
+
+typedef struct
+{
+    char address[256];      // host:port as given
+    struct sockaddr_in peer;
+    int receiveBuffer;      // SO_RCVBUF to ask for, 0 for the default
+    int actualBuffer;       // what the kernel gave
+    int busyPoll;           // SO_BUSY_POLL in us, 0 for none
+    SOCKET fd;              // INVALID_SOCKET when not connected
+    double timeout;         // receive timeout that is set on fd
+    epicsUInt64 receiveTime;    // kernel time of the last read in ns, or 0
+    epicsMutexId lock;      // held to connect or close fd, not to read
+} mpxSocket;
+
+/** Parses the options, returns NULL if they are not valid. The socket is
+ * connected by the first read */
+mpxSocket* mpxSocketCreate(const char *options);
+
+/** Connects to the server, does nothing if it is connected already */
+asynStatus mpxSocketConnect(mpxSocket *sock);
+
+void mpxSocketClose(mpxSocket *sock);
+
+/** Reads up to len bytes, or exactly len unless the timeout expires when
+ * waitAll is set, connecting first if need be. Returns asynTimeout if
+ * nothing arrived, asynDisconnected if it could not connect and asynError
+ * if the connection has gone, after which it is closed */
+asynStatus mpxSocketRead(mpxSocket *sock, char *dst, size_t len,
+        size_t *nread, double timeout, int waitAll);
+
+#endif /* MPXSOCKET_H_ */
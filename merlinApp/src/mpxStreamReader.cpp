@@ -0,0 +1,248 @@
+/* mpxStreamReader.cpp
+ *
+ * Buffered reader for the MPX framed byte stream, see mpxStreamReader.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <asynOctetSyncIO.h>
+
+#include "mpxStreamReader.h"
+
+static const char *readerName = "mpxStreamReader";
+
+/** Remainders of at least this many bytes are read straight into the
+ * caller's buffer rather than via the stream buffer */
+#define DIRECT_READ_MIN 4096
+
+mpxStreamReader::mpxStreamReader(asynUser* pasynUser, size_t capacity)
+{
+    this->pasynUser = pasynUser;
+    this->sock = NULL;
+    this->capacity = capacity;
+    this->buffer = (char*) calloc(capacity, 1);
+    this->head = 0;
+    this->tail = 0;
+}
+
+mpxStreamReader::mpxStreamReader(mpxSocket* sock, size_t capacity)
+{
+    this->pasynUser = NULL;
+    this->sock = sock;
+    this->capacity = capacity;
+    this->buffer = (char*) calloc(capacity, 1);
+    this->head = 0;
+    this->tail = 0;
+}
+
+mpxStreamReader::~mpxStreamReader()
+{
+    free(buffer);
+}
+
+/** a single read from the port, returns whatever is available up to len,
+ * or waits for all of it from a socket if waitAll is set */
+asynStatus mpxStreamReader::readPort(char* dst, size_t len, size_t* nread,
+        double timeout, int waitAll)
+{
+    const char *functionName = "readPort";
+    asynStatus status;
+    int eomReason;
+
+    if (sock != NULL)
+        return mpxSocketRead(sock, dst, len, nread, timeout, waitAll);
+
+    *nread = 0;
+    status = pasynOctetSyncIO->read(pasynUser, dst, len, timeout, nread,
+            &eomReason);
+    if (status == asynSuccess && *nread == 0)
+    {
+        status = asynError;
+    }
+    if (status != asynSuccess && status != asynTimeout)
+    {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s, status=%d error reading from port\n", readerName,
+                functionName, status);
+    }
+    return status;
+}
+
+/** makes sure at least len bytes are buffered, reading as much as the port
+ * will give at a time */
+asynStatus mpxStreamReader::fill(size_t len, double timeout)
+{
+    asynStatus status;
+    size_t nread;
+
+    if (len > capacity)
+        return asynError;
+
+    if (tail - head >= len)
+        return asynSuccess;
+
+    // make room at the end of the buffer by moving the unread data down
+    if (head + len > capacity || tail == capacity)
+    {
+        memmove(buffer, buffer + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    while (tail - head < len)
+    {
+        status = readPort(buffer + tail, capacity - tail, &nread, timeout,
+                0);
+        if (status != asynSuccess)
+        {
+            if (status != asynTimeout)
+                flush();
+            return status;
+        }
+        tail += nread;
+    }
+
+    return asynSuccess;
+}
+
+asynStatus mpxStreamReader::sync(const char* pattern, size_t len,
+        size_t* skipped, double timeout)
+{
+    asynStatus status;
+    const char *p;
+    size_t avail;
+
+    *skipped = 0;
+
+    while (1)
+    {
+        status = fill(len, timeout);
+        if (status != asynSuccess)
+            return status;
+
+        // scan the buffered bytes for the first byte of the pattern
+        avail = tail - head;
+        p = (const char*) memchr(buffer + head, pattern[0], avail);
+        while (p != NULL)
+        {
+            size_t pos = p - buffer;
+            if (tail - pos < len)
+            {
+                // possible partial match at the end, keep it and read more
+                break;
+            }
+            if (memcmp(p, pattern, len) == 0)
+            {
+                *skipped += pos - head;
+                head = pos;
+                return asynSuccess;
+            }
+            p = (const char*) memchr(p + 1, pattern[0], tail - pos - 1);
+        }
+
+        if (p == NULL)
+        {
+            *skipped += avail;
+            head = tail = 0;
+        }
+        else
+        {
+            *skipped += (p - buffer) - head;
+            head = p - buffer;
+            // the partial match is less than len bytes so fill must read
+            status = fill(tail - head + 1, timeout);
+            if (status != asynSuccess)
+                return status;
+        }
+    }
+}
+
+asynStatus mpxStreamReader::peek(size_t len, const char** view,
+        double timeout)
+{
+    asynStatus status;
+
+    *view = NULL;
+    status = fill(len, timeout);
+    if (status != asynSuccess)
+        return status;
+
+    *view = buffer + head;
+    return asynSuccess;
+}
+
+void mpxStreamReader::consume(size_t len)
+{
+    if (len > tail - head)
+        len = tail - head;
+    head += len;
+    if (head == tail)
+        head = tail = 0;
+}
+
+asynStatus mpxStreamReader::readInto(char* dst, size_t len, double timeout)
+{
+    asynStatus status;
+    size_t chunk, nread;
+
+    while (len > 0)
+    {
+        // hand over whatever is already buffered
+        chunk = tail - head < len ? tail - head : len;
+        if (chunk > 0)
+        {
+            memcpy(dst, buffer + head, chunk);
+            consume(chunk);
+            dst += chunk;
+            len -= chunk;
+            continue;
+        }
+
+        if (len >= DIRECT_READ_MIN)
+        {
+            status = readPort(dst, len, &nread, timeout, 1);
+            if (status != asynSuccess)
+                return status;
+            dst += nread;
+            len -= nread;
+        }
+        else
+        {
+            // short remainder, read it along with whatever follows
+            status = fill(len, timeout);
+            if (status != asynSuccess)
+                return status;
+        }
+    }
+
+    return asynSuccess;
+}
+
+asynStatus mpxStreamReader::discard(size_t len, double timeout)
+{
+    asynStatus status;
+    size_t chunk;
+
+    while (len > 0)
+    {
+        chunk = tail - head < len ? tail - head : len;
+        if (chunk == 0)
+        {
+            chunk = len < capacity ? len : capacity;
+            status = fill(chunk, timeout);
+            if (status != asynSuccess)
+                return status;
+        }
+        consume(chunk);
+        len -= chunk;
+    }
+
+    return asynSuccess;
+}
+
+void mpxStreamReader::flush()
+{
+    head = tail = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * mpxStreamReader.h
+ *
+ * Buffered reader for the MPX framed byte stream on a Labview socket.
+ *
+ * Data is pulled from the asyn octet port, or a direct socket (see
+ * mpxSocket.h), in large blocks and the MPX frame
+ * prefix, headers and short bodies are parsed straight out of the buffer.
+ * The buffer is linear (compacted when the read position gets near the end)
+ * so that any run of up to 'capacity' bytes can be handed out as a single
+ * contiguous view.
+ */
+
+#ifndef MPXSTREAMREADER_H_
+#define MPXSTREAMREADER_H_
+
+#include <stddef.h>
+
+#include <asynDriver.h>
+
+#include "mpxSocket.h"
+
+class mpxStreamReader
+{
+public:
+    mpxStreamReader(asynUser* pasynUser, size_t capacity);
+    mpxStreamReader(mpxSocket* sock, size_t capacity);
+    ~mpxStreamReader();
+
+    /** Discards data until the stream starts with pattern, skipped is set to
+     * the number of bytes thrown away */
+    asynStatus sync(const char* pattern, size_t len, size_t* skipped,
+            double timeout);
+    /** Sets view to the next len bytes of the stream, without consuming them.
+     * The view is valid until the next call on this reader. */
+    asynStatus peek(size_t len, const char** view, double timeout);
+    /** Consumes len bytes that have been peeked */
+    void consume(size_t len);
+    /** Reads exactly len bytes into dst. Buffered bytes are copied, large
+     * remainders are read from the port directly into dst */
+    asynStatus readInto(char* dst, size_t len, double timeout);
+    /** Reads and throws away len bytes */
+    asynStatus discard(size_t len, double timeout);
+    /** Throws away everything buffered e.g. after a connection error */
+    void flush();
+
+    size_t buffered() const { return tail - head; }
+    size_t getCapacity() const { return capacity; }
+    /** kernel time of the last read in ns since the epoch, 0 if not known */
+    epicsUInt64 receiveTime() const { return sock ? sock->receiveTime : 0; }
+
+private:
+    asynStatus fill(size_t len, double timeout);
+    asynStatus readPort(char* dst, size_t len, size_t* nread, double timeout,
+            int waitAll);
+
+    asynUser* pasynUser;
+    mpxSocket* sock;        // read from instead of the port if not NULL
+    char* buffer;
+    size_t capacity;
+    size_t head;    // next unread byte
+    size_t tail;    // end of the buffered data
+};
+
+#endif /* MPXSTREAMREADER_H_ */
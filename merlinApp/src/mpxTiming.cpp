@@ -0,0 +1,114 @@
+/* mpxTiming.cpp
+ *
+ * Per stage timing histograms, see mpxTiming.h
+ */
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "mpxTiming.h"
+
+const char *mpxStageNames[MPX_NUM_STAGES] =
+{ "WAIT", "RECEIVE", "HEADER", "CONVERT", "CORRECT", "ATTRIBUTES",
+        "CALLBACKS" };
+
+#ifdef _WIN32
+epicsUInt64 mpxTimingNow()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (epicsUInt64) ((double) now.QuadPart * 1e9 / frequency.QuadPart);
+}
+#endif
+
+/** index of the most significant bit set in x, x > 0 */
+static inline int topBit(epicsUInt64 x)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(x);
+#else
+    int n = 0;
+
+    while (x >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+/** times below 2^SUB_BITS ns have a bucket each, above that each octave is
+ * split into 2^SUB_BITS buckets by the bits below the top one */
+static inline int bucket(epicsUInt64 ns)
+{
+    int top;
+    int index;
+
+    if (ns < (1u << MPX_TIMING_SUB_BITS))
+        return (int) ns;
+
+    top = topBit(ns);
+    index = ((top - MPX_TIMING_SUB_BITS + 1) << MPX_TIMING_SUB_BITS)
+            + (int) ((ns >> (top - MPX_TIMING_SUB_BITS))
+                    & ((1u << MPX_TIMING_SUB_BITS) - 1));
+    return index < MPX_TIMING_BUCKETS ? index : MPX_TIMING_BUCKETS - 1;
+}
+
+/** the middle of the times that go in a bucket */
+static double bucketValue(int index)
+{
+    int octave = index >> MPX_TIMING_SUB_BITS;
+    int sub = index & ((1 << MPX_TIMING_SUB_BITS) - 1);
+    double width;
+
+    if (octave == 0)
+        return index;
+
+    width = (double) ((epicsUInt64) 1 << (octave - 1));
+    return ((1 << MPX_TIMING_SUB_BITS) + sub) * width + width / 2;
+}
+
+void mpxTimingClear(mpxTimingHistogram *h)
+{
+    memset(h, 0, sizeof(mpxTimingHistogram));
+}
+
+void mpxTimingAdd(mpxTimingHistogram *h, epicsUInt64 ns)
+{
+    h->count[bucket(ns)]++;
+    h->total++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+double mpxTimingPercentile(const mpxTimingHistogram *h, double fraction)
+{
+    epicsUInt32 target;
+    epicsUInt32 seen = 0;
+    double value;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+
+    target = (epicsUInt32) (fraction * h->total + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < MPX_TIMING_BUCKETS; i++)
+    {
+        seen += h->count[i];
+        if (seen >= target)
+        {
+            // the true value cannot be above the largest time seen
+            value = bucketValue(i);
+            return value < h->max ? value : (double) h->max;
+        }
+    }
+    return (double) h->max;
+}
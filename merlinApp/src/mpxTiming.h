@@ -0,0 +1,74 @@
+/*
+ * mpxTiming.h
+ *
+ * Cheap per stage timing of the acquisition pipeline.
+ *
+ * Each frame carries the time in ns that it spent in each stage, taken from
+ * a monotonic clock. When the frame is published the times are added to a
+ * histogram for each stage with buckets an eighth of an octave wide (about
+ * 9% resolution), which only costs a few shifts and an increment, so the
+ * timing can be left on. The percentiles are read from the histograms once
+ * per reporting interval and the histograms cleared for the next.
+ */
+
+#ifndef MPXTIMING_H_
+#define MPXTIMING_H_
+
+#include <epicsTypes.h>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/** The stages of a frame, in the order they happen */
+typedef enum
+{
+    mpxStageWait,           // waiting in mpxReadHeader for the frame
+    mpxStageReceive,        // reading the body from the data channel
+    mpxStageHeader,         // decoding the MQ1 header
+    mpxStageConvert,        // copying / converting the pixels
+    mpxStageCorrect,        // flat field, bad pixels and chip assembly
+    mpxStageAttributes,     // header attributes and getAttributes
+    mpxStageCallbacks,      // doCallbacksGenericPointer
+    MPX_NUM_STAGES
+} mpxStage;
+
+/** Names of the stages as used in the parameter names e.g. TIMING_WAIT_P50 */
+extern const char *mpxStageNames[MPX_NUM_STAGES];
+
+/** 8 buckets per octave up to 2^40 ns (about 18 minutes) */
+#define MPX_TIMING_SUB_BITS 3
+#define MPX_TIMING_MAX_BITS 40
+#define MPX_TIMING_BUCKETS \
+    (((MPX_TIMING_MAX_BITS - MPX_TIMING_SUB_BITS + 1) << MPX_TIMING_SUB_BITS))
+
+typedef struct
+{
+    epicsUInt32 count[MPX_TIMING_BUCKETS];
+    epicsUInt32 total;
+    epicsUInt64 max;
+} mpxTimingHistogram;
+
+/** The monotonic clock in ns */
+#ifdef _WIN32
+epicsUInt64 mpxTimingNow();
+#else
+static inline epicsUInt64 mpxTimingNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (epicsUInt64) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+void mpxTimingClear(mpxTimingHistogram *h);
+
+/** Adds a time of ns to the histogram */
+void mpxTimingAdd(mpxTimingHistogram *h, epicsUInt64 ns);
+
+/** The time in ns below which fraction (0 to 1) of the times fall, 0 if the
+ * histogram is empty */
+double mpxTimingPercentile(const mpxTimingHistogram *h, double fraction);
+
+#endif /* MPXTIMING_H_ */